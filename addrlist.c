@@ -0,0 +1,561 @@
+/*
+ *   This software is Copyright 2011 by Sean Groarke <sgroarke@gmail.com>
+ *   All rights reserved.
+ *
+ *   This file is part of npd6.
+ *
+ *   npd6 is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   npd6 is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with npd6.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* $Id$
+ * $HeadURL$
+ */
+
+/*
+ * The black/whitelist as a whole. Single addresses go in lSet (see
+ * addrset.c); addr/len prefixes into an LPM table (see lpm.c), and
+ * start-end ranges into a sorted array of non-overlapping intervals.
+ * addrlist_match() checks all three, and also a binary list file
+ * (NPD6LISTFILE, see listfile.h) if there is one.
+ *
+ * A blacklist's single addresses, in lSet and the file, also go into a
+ * blocked Bloom filter. Nearly every NS is for a target which isn't
+ * blacklisted, and the filter can say so from one cache line, without
+ * the exact lookups.
+ *
+ * Blocks are gathered as the config is read, and only turned into their
+ * lookup structures by addrlist_build() once it has all been read.
+ */
+
+#include "includes.h"
+#include "npd6.h"
+#include "listfile.h"
+#include <sys/mman.h>
+
+// An address as two host-order words, so ranges compare as integers
+struct addrKey {
+    uint64_t        hi;
+    uint64_t        lo;
+};
+
+struct addrRange {
+    struct addrKey  start;
+    struct addrKey  end;
+};
+
+static struct npd6Prefix    *listPrefixes;
+static unsigned int         listPrefixCount;
+static struct lpmTable      *listLpm;
+static struct addrRange     *listRanges;
+static unsigned int         listRangeCount;
+
+// A mapped list file. The one in use is only ever replaced whole, by
+// addrlist_build(), once its replacement is mapped.
+struct listFile {
+    void                    *map;
+    size_t                  size;
+    const struct in6_addr   *addrs;     // 1-based, see listfile.h
+    uint64_t                count;
+};
+static struct listFile      *listFile;
+static struct listFile      *listFileNext;  // Loaded, for addrlist_build()
+
+// Blocked Bloom filter: each address sets one bit in each of the eight
+// words of one cache-line block. Sized up to a power of two blocks.
+#define BLOOM_BLOCKWORDS    8
+#define BLOOM_BITSPERKEY    16
+#define BLOOM_TESTPROBES    65536   // For estimating the false positive rate
+
+struct bloomBlock {
+    uint64_t    word[BLOOM_BLOCKWORDS];
+} __attribute__((aligned(64)));
+
+static struct bloomBlock    *listBloom;
+static unsigned int         bloomBlocks;    // A power of 2
+static unsigned long        bloomKeys;
+static double               bloomEstFPR;
+
+
+static inline void addrToKey(const struct in6_addr *addr, struct addrKey *key)
+{
+    memcpy(&key->hi, &addr->s6_addr[0], sizeof(key->hi));
+    memcpy(&key->lo, &addr->s6_addr[8], sizeof(key->lo));
+    key->hi = be64toh(key->hi);
+    key->lo = be64toh(key->lo);
+}
+
+static inline int keyLE(const struct addrKey *a, const struct addrKey *b)
+{
+    return (a->hi < b->hi) | ((a->hi == b->hi) & (a->lo <= b->lo));
+}
+
+static int rangeCompare(const void *pa, const void *pb)
+{
+    const struct addrRange *a = pa, *b = pb;
+
+    if (a->start.hi != b->start.hi)
+        return (a->start.hi < b->start.hi) ? -1 : 1;
+    if (a->start.lo != b->start.lo)
+        return (a->start.lo < b->start.lo) ? -1 : 1;
+    return 0;
+}
+
+// Is the address in one of the ranges? Finds the last range starting at
+// or before it without branching on the comparisons, then checks its end.
+static int rangeFind(const struct addrKey *key)
+{
+    const struct addrRange  *base = listRanges;
+    unsigned int            n = listRangeCount, half;
+
+    while (n > 1)
+    {
+        half = n / 2;
+        base = keyLE(&base[half].start, key) ? &base[half] : base;
+        n -= half;
+    }
+    return keyLE(&base->start, key) & keyLE(key, &base->end);
+}
+
+
+// Is the address in the list file? A branch-free descent of the implicit
+// tree, ending with k just past the path to the smallest address >= key.
+static int listFileFind(const struct listFile *file, const struct addrKey *key)
+{
+    const struct in6_addr   *addrs = file->addrs;
+    uint64_t                k = 1;
+    struct addrKey          node;
+
+    while (k <= file->count)
+    {
+        __builtin_prefetch(&addrs[8 * k]);
+        __builtin_prefetch(&addrs[8 * k + 4]);
+        addrToKey(&addrs[k], &node);
+        k = 2 * k + !keyLE(key, &node);     // node < key
+    }
+    k >>= __builtin_ffsll(~k);
+    if (k == 0)
+        return 0;
+    addrToKey(&addrs[k], &node);
+    return (node.hi == key->hi) & (node.lo == key->lo);
+}
+
+static void listFileClose(struct listFile *file)
+{
+    if (file == NULL)
+        return;
+    munmap(file->map, file->size);
+    free(file);
+}
+
+// Odd multipliers, one per block word, to pick each word's bit
+static const uint32_t bloomSalt[BLOOM_BLOCKWORDS] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+static inline uint64_t bloomHash(const struct in6_addr *addr)
+{
+    uint64_t    a, b, h;
+
+    memcpy(&a, &addr->s6_addr[0], sizeof(a));
+    memcpy(&b, &addr->s6_addr[8], sizeof(b));
+    h = (a * 0xc2b2ae3d27d4eb4fULL) ^ b;
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 32;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+static inline void bloomAdd(uint64_t h)
+{
+    struct bloomBlock   *block = &listBloom[(h >> 32) & (bloomBlocks - 1)];
+    unsigned int        loop;
+
+    for (loop = 0; loop < BLOOM_BLOCKWORDS; loop++)
+        block->word[loop] |= 1ULL << (((uint32_t)h * bloomSalt[loop]) >> 26);
+}
+
+// 0 if the address is definitely not in the filter
+static inline int bloomMaybe(uint64_t h)
+{
+    const struct bloomBlock *block = &listBloom[(h >> 32) & (bloomBlocks - 1)];
+    uint64_t                missing = 0;
+    unsigned int            loop;
+
+    for (loop = 0; loop < BLOOM_BLOCKWORDS; loop++)
+        missing |= ~block->word[loop] & (1ULL << (((uint32_t)h * bloomSalt[loop]) >> 26));
+    return missing == 0;
+}
+
+// Build the filter over lSet and the list file, if it's worth having
+static void bloomBuild(void)
+{
+    unsigned long           keys = lSet.count, loop;
+    unsigned int            hits = 0;
+    struct addrIter         iter = { 0, 0 };
+    struct in6_addr         entry;
+    uint64_t                probe = 0x9e3779b97f4a7c15ULL;
+
+    free(listBloom);
+    listBloom = NULL;
+    if (listFile)
+        keys += listFile->count;
+    if ( (listType != BLACKLIST) || (keys == 0) )
+        return;
+
+    for (bloomBlocks = 1; (unsigned long)bloomBlocks * 512 < keys * BLOOM_BITSPERKEY; bloomBlocks *= 2)
+        ;
+    listBloom = aligned_alloc(sizeof(struct bloomBlock), bloomBlocks * sizeof(struct bloomBlock));
+    if (listBloom == NULL)
+    {
+        flog(LOG_ERR, "No memory for the blacklist Bloom filter - carrying on without");
+        return;
+    }
+    memset(listBloom, 0, bloomBlocks * sizeof(struct bloomBlock));
+    bloomKeys = keys;
+
+    while (addrset_next(&lSet, &iter, &entry))
+        bloomAdd(bloomHash(&entry));
+    if (listFile)
+    {
+        for (loop = 1; loop <= listFile->count; loop++)
+            bloomAdd(bloomHash(&listFile->addrs[loop]));
+    }
+
+    // Estimate the false positive rate with random hashes
+    for (loop = 0; loop < BLOOM_TESTPROBES; loop++)
+    {
+        probe ^= probe << 13;
+        probe ^= probe >> 7;
+        probe ^= probe << 17;
+        hits += bloomMaybe(probe);
+    }
+    bloomEstFPR = (double)hits / BLOOM_TESTPROBES;
+
+    flog(LOG_INFO, "Blacklist Bloom filter: %lu addresses, %u KB, estimated false positives %.3f%%",
+         bloomKeys, bloomBlocks * (unsigned int)sizeof(struct bloomBlock) / 1024,
+         bloomEstFPR * 100);
+}
+
+
+/*****************************************************************************
+ * addrlist_load_file
+ *      Map a binary list file built by npd6list. It only comes into use
+ *      at addrlist_build(), so the one in use carries on until then.
+ *
+ * Inputs:
+ *  The file's name.
+ *
+ * Return:
+ *      0 if mapped, -1 if it couldn't be or isn't a valid list file.
+ */
+int addrlist_load_file(char *name)
+{
+    struct listFile         *file;
+    struct listFileHeader   *header;
+    struct stat             st;
+    int                     fd;
+
+    if (listFileNext)
+    {
+        flog(LOG_ERR, "Only one addrlistFile allowed");
+        return -1;
+    }
+
+    fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        flog(LOG_ERR, "Can't open addrlistFile %s: %s", name, strerror(errno));
+        return -1;
+    }
+    if ( fstat(fd, &st) || (st.st_size < (off_t)LISTFILE_SIZE(0)) )
+    {
+        flog(LOG_ERR, "addrlistFile %s is too short", name);
+        close(fd);
+        return -1;
+    }
+
+    file = calloc(1, sizeof(struct listFile));
+    if (file == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+    file->size = st.st_size;
+    file->map = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (file->map == MAP_FAILED)
+    {
+        flog(LOG_ERR, "Can't map addrlistFile %s: %s", name, strerror(errno));
+        free(file);
+        return -1;
+    }
+
+    header = file->map;
+    if ( memcmp(header->magic, LISTFILE_MAGIC, sizeof(header->magic)) ||
+         (header->version != LISTFILE_VERSION) ||
+         (header->headerSize != sizeof(struct listFileHeader)) ||
+         (LISTFILE_SIZE(header->count) != file->size) )
+    {
+        flog(LOG_ERR, "addrlistFile %s is not a valid npd6list file", name);
+        munmap(file->map, file->size);
+        free(file);
+        return -1;
+    }
+    file->count = header->count;
+    file->addrs = (const struct in6_addr *)(header + 1);
+    madvise(file->map, file->size, MADV_WILLNEED);
+
+    flog(LOG_INFO, "addrlistFile %s: %llu addresses", name,
+         (unsigned long long)file->count);
+    listFileNext = file;
+    return 0;
+}
+
+
+/*****************************************************************************
+ * addrlist_add_block
+ *      Record an addrlist entry which is a prefix (addr/len) or a range
+ *      (start-end) rather than a single address. A /128 prefix or a
+ *      one-address range just goes in lSet.
+ *
+ * Inputs:
+ *  The entry as written in the config file.
+ *
+ * Return:
+ *      0 if recorded, -1 if it's not valid.
+ */
+int addrlist_add_block(char *entry)
+{
+    char                *copy = strdupa(entry);
+    char                *sep, *end;
+    struct in6_addr     first, last;
+    struct addrRange    range;
+    long                len;
+    void                *grown;
+
+    if ( (sep = strchr(copy, '/')) )
+    {
+        *sep = '\0';
+        len = strtol(sep + 1, &end, 10);
+        if ( (*end != '\0') || (end == sep + 1) || (len < 0) || (len > 128) ||
+             (build_addr(copy, &first) != 1) )
+            return -1;
+        if (len == 128)
+        {
+            storeListEntry(&first);
+            return 0;
+        }
+        grown = realloc(listPrefixes, (listPrefixCount + 1) * sizeof(struct npd6Prefix));
+        if (grown == NULL)
+            return -1;
+        listPrefixes = grown;
+        listPrefixes[listPrefixCount].prefix = first;
+        listPrefixes[listPrefixCount].len = len;
+        listPrefixCount++;
+        flog(LOG_DEBUG, "addrlist prefix %s/%ld", copy, len);
+        return 0;
+    }
+
+    if ( (sep = strchr(copy, '-')) )
+    {
+        *sep = '\0';
+        if ( (build_addr(copy, &first) != 1) || (build_addr(sep + 1, &last) != 1) )
+            return -1;
+        addrToKey(&first, &range.start);
+        addrToKey(&last, &range.end);
+        if ( !keyLE(&range.start, &range.end) )
+        {
+            flog(LOG_ERR, "addrlist range %s ends before it starts", entry);
+            return -1;
+        }
+        if ( !memcmp(&first, &last, sizeof(first)) )
+        {
+            storeListEntry(&first);
+            return 0;
+        }
+        grown = realloc(listRanges, (listRangeCount + 1) * sizeof(struct addrRange));
+        if (grown == NULL)
+            return -1;
+        listRanges = grown;
+        listRanges[listRangeCount++] = range;
+        flog(LOG_DEBUG, "addrlist range %s to %s", copy, sep + 1);
+        return 0;
+    }
+
+    return -1;
+}
+
+
+/*****************************************************************************
+ * addrlist_build
+ *      Once the config has been read, build the LPM table over the
+ *      addrlist prefixes, and sort the ranges, merging any which overlap
+ *      or abut, so that a lookup only ever has one candidate.
+ *
+ * Return:
+ *      0 on success, -1 if the table could not be built.
+ */
+int addrlist_build(void)
+{
+    unsigned int    loop, out;
+    struct addrKey  next;
+
+    if (listPrefixCount)
+    {
+        listLpm = lpm_build(listPrefixes, listPrefixCount);
+        if (listLpm == NULL)
+            return -1;
+    }
+
+    if (listRangeCount)
+    {
+        qsort(listRanges, listRangeCount, sizeof(struct addrRange), rangeCompare);
+        for (loop = 1, out = 0; loop < listRangeCount; loop++)
+        {
+            // The address after the current range's end, if there is one
+            next = listRanges[out].end;
+            if ( ++next.lo == 0 )
+                next.hi++;
+            if ( ((next.hi | next.lo) != 0) && !keyLE(&listRanges[loop].start, &next) )
+                listRanges[++out] = listRanges[loop];
+            else if ( keyLE(&listRanges[out].end, &listRanges[loop].end) )
+                listRanges[out].end = listRanges[loop].end;
+        }
+        listRangeCount = out + 1;
+    }
+
+    // Into service with the new list file, if any, and out with the old.
+    // A reload stops the workers first, and the dispatcher is the one
+    // doing this, so nothing can be looking in the old one.
+    listFileClose(listFile);
+    listFile = listFileNext;
+    listFileNext = NULL;
+
+    bloomBuild();
+
+    if (listPrefixCount || listRangeCount)
+        flog(LOG_INFO, "addrlist: %u addresses, %u prefixes, %u ranges",
+             lSet.count, listPrefixCount, listRangeCount);
+    return 0;
+}
+
+
+/*****************************************************************************
+ * addrlist_match
+ *      Is an address on the addrlist, as itself or in a prefix or range?
+ *
+ * Inputs:
+ *  The address.
+ *
+ * Return:
+ *      1 if so, 0 if not.
+ */
+int addrlist_match(const struct in6_addr *addr)
+{
+    struct listFile *file = listFile;
+    struct addrKey  key;
+    int             maybe = 1;
+
+    addrToKey(addr, &key);
+
+    // The single addresses, unless the Bloom filter rules them out
+    if (listBloom)
+    {
+        self->stats.bloomChecks++;
+        maybe = bloomMaybe(bloomHash(addr));
+    }
+    if (maybe)
+    {
+        if (listBloom)
+            self->stats.bloomPasses++;
+        if ( addrset_find(&lSet, addr) || (file && listFileFind(file, &key)) )
+            return 1;
+        if (listBloom)
+            self->stats.bloomFalsePos++;
+    }
+
+    if ( listLpm && lpm_lookup(listLpm, addr) )
+        return 1;
+    return listRangeCount && rangeFind(&key);
+}
+
+
+// Does the addrlist hold anything which isn't in lSet? If so, the kernel
+// filters can't apply a whitelist, as they only know of lSet.
+int addrlist_blocks(void)
+{
+    return listPrefixCount + listRangeCount + (listFile != NULL);
+}
+
+
+/*****************************************************************************
+ * addrlist_log_stats
+ *      Log the address set's size, and the blacklist Bloom filter's size
+ *      and how it has done, as part of dumpStats().
+ *
+ * Inputs:
+ *  Counters totalled over all threads.
+ *
+ * Return:
+ *      void
+ */
+void addrlist_log_stats(struct npd6Stats *total)
+{
+    unsigned long   members, nonMembers;
+    size_t          bytes;
+
+    if (lSet.count)
+    {
+        bytes = addrset_memory(&lSet);
+        flog(LOG_INFO, "Addrlist set: %u addresses in %u /64s, %zu bytes, %.1f bytes/address",
+             lSet.count, lSet.groupCount, bytes, (double)bytes / lSet.count);
+    }
+
+    if (listBloom == NULL)
+        return;
+
+    // Passes are members plus false positives
+    members = total->bloomPasses - total->bloomFalsePos;
+    nonMembers = total->bloomChecks - members;
+    flog(LOG_INFO, "Blacklist Bloom filter: %lu addresses in %u KB, estimated false positives %.3f%%",
+         bloomKeys, bloomBlocks * (unsigned int)sizeof(struct bloomBlock) / 1024,
+         bloomEstFPR * 100);
+    flog(LOG_INFO, "  %lu checked, %lu ruled out, %lu false positives (%.3f%% of non-members)",
+         total->bloomChecks, total->bloomChecks - total->bloomPasses, total->bloomFalsePos,
+         nonMembers ? 100.0 * total->bloomFalsePos / nonMembers : 0.0);
+}
+
+
+// Throw the addrlist away, ready for a config (re)load. The list file
+// stays in use until addrlist_build() replaces it.
+void addrlist_free(void)
+{
+    listFileClose(listFileNext);
+    listFileNext = NULL;
+    free(listBloom);
+    listBloom = NULL;
+
+    addrset_free(&lSet);
+    lpm_free(listLpm);
+    listLpm = NULL;
+    free(listPrefixes);
+    listPrefixes = NULL;
+    listPrefixCount = 0;
+    free(listRanges);
+    listRanges = NULL;
+    listRangeCount = 0;
+}
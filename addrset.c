@@ -0,0 +1,445 @@
+/*
+ *   This software is Copyright 2011 by Sean Groarke <sgroarke@gmail.com>
+ *   All rights reserved.
+ *
+ *   This file is part of npd6.
+ *
+ *   npd6 is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   npd6 is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with npd6.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* $Id$
+ * $HeadURL$
+ */
+
+/*
+ * A set of in6_addrs, grouped by their upper 64 bits. Real lists are
+ * mostly a few /64s with many hosts in each, so each /64 is stored once,
+ * in a group, and each host as just its 64-bit interface identifier
+ * under it. A directory finds a /64's group; a group holds its first
+ * ADDRSET_INLINE IIDs in itself, and past that has a table of its own.
+ *
+ * The directory and the groups' tables are open-addressing hash tables
+ * of 64-bit keys in the style of the "Swiss table". Slots come in groups
+ * of 16, each slot with a control byte: ADDRSET_EMPTY, or 7 bits of the
+ * key's hash. A probe compares its 7 bits against a whole group's control
+ * bytes at once, so keys themselves are only looked at on a likely hit.
+ * Groups of slots are probed triangularly, and one with an empty slot
+ * ends the search.
+ *
+ * Nothing is ever removed, short of freeing the whole set.
+ */
+
+#include "includes.h"
+#include "npd6.h"
+#include "cpu.h"
+
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif
+
+#define ADDRSET_EMPTY       0x80
+#define ADDRSET_MINSLOTS    ADDRSET_GROUP
+#define ADDRSET_ALIGN       64          // Cache line
+
+// A table's block: control bytes, then keys, then (directory only) values
+#define TABLE_KEYS(block, size)     ((uint64_t *)((uint8_t *)(block) + (size)))
+#define TABLE_VALS(block, size)     ((uint32_t *)(TABLE_KEYS(block, size) + (size)))
+
+
+static inline uint64_t keyHash(uint64_t key)
+{
+    // The MurmurHash3 finaliser. IIDs are often consecutive, so it has
+    // to avalanche.
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+#define HASH_TAG(h)         ((uint8_t)((h) & 0x7f))
+#define HASH_GROUP(h)       ((h) >> 7)
+
+static inline void splitAddr(const struct in6_addr *addr, uint64_t *upper, uint64_t *lower)
+{
+    memcpy(upper, &addr->s6_addr[0], sizeof(*upper));
+    memcpy(lower, &addr->s6_addr[8], sizeof(*lower));
+}
+
+
+/*****************************************************************************
+ * probeScalar / probeSse2
+ *      Find a key's slot in a table, one control byte at a time or a
+ *      group at a time.
+ *
+ * Return:
+ *      The slot, or -1 if the key isn't there.
+ */
+static inline long probeScalar(const uint8_t *ctrl, unsigned int size, uint64_t key)
+{
+    uint64_t        h = keyHash(key);
+    const uint64_t  *keys = TABLE_KEYS(ctrl, size);
+    unsigned int    mask = size / ADDRSET_GROUP - 1;
+    unsigned int    group = HASH_GROUP(h) & mask, step, slot, loop;
+
+    for (step = 1; ; step++)
+    {
+        for (loop = 0; loop < ADDRSET_GROUP; loop++)
+        {
+            slot = group * ADDRSET_GROUP + loop;
+            if (ctrl[slot] == ADDRSET_EMPTY)
+                return -1;
+            if ( (ctrl[slot] == HASH_TAG(h)) && (keys[slot] == key) )
+                return slot;
+        }
+        group = (group + step) & mask;
+    }
+}
+
+#ifdef CPU_X86
+__attribute__((target("sse2")))
+static inline long probeSse2(const uint8_t *ctrl, unsigned int size, uint64_t key)
+{
+    uint64_t        h = keyHash(key);
+    const uint64_t  *keys = TABLE_KEYS(ctrl, size);
+    unsigned int    mask = size / ADDRSET_GROUP - 1;
+    unsigned int    group = HASH_GROUP(h) & mask, step, hits, slot;
+    __m128i         tag = _mm_set1_epi8(HASH_TAG(h)), group16;
+
+    for (step = 1; ; step++)
+    {
+        group16 = _mm_load_si128((const __m128i *)&ctrl[group * ADDRSET_GROUP]);
+        hits = _mm_movemask_epi8(_mm_cmpeq_epi8(group16, tag));
+        while (hits)
+        {
+            slot = group * ADDRSET_GROUP + __builtin_ctz(hits);
+            if (keys[slot] == key)
+                return slot;
+            hits &= hits - 1;
+        }
+        // Only EMPTY has the top bit set
+        if (_mm_movemask_epi8(group16))
+            return -1;
+        group = (group + step) & mask;
+    }
+}
+#endif
+
+// Look an address up with one of the above
+#define ADDRSET_FIND_BODY(probe)                                            \
+    struct addrGroup    *group;                                             \
+    uint64_t            upper, lower;                                       \
+    unsigned int        loop;                                               \
+    long                slot;                                               \
+                                                                            \
+    if (set->count == 0)                                                    \
+        return 0;                                                           \
+    splitAddr(addr, &upper, &lower);                                        \
+    slot = probe(set->dirBlock, set->dirSize, upper);                       \
+    if (slot < 0)                                                           \
+        return 0;                                                           \
+    group = &set->groups[TABLE_VALS(set->dirBlock, set->dirSize)[slot]];    \
+    if (group->size == 0)                                                   \
+    {                                                                       \
+        for (loop = 0; loop < group->count; loop++)                         \
+        {                                                                   \
+            if (group->inl[loop] == lower)                                  \
+                return 1;                                                   \
+        }                                                                   \
+        return 0;                                                           \
+    }                                                                       \
+    return probe(group->block, group->size, lower) >= 0;
+
+static int addrset_find_scalar(struct addrSet *set, const struct in6_addr *addr)
+{
+    ADDRSET_FIND_BODY(probeScalar)
+}
+
+#ifdef CPU_X86
+__attribute__((target("sse2")))
+static int addrset_find_sse2(struct addrSet *set, const struct in6_addr *addr)
+{
+    ADDRSET_FIND_BODY(probeSse2)
+}
+#endif
+
+struct cpuVariant addrsetFindVariants[] = {
+    { "scalar", 0,          addrset_find_scalar },
+#ifdef CPU_X86
+    { "sse2",   CPU_SSE2,   addrset_find_sse2 },
+#endif
+    { NULL,     0,          NULL }
+};
+
+
+/*****************************************************************************
+ * addrset_find
+ *      Is an address in the set?
+ *
+ * Inputs:
+ *  The set, and the address.
+ *
+ * Return:
+ *      1 if present, 0 if not.
+ */
+int addrset_find(struct addrSet *set, const struct in6_addr *addr)
+{
+    return addrsetFindImpl(set, addr);
+}
+
+
+// The first free slot on a key's probe sequence. There always is one, as
+// tables are never full.
+static unsigned int tableSlot(uint8_t *ctrl, unsigned int size, uint64_t key)
+{
+    uint64_t        h = keyHash(key);
+    unsigned int    mask = size / ADDRSET_GROUP - 1;
+    unsigned int    group = HASH_GROUP(h) & mask, step, slot, loop;
+
+    for (step = 1; ; step++)
+    {
+        for (loop = 0; loop < ADDRSET_GROUP; loop++)
+        {
+            slot = group * ADDRSET_GROUP + loop;
+            if (ctrl[slot] == ADDRSET_EMPTY)
+            {
+                ctrl[slot] = HASH_TAG(h);
+                return slot;
+            }
+        }
+        group = (group + step) & mask;
+    }
+}
+
+// A new, empty, cache-aligned table block of 'size' slots, a power of 2
+static void *tableAlloc(unsigned int size, int withVals)
+{
+    void    *block;
+    size_t  bytes = size * (1 + sizeof(uint64_t) + (withVals ? sizeof(uint32_t) : 0));
+
+    if ( posix_memalign(&block, ADDRSET_ALIGN, bytes) )
+        return NULL;
+    memset(block, ADDRSET_EMPTY, size);
+    return block;
+}
+
+// Is a table of 'size' slots too full for one more?
+static inline int tableFull(unsigned int count, unsigned int size)
+{
+    return (count + 1) * 8 > size * 7;
+}
+
+// Double the directory, rehashing what's there
+static int dirGrow(struct addrSet *set)
+{
+    unsigned int    size = set->dirSize ? set->dirSize * 2 : ADDRSET_MINSLOTS;
+    void            *block = tableAlloc(size, 1);
+    unsigned int    loop, slot;
+
+    if (block == NULL)
+        return -1;
+    for (loop = 0; loop < set->dirSize; loop++)
+    {
+        if (((uint8_t *)set->dirBlock)[loop] == ADDRSET_EMPTY)
+            continue;
+        slot = tableSlot(block, size, TABLE_KEYS(set->dirBlock, set->dirSize)[loop]);
+        TABLE_KEYS(block, size)[slot] = TABLE_KEYS(set->dirBlock, set->dirSize)[loop];
+        TABLE_VALS(block, size)[slot] = TABLE_VALS(set->dirBlock, set->dirSize)[loop];
+    }
+    free(set->dirBlock);
+    set->dirBlock = block;
+    set->dirSize = size;
+    return 0;
+}
+
+// Give a group a table of its own of 'size' slots, moving its IIDs in
+static int groupGrow(struct addrGroup *group, unsigned int size)
+{
+    void            *block = tableAlloc(size, 0);
+    unsigned int    loop, slot;
+
+    if (block == NULL)
+        return -1;
+    if (group->size == 0)
+    {
+        for (loop = 0; loop < group->count; loop++)
+        {
+            slot = tableSlot(block, size, group->inl[loop]);
+            TABLE_KEYS(block, size)[slot] = group->inl[loop];
+        }
+    }
+    else
+    {
+        for (loop = 0; loop < group->size; loop++)
+        {
+            if (((uint8_t *)group->block)[loop] == ADDRSET_EMPTY)
+                continue;
+            slot = tableSlot(block, size, TABLE_KEYS(group->block, group->size)[loop]);
+            TABLE_KEYS(block, size)[slot] = TABLE_KEYS(group->block, group->size)[loop];
+        }
+        free(group->block);
+    }
+    group->block = block;
+    group->size = size;
+    return 0;
+}
+
+// Find an upper 64 bits' group, adding an empty one if there isn't one
+static struct addrGroup *groupFor(struct addrSet *set, uint64_t upper)
+{
+    struct addrGroup    *grown;
+    unsigned int        slot;
+    long                found = -1;
+
+    if (set->dirSize)
+        found = probeScalar(set->dirBlock, set->dirSize, upper);
+    if (found >= 0)
+        return &set->groups[TABLE_VALS(set->dirBlock, set->dirSize)[found]];
+
+    if (set->groupCount == set->groupAlloc)
+    {
+        grown = realloc(set->groups, (set->groupAlloc ? set->groupAlloc * 2 : 4) *
+                                     sizeof(struct addrGroup));
+        if (grown == NULL)
+            return NULL;
+        set->groups = grown;
+        set->groupAlloc = set->groupAlloc ? set->groupAlloc * 2 : 4;
+    }
+    if ( tableFull(set->groupCount, set->dirSize) && dirGrow(set) )
+        return NULL;
+
+    slot = tableSlot(set->dirBlock, set->dirSize, upper);
+    TABLE_KEYS(set->dirBlock, set->dirSize)[slot] = upper;
+    TABLE_VALS(set->dirBlock, set->dirSize)[slot] = set->groupCount;
+    memset(&set->groups[set->groupCount], 0, sizeof(struct addrGroup));
+    set->groups[set->groupCount].upper = upper;
+    return &set->groups[set->groupCount++];
+}
+
+
+/*****************************************************************************
+ * addrset_add
+ *      Add an address to the set.
+ *
+ * Inputs:
+ *  The set, and the address, which is copied.
+ *
+ * Return:
+ *      1 if added, 0 if already there, -1 if out of memory.
+ */
+int addrset_add(struct addrSet *set, const struct in6_addr *addr)
+{
+    struct addrGroup    *group;
+    uint64_t            upper, lower;
+    unsigned int        slot;
+
+    if (addrset_find(set, addr))
+        return 0;
+
+    splitAddr(addr, &upper, &lower);
+    group = groupFor(set, upper);
+    if (group == NULL)
+        return -1;
+
+    if ( (group->size == 0) && (group->count < ADDRSET_INLINE) )
+        group->inl[group->count] = lower;
+    else
+    {
+        if ( (group->size == 0) || tableFull(group->count, group->size) )
+        {
+            if ( groupGrow(group, group->size ? group->size * 2 : ADDRSET_MINSLOTS) )
+                return -1;
+        }
+        slot = tableSlot(group->block, group->size, lower);
+        TABLE_KEYS(group->block, group->size)[slot] = lower;
+    }
+    group->count++;
+    set->count++;
+    return 1;
+}
+
+
+/*****************************************************************************
+ * addrset_next
+ *      Walk the set, a /64 at a time but otherwise in no particular order.
+ *
+ * Inputs:
+ *  The set, and an iterator which the caller starts zeroed.
+ *
+ * Outputs:
+ *  The next address, and the iterator moved on.
+ *
+ * Return:
+ *      1 if there was a next address, 0 at the end.
+ */
+int addrset_next(struct addrSet *set, struct addrIter *iter, struct in6_addr *addr)
+{
+    struct addrGroup    *group;
+
+    for ( ; iter->group < set->groupCount; iter->group++, iter->slot = 0)
+    {
+        group = &set->groups[iter->group];
+        memcpy(&addr->s6_addr[0], &group->upper, sizeof(group->upper));
+        if (group->size == 0)
+        {
+            if (iter->slot < group->count)
+            {
+                memcpy(&addr->s6_addr[8], &group->inl[iter->slot++], sizeof(uint64_t));
+                return 1;
+            }
+            continue;
+        }
+        while (iter->slot < group->size)
+        {
+            if (((uint8_t *)group->block)[iter->slot++] != ADDRSET_EMPTY)
+            {
+                memcpy(&addr->s6_addr[8], &TABLE_KEYS(group->block, group->size)[iter->slot - 1],
+                       sizeof(uint64_t));
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+// Bytes the set takes up, for the stats
+size_t addrset_memory(struct addrSet *set)
+{
+    size_t          bytes = sizeof(*set);
+    unsigned int    loop;
+
+    bytes += set->dirSize * (1 + sizeof(uint64_t) + sizeof(uint32_t));
+    bytes += set->groupAlloc * sizeof(struct addrGroup);
+    for (loop = 0; loop < set->groupCount; loop++)
+        bytes += set->groups[loop].size * (1 + sizeof(uint64_t));
+    return bytes;
+}
+
+
+// Empty the set and release its memory
+void addrset_free(struct addrSet *set)
+{
+    unsigned int    loop;
+
+    for (loop = 0; loop < set->groupCount; loop++)
+    {
+        if (set->groups[loop].size)
+            free(set->groups[loop].block);
+    }
+    free(set->groups);
+    free(set->dirBlock);
+    memset(set, 0, sizeof(*set));
+}
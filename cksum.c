@@ -0,0 +1,216 @@
+/*
+ *   This software is Copyright 2011 by Sean Groarke <sgroarke@gmail.com>
+ *   All rights reserved.
+ *
+ *   This file is part of npd6.
+ *
+ *   npd6 is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   npd6 is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with npd6.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* $Id$
+ * $HeadURL$
+ */
+
+/*
+ * Ones' complement checksums, with SSE2 and AVX2 versions of the main
+ * loop on x86 and a portable one for everything else. cpu.c picks the
+ * best the CPU can do.
+ */
+
+#include "includes.h"
+#include "npd6.h"
+#include "cksum.h"
+#include "cpu.h"
+
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif
+
+uint32_t    (*cksumImpl)(const unsigned char *, unsigned int, uint64_t);
+
+
+// Fold a 64-bit accumulator down to 32 bits, carries and all
+static inline uint32_t fold64(uint64_t sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    return (uint32_t)sum;
+}
+
+
+/*****************************************************************************
+ * cksum_scalar
+ *      Portable version. Adds 32-bit words into a 64-bit accumulator,
+ *      which can't overflow for any length we could be given.
+ */
+static uint32_t cksum_scalar(const unsigned char *data, unsigned int len, uint64_t sum)
+{
+    uint32_t    word;
+    uint16_t    half;
+    uint8_t     tail[2] = { 0, 0 };
+
+    for ( ; len >= 4; data += 4, len -= 4)
+    {
+        memcpy(&word, data, 4);
+        sum += word;
+    }
+    if (len >= 2)
+    {
+        memcpy(&half, data, 2);
+        sum += half;
+        data += 2;
+        len -= 2;
+    }
+    if (len)
+    {
+        // Odd byte out is the first of a zero-padded 16-bit word
+        tail[0] = *data;
+        memcpy(&half, tail, 2);
+        sum += half;
+    }
+
+    return fold64(sum);
+}
+
+
+#ifdef CPU_X86
+/*****************************************************************************
+ * cksum_sse2 / cksum_avx2
+ *      16 or 32 bytes at a time. Each 32-bit word is split into its two
+ *      16-bit halves, zero-extended and added into 32-bit lanes, which
+ *      are emptied into the 64-bit total before they can overflow. The
+ *      leftovers go to the scalar version.
+ */
+#define CKSUM_LANE_ROUNDS   16384   // Each round adds < 2^17 to a lane
+
+__attribute__((target("sse2")))
+static uint32_t cksum_sse2(const unsigned char *data, unsigned int len, uint64_t sum)
+{
+    const __m128i   mask = _mm_set1_epi32(0xffff);
+    __m128i         acc, vec;
+    uint32_t        lanes[4];
+    unsigned int    rounds;
+
+    while (len >= 16)
+    {
+        acc = _mm_setzero_si128();
+        for (rounds = 0; (len >= 16) && (rounds < CKSUM_LANE_ROUNDS); rounds++)
+        {
+            vec = _mm_loadu_si128((const __m128i *)data);
+            acc = _mm_add_epi32(acc, _mm_and_si128(vec, mask));
+            acc = _mm_add_epi32(acc, _mm_srli_epi32(vec, 16));
+            data += 16;
+            len -= 16;
+        }
+        _mm_storeu_si128((__m128i *)lanes, acc);
+        sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+
+    return cksum_scalar(data, len, sum);
+}
+
+__attribute__((target("avx2")))
+static uint32_t cksum_avx2(const unsigned char *data, unsigned int len, uint64_t sum)
+{
+    const __m256i   mask = _mm256_set1_epi32(0xffff);
+    __m256i         acc, vec;
+    uint32_t        lanes[8];
+    unsigned int    rounds, idx;
+
+    while (len >= 32)
+    {
+        acc = _mm256_setzero_si256();
+        for (rounds = 0; (len >= 32) && (rounds < CKSUM_LANE_ROUNDS); rounds++)
+        {
+            vec = _mm256_loadu_si256((const __m256i *)data);
+            acc = _mm256_add_epi32(acc, _mm256_and_si256(vec, mask));
+            acc = _mm256_add_epi32(acc, _mm256_srli_epi32(vec, 16));
+            data += 32;
+            len -= 32;
+        }
+        _mm256_storeu_si256((__m256i *)lanes, acc);
+        for (idx = 0; idx < 8; idx++)
+            sum += lanes[idx];
+    }
+
+    return cksum_scalar(data, len, sum);
+}
+#endif
+
+
+struct cpuVariant cksumVariants[] = {
+    { "scalar", 0,          cksum_scalar },
+#ifdef CPU_X86
+    { "sse2",   CPU_SSE2,   cksum_sse2 },
+    { "avx2",   CPU_AVX2,   cksum_avx2 },
+#endif
+    { NULL,     0,          NULL }
+};
+
+
+/*****************************************************************************
+ * cksum_partial
+ *      Add some data into a running checksum.
+ *
+ * Inputs:
+ *  data and its length in bytes, and the sum so far (0 to start).
+ *
+ * Return:
+ *      The new sum, not yet folded or complemented.
+ */
+uint32_t cksum_partial(const void *data, unsigned int len, uint32_t sum)
+{
+    return cksumImpl(data, len, sum);
+}
+
+
+/*****************************************************************************
+ * cksum_pseudo6
+ *      Sum of the IPv6 pseudo-header, per RFC 8200 section 8.1.
+ *
+ * Inputs:
+ *  Source and destination addresses, upper-layer length and protocol.
+ *
+ * Return:
+ *      The sum, to be carried on with over the upper-layer data.
+ */
+uint32_t cksum_pseudo6(const struct in6_addr *src, const struct in6_addr *dst,
+                       uint32_t len, uint8_t proto)
+{
+    uint32_t sum = 0;
+
+    sum = cksum_add_addr(sum, src);
+    sum = cksum_add_addr(sum, dst);
+    sum = cksum_add32(sum, htonl(len));
+    return cksum_add32(sum, htonl(proto));
+}
+
+
+/*****************************************************************************
+ * cksum_fold
+ *      Finish a checksum.
+ *
+ * Inputs:
+ *  The sum.
+ *
+ * Return:
+ *      The checksum, ready to store in a header as it is. When checking
+ *      a message including its checksum field, 0 means it was good.
+ */
+uint16_t cksum_fold(uint32_t sum)
+{
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
@@ -0,0 +1,67 @@
+/*
+ *   This software is Copyright 2011 by Sean Groarke <sgroarke@gmail.com>
+ *   All rights reserved.
+ *
+ *   This file is part of npd6.
+ *
+ *   npd6 is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   npd6 is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with npd6.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* $Id$
+ * $HeadURL$
+ */
+
+#ifndef CKSUM_H
+#define CKSUM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
+
+// Internet (ones' complement) checksums. Sums are kept unfolded in 32
+// bits and always over the data as it lies in memory, so the final
+// cksum_fold() gives a value ready to store straight into a header,
+// whatever the host's byte order.
+//
+// A sum may be built up over several pieces, but only the last may be
+// of odd length.
+
+extern uint32_t (*cksumImpl)(const unsigned char *, unsigned int, uint64_t);
+
+uint32_t    cksum_partial(const void *, unsigned int, uint32_t);
+uint32_t    cksum_pseudo6(const struct in6_addr *, const struct in6_addr *, uint32_t, uint8_t);
+uint16_t    cksum_fold(uint32_t);
+
+// Incremental helpers, mainly for patching prebuilt NAs. Adding an
+// address to a sum over a template with zeros in its place gives the
+// same as summing the patched template from scratch.
+static inline uint32_t cksum_add32(uint32_t sum, uint32_t val)
+{
+    sum += val;
+    return sum + (sum < val);
+}
+
+static inline uint32_t cksum_add_addr(uint32_t sum, const struct in6_addr *addr)
+{
+    uint32_t words[4];
+
+    // Addresses in received frames needn't be aligned
+    memcpy(words, addr, sizeof(words));
+    sum = cksum_add32(sum, words[0]);
+    sum = cksum_add32(sum, words[1]);
+    sum = cksum_add32(sum, words[2]);
+    return cksum_add32(sum, words[3]);
+}
+
+#endif
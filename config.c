@@ -27,13 +27,148 @@
 #include "npd6config.h"
 
 #include "expintf.h"
+#include "cpu.h"
+
+static int configLoaded;    // Once the startup read has succeeded
+
+//*******************************************************
+// Per-interface options go to the latest interface declared, or
+// become the defaults if no interface has been declared yet.
+static struct npd6IfOptions *ifOptions(void)
+{
+    if (interfaceCount)
+        return &interfaces[interfaceCount-1].opts;
+    return &ifDefaults;
+}
+
+//*******************************************************
+// Parse a prefix as given to NPD6PREFIX or NPD6EXTRAPREFIX, e.g. 1:2:3::
+// or 1:2:3::/12, into its padded string, binary and mask length forms.
+static int parsePrefix(char *token, char *addrStr, struct in6_addr *prefixaddr, int *masklen)
+{
+    char    *slashMarker;
+    int     prefixaddrlen;
+
+    strncpy( addrStr, token, INET6_ADDRSTRLEN);
+    flog(LOG_DEBUG, "Raw prefix: %s", addrStr);
+    // The prefix may be optionally specified with a mask.
+    // e.g. 1:2:3:: or 1:2:3::/12
+    slashMarker = strchr( addrStr, '/');
+    *masklen = NOMASK;
+    if (slashMarker != NULL)
+    {
+        // We found a mask marker
+        *masklen = atoi(slashMarker + 1);
+        // Re-terminate prefix
+        flog(LOG_DEBUG2, "Pre: %s", addrStr);
+        slashMarker[0] = '\0';
+        flog(LOG_DEBUG2, "Post: %s", addrStr);
+    }
+
+    // We need to pad it up and record the length in bits
+    prefixaddrlen = prefixset(addrStr);
+    flog(LOG_INFO, "Padded prefix: %s, length = %d", addrStr, prefixaddrlen);
+    if ( prefixaddrlen <= 0 )
+    {
+        flog(LOG_ERR, "Invalid prefix.");
+        return -1;
+    }
+    // If no mask specified, assume a default value
+    if ( *masklen == NOMASK )
+    {
+        flog(LOG_INFO, "No mask specified. Assuming mask length %d", prefixaddrlen);
+        *masklen = prefixaddrlen;
+    }
+    else
+    {
+        flog(LOG_INFO, "Mask length specified: %d", *masklen);
+        if ( (*masklen < 0) || (*masklen > 128) )
+        {
+            flog(LOG_ERR, "Invalid mask length.");
+            return -1;
+        }
+    }
+    // If specified mask length at odds with the prefix itself, flag it
+    // i.e. if the mask specified is not on a 16-bit boundary. Quite legal, but likely
+    // not common
+    if ( *masklen != prefixaddrlen )
+    {
+        flog(LOG_INFO, "Mask of %d correct? Prefix looked like %d. Continuing with your value (%d)",
+                        *masklen, prefixaddrlen, *masklen);
+    }
+    // Build a binary image of it
+    build_addr(addrStr, prefixaddr);
+
+    return 0;
+}
+
+//*******************************************************
+// Put everything the config file can set back to its default, so that a
+// reload starts from scratch rather than from the last config. Not
+// eventLoop: see readConfig().
+static void configDefaults(void)
+{
+    // Default black/whitelisting to OFF
+    listType = NOLIST;
+    naLinkOptFlag = 0;
+    nsIgnoreLocal = 1;
+    naRouter = 1;
+    maxHops = MAXMAXHOPS;
+    pollErrorLimit = 10;    // Vaguely sensible default
+    // Any targets collected so far go too. Workers are stopped by now,
+    // so theirs are in here as well.
+    collectTargets = 0;
+    addrset_free(&mainWorker.targets);
+    targetsHeld = 0;
+    // Logging
+    listLog = 0;
+    ralog = 0;
+
+    ifDefaults.rxRing = 0;
+    ifDefaults.rxRingBlockSize = RXRING_BLOCKSIZE;
+    ifDefaults.rxRingBlocks = RXRING_BLOCKS;
+    ifDefaults.xdp = XDPMODE_OFF;
+    ifDefaults.xdpQueue = 0;
+    ifDefaults.workers = 0;
+    ifDefaults.fanout = FANOUT_HASH;
+    rxBatch = 0;
+    socketFilter = FILTER_CLASSIC;
+    naTransmit = NATX_ICMP;
+    qdiscBypass = 0;
+}
+
+//*******************************************************
+// Read the next line of the config file into linein. A line that won't
+// fit is an error rather than being chopped up and parsed in pieces; only
+// the last line in the file may go without its newline.
+// Returns 1 with a line, 0 at the end of the file, -1 on error.
+static int readConfigLine(char *linein, int size, FILE *configFileFD)
+{
+    size_t len;
+
+    if (fgets(linein, size, configFileFD) == NULL)
+        return 0;
+
+    len = strlen(linein);
+    if ( (len == 0) || (linein[len-1] != '\n') )
+    {
+        if ( !feof(configFileFD) )
+        {
+            flog(LOG_ERR, "Config line too long (max %d chars): %.40s...", size - 2, linein);
+            return -1;
+        }
+    }
+
+    return 1;
+}
 
 //*******************************************************
 // Take supplied filename and open it, then parse the contents.
 int readConfig(char *configFileName)
 {
     char linein[256];
-    int len;
+    char linecopy[sizeof(linein)];  // For strtok(), as exprlist wants linein whole
+    int len, err;
     const char delimiters[] = "=";
     char *lefttoken, *righttoken;
     char *cp;
@@ -44,15 +179,19 @@ int readConfig(char *configFileName)
     // For prefix manipulation:
     char            prefixaddrstr[INET6_ADDRSTRLEN];
     struct          in6_addr prefixaddr;
-    int             prefixaddrlen, masklen=0;
+    int             masklen=0;
     char            interfacestr[INTERFACE_STRLEN];
-    char            *slashMarker;
     int             approxInterfaces = 0;
+    struct npd6IfOptions *opts;
+    char            errorStr[128];          // From storeExpression()
 
     
     // Ensure global set correctly
     interfaceCount = 0;
-    pollErrorLimit = 10;    // Vaguely sensible default
+    configDefaults();
+    addrlist_free();        // A reload starts the addrlist afresh
+    clearExpressions();     // ...and the exprlist
+    cpu_bind_best();        // Until the config says otherwise
 
     if ((configFileFD = fopen(configFileName, "r")) == NULL)
     {
@@ -66,7 +205,10 @@ int readConfig(char *configFileName)
     // and hence this value will typically be slightly bigger than required.
     // However the amount of memory so "wasted" is pretty tiny, so I really don't care.
     do {
-        if (fgets(linein, 128, configFileFD) == NULL)
+        err = readConfigLine(linein, sizeof(linein), configFileFD);
+        if (err < 0)
+            return 1;
+        if (err == 0)
             break;
         
         // Quick check for the presence of the string "interface"
@@ -92,7 +234,10 @@ int readConfig(char *configFileName)
         int strToken, strIdx;
 
         len = 0;
-        if (fgets(linein, 128, configFileFD) == NULL)
+        err = readConfigLine(linein, sizeof(linein), configFileFD);
+        if (err < 0)
+            return 1;
+        if (err == 0)
             break;
         // Tidy it up
             stripwhitespace(linein);
@@ -105,7 +250,10 @@ int readConfig(char *configFileName)
             }
 
             // Tokenize
-            cp = strdupa(linein);
+            // Not strdupa(): that's stack which isn't given back until
+            // we return, and a config can have millions of lines.
+            strcpy(linecopy, linein);
+            cp = linecopy;
             lefttoken = strtok(cp, delimiters);
             righttoken = strtok(NULL, delimiters);
             if ( (lefttoken == NULL) || (righttoken == NULL) )
@@ -135,50 +283,8 @@ int readConfig(char *configFileName)
                     continue;
 
                 case NPD6PREFIX:
-                    strncpy( prefixaddrstr, righttoken, sizeof(prefixaddrstr));
-                    flog(LOG_DEBUG, "Raw prefix: %s", prefixaddrstr);
-                    // The prefix may be optionally specified with a mask.
-                    // e.g. 1:2:3:: or 1:2:3::/12
-                    slashMarker = strchr( prefixaddrstr, '/');
-                    masklen = NOMASK;
-                    if (slashMarker != NULL)
-                    {
-                        // We found a mask marker
-                        masklen = atoi(slashMarker + 1);
-                        // Re-terminate prefix
-                        flog(LOG_DEBUG2, "Pre: %s", prefixaddrstr);
-                        slashMarker[0] = '\0';
-                        flog(LOG_DEBUG2, "Post: %s", prefixaddrstr);
-                    }
-
-                    // We need to pad it up and record the length in bits
-                    prefixaddrlen = prefixset(prefixaddrstr);
-                    flog(LOG_INFO, "Padded prefix: %s, length = %d", prefixaddrstr, prefixaddrlen);
-                    if ( prefixaddrlen <= 0 )
-                    {
-                        flog(LOG_ERR, "Invalid prefix.");
+                    if ( parsePrefix(righttoken, prefixaddrstr, &prefixaddr, &masklen) )
                         return 1;
-                    }
-                    // If no mask specified, assume a default value
-                    if ( masklen == NOMASK )
-                    {
-                        flog(LOG_INFO, "No mask specified. Assuming mask length %d", prefixaddrlen);
-                        masklen = prefixaddrlen;
-                    }
-                    else
-                    {
-                        flog(LOG_INFO, "Mask length specified: %d", masklen);
-                    }
-                    // If specified mask length at odds with the prefix itself, flag it
-                    // i.e. if the mask specified is not on a 16-bit boundary. Quite legal, but likely
-                    // not common
-                    if ( masklen != prefixaddrlen )
-                    {
-                        flog(LOG_INFO, "Mask of %d correct? Prefix looked like %d. Continuing with your value (%d)",
-                                        masklen, prefixaddrlen, masklen);
-                    }
-                    // Build a binary image of it
-                    build_addr(prefixaddrstr, &prefixaddr);
                     // Store it
                     interfaces[prefixCount].prefix = prefixaddr;
                     strncpy( interfaces[prefixCount].prefixStr, prefixaddrstr, 
@@ -187,6 +293,39 @@ int readConfig(char *configFileName)
                     prefixCount++;
                     break;
 
+                case NPD6EXTRAPREFIX:
+                    // Goes with the latest prefix
+                    if ( prefixCount == 0 )
+                    {
+                        flog(LOG_ERR, "extraPrefix must follow a prefix");
+                        return 1;
+                    }
+                    if ( parsePrefix(righttoken, prefixaddrstr, &prefixaddr, &masklen) )
+                        return 1;
+                    {
+                        struct npd6Interface    *iface = &interfaces[prefixCount-1];
+                        struct npd6Prefix       *grown;
+
+                        if ( iface->extraCount + 1 >= LPM_MAXPREFIXES )
+                        {
+                            flog(LOG_ERR, "Too many extraPrefix entries - max is %d",
+                                 LPM_MAXPREFIXES - 1);
+                            return 1;
+                        }
+                        grown = realloc(iface->extraPrefixes,
+                                        (iface->extraCount + 1) * sizeof(struct npd6Prefix));
+                        if ( grown == NULL )
+                        {
+                            flog(LOG_ERR, "realloc failed - Terminating");
+                            return 1;
+                        }
+                        grown[iface->extraCount].prefix = prefixaddr;
+                        grown[iface->extraCount].len = masklen;
+                        iface->extraPrefixes = grown;
+                        iface->extraCount++;
+                    }
+                    break;
+
                 case NPD6INTERFACE:
                     if ( strlen( righttoken) > INTERFACE_STRLEN )
                     {
@@ -198,6 +337,7 @@ int readConfig(char *configFileName)
                     // Store it
                     strncpy( interfaces[interfaceCount].nameStr, interfacestr, 
                              sizeof(interfaces[interfaceCount].nameStr) );
+                    interfaces[interfaceCount].opts = ifDefaults;
                     interfaceCount++;
                     break;
 
@@ -271,16 +411,8 @@ int readConfig(char *configFileName)
                     break;
 
                 case NPD6TARGETS:
-                    // If we arrive here and the tRoot tree already exists,
-                    // then we're re-reading the config and so need to zap
-                    // the tRoot data first.
-                    if (tRoot != NULL)
-                    {
-                        tdestroy(tRoot, free);
-                        tEntries = 0;
-                    }
-                    collectTargets = -1;
-                    tRoot = NULL;
+                    // Anything collected before a reload is gone by now,
+                    // see configDefaults()
                     collectTargets = atoi(righttoken);
 
                     if ( (collectTargets < 0) || (collectTargets > MAXTARGETS) )
@@ -316,7 +448,15 @@ int readConfig(char *configFileName)
                     }
                     break;
                 case NPD6LISTADDR:
-                    if (build_addr( righttoken, &listEntry) )
+                    // A prefix or range?
+                    if ( strchr(righttoken, '/') || strchr(righttoken, '-') )
+                    {
+                        if ( addrlist_add_block(righttoken) )
+                            flog(LOG_ERR, "Address block %s invalid.", righttoken);
+                        else
+                            flog(LOG_DEBUG, "Address block %s valid.", righttoken);
+                    }
+                    else if (build_addr( righttoken, &listEntry) )
                     {
                         flog(LOG_DEBUG, "Address %s valid.", righttoken);
                         storeListEntry(&listEntry);
@@ -327,6 +467,11 @@ int readConfig(char *configFileName)
                     }
                     break;
                     
+                case NPD6LISTFILE:
+                    if ( addrlist_load_file(righttoken) )
+                        return 1;
+                    break;
+
                 case NPD6ERRORTH:
                     pollErrorLimit = -1;
                     pollErrorLimit = atoi(righttoken);
@@ -344,8 +489,12 @@ int readConfig(char *configFileName)
                     
                     
                 case NPD6EXPRADDR:
+                    if ( storeExpression(linein, errorStr, sizeof(errorStr)) )
+                    {
+                        flog(LOG_ERR, "%s - invalid expression: %s", linein, errorStr);
+                        return 1;
+                    }
                     flog(LOG_DEBUG, "Address expression %s added.", linein);
-                    storeExpression(linein);
                     break;
                     
                 case NPD6LISTLOG:
@@ -383,6 +532,230 @@ int readConfig(char *configFileName)
                         return 1;
                     }
                     break;                    
+
+                case NPD6RXRING:
+                    opts = ifOptions();
+                    if ( !strcmp( righttoken, SET ) )
+                    {
+                        flog(LOG_INFO, "rxRing flag SET");
+                        opts->rxRing = 1;
+                    }
+                    else if ( !strcmp( righttoken, UNSET ) )
+                    {
+                        flog(LOG_INFO, "rxRing flag UNSET");
+                        opts->rxRing = 0;
+                    }
+                    else
+                    {
+                        flog(LOG_ERR, "rxRing flag - Bad value");
+                        return 1;
+                    }
+                    break;
+
+                case NPD6RINGBSIZE:
+                    opts = ifOptions();
+                    opts->rxRingBlockSize = strtoul(righttoken, NULL, 0);
+
+                    // The kernel wants whole pages and room for at least one frame
+                    if ( (opts->rxRingBlockSize < RXRING_FRAMESIZE) ||
+                         (opts->rxRingBlockSize % getpagesize()) )
+                    {
+                        flog(LOG_ERR, "rxRingBlockSize - must be a multiple of the page size (%d).",
+                             getpagesize());
+                        return 1;
+                    }
+                    else
+                    {
+                        flog(LOG_INFO, "rxRingBlockSize set to %u", opts->rxRingBlockSize);
+                    }
+                    break;
+
+                case NPD6RINGBLOCKS:
+                    opts = ifOptions();
+                    opts->rxRingBlocks = strtoul(righttoken, NULL, 0);
+
+                    if ( opts->rxRingBlocks < 1 )
+                    {
+                        flog(LOG_ERR, "rxRingBlocks - invalid value specified in config.");
+                        return 1;
+                    }
+                    else
+                    {
+                        flog(LOG_INFO, "rxRingBlocks set to %u", opts->rxRingBlocks);
+                    }
+                    break;
+
+                case NPD6RXBATCH:
+                    rxBatch = -1;
+                    rxBatch = atoi(righttoken);
+
+                    if ( (rxBatch < 0) || (rxBatch > MAXRXBUDGET) )
+                    {
+                        flog(LOG_ERR, "rxBatch - invalid value specified in config.");
+                        return 1;
+                    }
+                    else
+                    {
+                        flog(LOG_INFO, "rxBatch set to %d", rxBatch);
+                    }
+                    break;
+
+                case NPD6XDP:
+                    opts = ifOptions();
+                    if ( !strcmp( righttoken, OFF ) )
+                    {
+                        flog(LOG_INFO, "xdp set to OFF");
+                        opts->xdp = XDPMODE_OFF;
+                    }
+                    else if ( !strcmp( righttoken, NPD6GENERIC ) )
+                    {
+                        flog(LOG_INFO, "xdp set to GENERIC");
+                        opts->xdp = XDPMODE_GENERIC;
+                    }
+                    else if ( !strcmp( righttoken, NPD6NATIVE ) )
+                    {
+                        flog(LOG_INFO, "xdp set to NATIVE");
+                        opts->xdp = XDPMODE_NATIVE;
+                    }
+                    else
+                    {
+                        flog(LOG_ERR, "xdp - Bad value");
+                        return 1;
+                    }
+                    break;
+
+                case NPD6XDPQUEUE:
+                    opts = ifOptions();
+                    opts->xdpQueue = strtoul(righttoken, NULL, 0);
+                    flog(LOG_INFO, "xdpQueue set to %u", opts->xdpQueue);
+                    break;
+
+                case NPD6WORKERS:
+                    opts = ifOptions();
+                    opts->workers = strtoul(righttoken, NULL, 0);
+
+                    if ( opts->workers > MAXWORKERS )
+                    {
+                        flog(LOG_ERR, "workers - invalid value specified in config.");
+                        return 1;
+                    }
+                    else
+                    {
+                        flog(LOG_INFO, "workers set to %u", opts->workers);
+                    }
+                    break;
+
+                case NPD6FANOUT:
+                    opts = ifOptions();
+                    if ( !strcmp( righttoken, NPD6HASH ) )
+                    {
+                        flog(LOG_INFO, "fanout set to HASH");
+                        opts->fanout = FANOUT_HASH;
+                    }
+                    else if ( !strcmp( righttoken, NPD6CPU ) )
+                    {
+                        flog(LOG_INFO, "fanout set to CPU");
+                        opts->fanout = FANOUT_CPU;
+                    }
+                    else
+                    {
+                        flog(LOG_ERR, "fanout - Bad value");
+                        return 1;
+                    }
+                    break;
+
+                case NPD6SOCKFILTER:
+                    if ( !strcmp( righttoken, NPD6CLASSIC ) )
+                    {
+                        flog(LOG_INFO, "socketFilter set to CLASSIC");
+                        socketFilter = FILTER_CLASSIC;
+                    }
+                    else if ( !strcmp( righttoken, NPD6EBPF ) )
+                    {
+                        flog(LOG_INFO, "socketFilter set to EBPF");
+                        socketFilter = FILTER_EBPF;
+                    }
+                    else
+                    {
+                        flog(LOG_ERR, "socketFilter - Bad value");
+                        return 1;
+                    }
+                    break;
+
+                case NPD6EVENTLOOP:
+                {
+                    // The dispatcher picks its loop once, at startup, so
+                    // a reload can't change it. Say so rather than act as
+                    // if it had.
+                    int loopWanted;
+
+                    if ( !strcmp( righttoken, NPD6EPOLL ) )
+                        loopWanted = LOOP_EPOLL;
+                    else if ( !strcmp( righttoken, NPD6IOURING ) )
+                        loopWanted = LOOP_URING;
+                    else
+                    {
+                        flog(LOG_ERR, "eventLoop - Bad value");
+                        return 1;
+                    }
+
+                    if (!configLoaded)
+                    {
+                        flog(LOG_INFO, "eventLoop set to %s",
+                             (loopWanted == LOOP_URING) ? "IO_URING" : "EPOLL");
+                        eventLoop = loopWanted;
+                    }
+                    else if (loopWanted != eventLoop)
+                        flog(LOG_ERR, "eventLoop can't change on reload - restart npd6 to use %s",
+                             righttoken);
+                    break;
+                }
+
+                case NPD6NATX:
+                    if ( !strcmp( righttoken, NPD6ICMP ) )
+                    {
+                        flog(LOG_INFO, "naTransmit set to ICMP");
+                        naTransmit = NATX_ICMP;
+                    }
+                    else if ( !strcmp( righttoken, NPD6L2 ) )
+                    {
+                        flog(LOG_INFO, "naTransmit set to L2");
+                        naTransmit = NATX_L2;
+                    }
+                    else if ( !strcmp( righttoken, NPD6TXRING ) )
+                    {
+                        flog(LOG_INFO, "naTransmit set to TXRING");
+                        naTransmit = NATX_TXRING;
+                    }
+                    else
+                    {
+                        flog(LOG_ERR, "naTransmit - Bad value");
+                        return 1;
+                    }
+                    break;
+
+                case NPD6QDISCBYPASS:
+                    if ( !strcmp( righttoken, SET ) )
+                    {
+                        flog(LOG_INFO, "qdiscBypass flag SET");
+                        qdiscBypass = 1;
+                    }
+                    else if ( !strcmp( righttoken, UNSET ) )
+                    {
+                        flog(LOG_INFO, "qdiscBypass flag UNSET");
+                        qdiscBypass = 0;
+                    }
+                    else
+                    {
+                        flog(LOG_ERR, "qdiscBypass flag - Bad value");
+                        return 1;
+                    }
+                    break;
+
+                case NPD6CPUVARIANT:
+                    if ( cpu_override(righttoken) )
+                        return 1;
+                    break;
             }
     } while (len);
 
@@ -402,6 +775,11 @@ int readConfig(char *configFileName)
 
     flog(LOG_DEBUG, "Total interfaces defined: %d", interfaceCount);
 
+    if ( addrlist_build() )
+        return 1;
+    if ( buildExpressions() )
+        return 1;
+
     // Work out the interface indices and link addrs
     for (check = 0; check < interfaceCount; check ++)
     {
@@ -419,6 +797,16 @@ int readConfig(char *configFileName)
         flog(LOG_DEBUG2, "i/f name = %s, i/f index = %d",
                     interfaces[check].nameStr,
                     interfaces[check].index);
+
+        // Workers each open a socket of their own, and the ring is only
+        // set up on the interface's
+        if ( interfaces[check].opts.workers && interfaces[check].opts.rxRing &&
+             !interfaces[check].opts.xdp )
+        {
+            flog(LOG_ERR, "rxRing can't be used with workers, on interface %s",
+                 interfaces[check].nameStr);
+            return 1;
+        }
         
         // Interface's link address
         if (getLinkaddress( interfaces[check].nameStr, interfaces[check].linkAddr) )
@@ -427,7 +815,22 @@ int readConfig(char *configFileName)
                  interfaces[check].nameStr );
             return 1;
         }
+
+        // Its link-local address. Only needed by backends which build
+        // the whole NA themselves, so don't insist on it here.
+        if (getLinkLocal( interfaces[check].nameStr, &interfaces[check].linkLocal) )
+        {
+            flog(LOG_INFO, "No link-local address found on interface %s.",
+                 interfaces[check].nameStr );
+        }
+
+        build_na_template(check);
+
+        // Its extra prefixes, if any
+        if ( lpm_setup(check) )
+            return 1;
     }
     
+    configLoaded = 1;
     return 0;
 }
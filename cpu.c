@@ -0,0 +1,235 @@
+/*
+ *   This software is Copyright 2011 by Sean Groarke <sgroarke@gmail.com>
+ *   All rights reserved.
+ *
+ *   This file is part of npd6.
+ *
+ *   npd6 is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   npd6 is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with npd6.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* $Id$
+ * $HeadURL$
+ */
+
+/*
+ * Runtime choice between the variants of npd6's hot kernels, so that one
+ * binary makes the best of whatever CPU it finds itself on. The CPU is
+ * probed once at startup; each kernel's function pointer is then bound
+ * to the best variant it can run, or to one named in the config.
+ */
+
+#include "includes.h"
+#include "npd6.h"
+#include "cpu.h"
+#include "cksum.h"
+
+// A kernel and where its callers look for it
+struct cpuKernel {
+    const char          *name;
+    struct cpuVariant   *variants;
+    void                *impl;          // Address of the function pointer
+    struct cpuVariant   *chosen;
+};
+
+static struct cpuKernel kernels[] = {
+    { "cksum",          cksumVariants,          &cksumImpl,         NULL },
+    { "addr6match",     addr6matchVariants,     &addr6matchImpl,    NULL },
+    { "tCompare",       tCompareVariants,       &tCompareImpl,      NULL },
+    { "lpmLookup",      lpmLookupVariants,      &lpmLookupImpl,     NULL },
+    { "addrsetFind",    addrsetFindVariants,    &addrsetFindImpl,   NULL },
+};
+#define KERNELCOUNT (sizeof(kernels) / sizeof(kernels[0]))
+
+static unsigned int cpuFeatures;
+
+static const struct {
+    unsigned int    flag;
+    const char      *name;
+} featureNames[] = {
+    { CPU_SSE2,     "sse2" },
+    { CPU_SSE42,    "sse4.2" },
+    { CPU_AVX2,     "avx2" },
+    { CPU_BMI2,     "bmi2" },
+    { CPU_POPCNT,   "popcnt" },
+};
+#define FEATURECOUNT (sizeof(featureNames) / sizeof(featureNames[0]))
+
+
+// Point a kernel's callers at a variant. memcpy() as the function
+// pointers are all of different types.
+static void bindVariant(struct cpuKernel *kernel, struct cpuVariant *variant)
+{
+    memcpy(kernel->impl, &variant->fn, sizeof(variant->fn));
+    kernel->chosen = variant;
+}
+
+
+/*****************************************************************************
+ * cpu_init
+ *      Find out what the CPU can do, then bind every kernel to the best
+ *      variant it can run. Called once, first thing in main().
+ *
+ * Inputs:
+ *  void
+ *
+ * Outputs:
+ *  Every kernel bound.
+ *
+ * Return:
+ *      void
+ */
+void cpu_init(void)
+{
+#ifdef CPU_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        cpuFeatures |= CPU_SSE2;
+    if (__builtin_cpu_supports("sse4.2"))
+        cpuFeatures |= CPU_SSE42;
+    if (__builtin_cpu_supports("avx2"))
+        cpuFeatures |= CPU_AVX2;
+    if (__builtin_cpu_supports("bmi2"))
+        cpuFeatures |= CPU_BMI2;
+    if (__builtin_cpu_supports("popcnt"))
+        cpuFeatures |= CPU_POPCNT;
+#endif
+    cpu_bind_best();
+}
+
+
+/*****************************************************************************
+ * cpu_bind_best
+ *      Bind every kernel to the best variant the CPU can run, undoing
+ *      any config overrides. Done at the start of each config read.
+ */
+void cpu_bind_best(void)
+{
+    struct cpuVariant   *variant, *best;
+    unsigned int        loop;
+
+    for (loop = 0; loop < KERNELCOUNT; loop++)
+    {
+        best = NULL;
+        for (variant = kernels[loop].variants; variant->name; variant++)
+        {
+            if ( (variant->needs & cpuFeatures) == variant->needs )
+                best = variant;
+        }
+        // The first variant never needs anything
+        bindVariant(&kernels[loop], best ? best : kernels[loop].variants);
+    }
+}
+
+
+/*****************************************************************************
+ * cpu_override
+ *      Force a kernel to use a given variant, e.g. for benchmarking.
+ *
+ * Inputs:
+ *  spec is "kernel:variant", or just "variant" for every kernel that
+ *  has one of that name.
+ *
+ * Outputs:
+ *  Kernel(s) rebound.
+ *
+ * Return:
+ *      0 on success, otherwise 1 (as readConfig() would have it)
+ */
+int cpu_override(char *spec)
+{
+    char                *colon = strchr(spec, ':');
+    char                *varName = colon ? colon + 1 : spec;
+    struct cpuVariant   *variant;
+    unsigned int        loop, found = 0;
+
+    if (colon)
+        *colon = '\0';
+
+    for (loop = 0; loop < KERNELCOUNT; loop++)
+    {
+        if ( colon && strcmp(spec, kernels[loop].name) )
+            continue;
+
+        for (variant = kernels[loop].variants; variant->name; variant++)
+        {
+            if ( strcmp(varName, variant->name) )
+                continue;
+            if ( (variant->needs & cpuFeatures) != variant->needs )
+            {
+                flog(LOG_ERR, "cpuVariant - %s %s not supported by this CPU",
+                     kernels[loop].name, varName);
+                return 1;
+            }
+            bindVariant(&kernels[loop], variant);
+            flog(LOG_INFO, "cpuVariant - %s forced to %s", kernels[loop].name, varName);
+            found++;
+        }
+    }
+
+    if (!found)
+    {
+        flog(LOG_ERR, "cpuVariant - no such kernel or variant: %s%s%s",
+             spec, colon ? ":" : "", colon ? varName : "");
+        return 1;
+    }
+    return 0;
+}
+
+
+// "name name name", into buf
+static void variantList(struct cpuKernel *kernel, char *buf, size_t size)
+{
+    struct cpuVariant   *variant;
+    size_t              used = 0;
+
+    buf[0] = '\0';
+    for (variant = kernel->variants; variant->name && (used < size); variant++)
+        used += snprintf(buf + used, size - used, "%s%s", used ? " " : "", variant->name);
+}
+
+
+/*****************************************************************************
+ * cpu_report / cpu_log
+ *      Describe the CPU features found and the variant each kernel is
+ *      using, on stdout for -v or in the log at startup.
+ */
+void cpu_report(FILE *out)
+{
+    unsigned int    loop;
+    char            list[128];
+
+    fprintf(out, "CPU features:");
+    for (loop = 0; loop < FEATURECOUNT; loop++)
+    {
+        if (cpuFeatures & featureNames[loop].flag)
+            fprintf(out, " %s", featureNames[loop].name);
+    }
+    fprintf(out, "\n");
+
+    for (loop = 0; loop < KERNELCOUNT; loop++)
+    {
+        variantList(&kernels[loop], list, sizeof(list));
+        fprintf(out, "  %-12s %-8s (of: %s)\n", kernels[loop].name,
+                kernels[loop].chosen->name, list);
+    }
+}
+
+void cpu_log(void)
+{
+    unsigned int    loop;
+
+    for (loop = 0; loop < KERNELCOUNT; loop++)
+        flog(LOG_INFO, "Kernel %s using the %s variant", kernels[loop].name,
+             kernels[loop].chosen->name);
+}
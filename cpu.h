@@ -0,0 +1,64 @@
+/*
+ *   This software is Copyright 2011 by Sean Groarke <sgroarke@gmail.com>
+ *   All rights reserved.
+ *
+ *   This file is part of npd6.
+ *
+ *   npd6 is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   npd6 is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with npd6.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* $Id$
+ * $HeadURL$
+ */
+
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_X86
+#endif
+
+// CPU features a variant may need
+#define CPU_SSE2            (1 << 0)
+#define CPU_SSE42           (1 << 1)
+#define CPU_AVX2            (1 << 2)
+#define CPU_BMI2            (1 << 3)
+#define CPU_POPCNT          (1 << 4)
+
+// One implementation of a hot kernel. A kernel's variants are listed
+// slowest first, ending with a NULL name; the last the CPU can run is
+// the one used, unless the config says otherwise.
+struct cpuVariant {
+    const char          *name;
+    unsigned int        needs;          // CPU_* features
+    void                *fn;
+};
+
+// Each module with kernels exports its variant list, and the function
+// pointer its callers go through.
+extern struct cpuVariant    cksumVariants[];
+extern struct cpuVariant    addr6matchVariants[];
+extern struct cpuVariant    tCompareVariants[];
+extern struct cpuVariant    lpmLookupVariants[];
+extern struct cpuVariant    addrsetFindVariants[];
+
+void    cpu_init(void);
+void    cpu_bind_best(void);
+int     cpu_override(char *);
+void    cpu_report(FILE *);
+void    cpu_log(void);
+
+#endif
@@ -0,0 +1,192 @@
+/*
+ *   This software is Copyright 2011 by Sean Groarke <sgroarke@gmail.com>
+ *   All rights reserved.
+ *
+ *   This file is part of npd6.
+ *
+ *   npd6 is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   npd6 is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with npd6.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* $Id$
+ * $HeadURL$
+ */
+
+#include "includes.h"
+#include "npd6.h"
+#include "ebpf.h"
+#include <sys/syscall.h>
+
+/*
+ * Thin wrappers around the bpf() system call. glibc has no wrapper for
+ * it and we don't want the weight of libbpf for a couple of tiny programs.
+ */
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+
+/*****************************************************************************
+ * ebpf_map_create
+ *      Create a BPF map.
+ *
+ * Inputs:
+ *  Map type, key and value sizes in bytes, maximum number of entries
+ *  and BPF_F_* map flags.
+ *
+ * Outputs:
+ *  none
+ *
+ * Return:
+ *      Map fd on success, otherwise -1
+ */
+int ebpf_map_create(enum bpf_map_type type, unsigned int keySize,
+                    unsigned int valueSize, unsigned int maxEntries,
+                    unsigned int flags)
+{
+    union bpf_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = type;
+    attr.key_size = keySize;
+    attr.value_size = valueSize;
+    attr.max_entries = maxEntries;
+    attr.map_flags = flags;
+
+    fd = sys_bpf(BPF_MAP_CREATE, &attr);
+    if (fd < 0)
+        flog(LOG_ERR, "bpf(BPF_MAP_CREATE, type %d): %s", type, strerror(errno));
+    return fd;
+}
+
+
+/*****************************************************************************
+ * ebpf_map_update / ebpf_map_delete / ebpf_map_next_key
+ *      Element operations on a map, as per the BPF_MAP_* commands.
+ *
+ * Return:
+ *      0 on success, otherwise -1 with errno set
+ */
+int ebpf_map_update(int fd, const void *key, const void *value, unsigned long long flags)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = fd;
+    attr.key = (unsigned long)key;
+    attr.value = (unsigned long)value;
+    attr.flags = flags;
+    return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+int ebpf_map_delete(int fd, const void *key)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = fd;
+    attr.key = (unsigned long)key;
+    return sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+int ebpf_map_next_key(int fd, const void *key, void *nextKey)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = fd;
+    attr.key = (unsigned long)key;
+    attr.next_key = (unsigned long)nextKey;
+    return sys_bpf(BPF_MAP_GET_NEXT_KEY, &attr);
+}
+
+
+/*****************************************************************************
+ * ebpf_prog_load
+ *      Load a hand-assembled program into the kernel. If the verifier
+ *      rejects it, its log is passed on to ours.
+ *
+ * Inputs:
+ *  Program type, the instructions and how many there are.
+ *
+ * Outputs:
+ *  none
+ *
+ * Return:
+ *      Program fd on success, otherwise -1
+ */
+int ebpf_prog_load(enum bpf_prog_type type, struct bpf_insn *insns, unsigned int count)
+{
+    static char     verifierLog[EBPF_LOG_SIZE];
+    union bpf_attr  attr;
+    int             fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = type;
+    attr.insns = (unsigned long)insns;
+    attr.insn_cnt = count;
+    attr.license = (unsigned long)"GPL";
+
+    fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (fd >= 0)
+        return fd;
+
+    // Try again, this time asking the verifier to explain itself
+    verifierLog[0] = '\0';
+    attr.log_buf = (unsigned long)verifierLog;
+    attr.log_size = sizeof(verifierLog);
+    attr.log_level = 1;
+    fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (fd < 0)
+    {
+        flog(LOG_ERR, "bpf(BPF_PROG_LOAD, type %d, %u insns): %s", type, count, strerror(errno));
+        flog(LOG_DEBUG, "Verifier said: %s", verifierLog);
+    }
+    return fd;
+}
+
+
+/*****************************************************************************
+ * ebpf_link_xdp
+ *      Attach an XDP program to an interface via a BPF link. The
+ *      program comes off again when the link fd is closed, including
+ *      if we die unexpectedly.
+ *
+ * Inputs:
+ *  Program fd, kernel interface index, XDP_FLAGS_* mode.
+ *
+ * Outputs:
+ *  none
+ *
+ * Return:
+ *      Link fd on success, otherwise -1
+ */
+int ebpf_link_xdp(int progFd, int ifIndex, unsigned int flags)
+{
+    union bpf_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = progFd;
+    attr.link_create.target_ifindex = ifIndex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = flags;
+
+    fd = sys_bpf(BPF_LINK_CREATE, &attr);
+    if (fd < 0)
+        flog(LOG_ERR, "bpf(BPF_LINK_CREATE, XDP on %d): %s", ifIndex, strerror(errno));
+    return fd;
+}
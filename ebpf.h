@@ -0,0 +1,70 @@
+/*
+ *   This software is Copyright 2011 by Sean Groarke <sgroarke@gmail.com>
+ *   All rights reserved.
+ *
+ *   This file is part of npd6.
+ *
+ *   npd6 is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   npd6 is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with npd6.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* $Id$
+ * $HeadURL$
+ */
+
+#ifndef EBPF_H
+#define EBPF_H
+
+#include <linux/bpf.h>
+
+// We don't pull in libbpf, so eBPF programs are assembled by hand using
+// these. They mirror the instruction macros in the kernel's filter.h.
+#define EBPF_INSN(CODE, DST, SRC, OFF, IMM) \
+    ((struct bpf_insn) { .code = (CODE), .dst_reg = (DST), .src_reg = (SRC), .off = (OFF), .imm = (IMM) })
+
+#define EBPF_ALU64_IMM(OP, DST, IMM)        EBPF_INSN(BPF_ALU64|BPF_OP(OP)|BPF_K, DST, 0, 0, IMM)
+#define EBPF_ALU64_REG(OP, DST, SRC)        EBPF_INSN(BPF_ALU64|BPF_OP(OP)|BPF_X, DST, SRC, 0, 0)
+#define EBPF_ALU32_IMM(OP, DST, IMM)        EBPF_INSN(BPF_ALU|BPF_OP(OP)|BPF_K, DST, 0, 0, IMM)
+#define EBPF_ALU32_REG(OP, DST, SRC)        EBPF_INSN(BPF_ALU|BPF_OP(OP)|BPF_X, DST, SRC, 0, 0)
+#define EBPF_MOV64_IMM(DST, IMM)            EBPF_INSN(BPF_ALU64|BPF_MOV|BPF_K, DST, 0, 0, IMM)
+#define EBPF_MOV64_REG(DST, SRC)            EBPF_INSN(BPF_ALU64|BPF_MOV|BPF_X, DST, SRC, 0, 0)
+#define EBPF_MOV32_IMM(DST, IMM)            EBPF_INSN(BPF_ALU|BPF_MOV|BPF_K, DST, 0, 0, IMM)
+#define EBPF_MOV32_REG(DST, SRC)            EBPF_INSN(BPF_ALU|BPF_MOV|BPF_X, DST, SRC, 0, 0)
+#define EBPF_LDX_MEM(SIZE, DST, SRC, OFF)   EBPF_INSN(BPF_LDX|BPF_SIZE(SIZE)|BPF_MEM, DST, SRC, OFF, 0)
+#define EBPF_STX_MEM(SIZE, DST, SRC, OFF)   EBPF_INSN(BPF_STX|BPF_SIZE(SIZE)|BPF_MEM, DST, SRC, OFF, 0)
+#define EBPF_ST_MEM(SIZE, DST, OFF, IMM)    EBPF_INSN(BPF_ST|BPF_SIZE(SIZE)|BPF_MEM, DST, 0, OFF, IMM)
+// Legacy packet access, result in r0 in host order. Needs ctx in r6.
+#define EBPF_LD_ABS(SIZE, IMM)              EBPF_INSN(BPF_LD|BPF_SIZE(SIZE)|BPF_ABS, 0, 0, 0, IMM)
+#define EBPF_JMP_IMM(OP, DST, IMM, OFF)     EBPF_INSN(BPF_JMP|BPF_OP(OP)|BPF_K, DST, 0, OFF, IMM)
+#define EBPF_JMP_REG(OP, DST, SRC, OFF)     EBPF_INSN(BPF_JMP|BPF_OP(OP)|BPF_X, DST, SRC, OFF, 0)
+#define EBPF_JMP32_IMM(OP, DST, IMM, OFF)   EBPF_INSN(BPF_JMP32|BPF_OP(OP)|BPF_K, DST, 0, OFF, IMM)
+#define EBPF_JMP32_REG(OP, DST, SRC, OFF)   EBPF_INSN(BPF_JMP32|BPF_OP(OP)|BPF_X, DST, SRC, OFF, 0)
+#define EBPF_JA(OFF)                        EBPF_INSN(BPF_JMP|BPF_JA, 0, 0, OFF, 0)
+#define EBPF_CALL(FUNC)                     EBPF_INSN(BPF_JMP|BPF_CALL, 0, 0, 0, FUNC)
+#define EBPF_EXIT()                         EBPF_INSN(BPF_JMP|BPF_EXIT, 0, 0, 0, 0)
+// Takes two instruction slots
+#define EBPF_LD_MAP_FD(DST, FD) \
+    EBPF_INSN(BPF_LD|BPF_DW|BPF_IMM, DST, BPF_PSEUDO_MAP_FD, 0, FD), \
+    EBPF_INSN(0, 0, 0, 0, 0)
+
+#define EBPF_MAX_INSNS      4096
+#define EBPF_LOG_SIZE       65536
+
+int     ebpf_map_create(enum bpf_map_type, unsigned int, unsigned int, unsigned int, unsigned int);
+int     ebpf_map_update(int, const void *, const void *, unsigned long long);
+int     ebpf_map_delete(int, const void *);
+int     ebpf_map_next_key(int, const void *, void *);
+int     ebpf_prog_load(enum bpf_prog_type, struct bpf_insn *, unsigned int);
+int     ebpf_link_xdp(int, int, unsigned int);
+
+#endif /* EBPF_H */
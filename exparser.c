@@ -34,6 +34,8 @@
 //    - Added: abs()
 //    - Added: mask()
 //    - Added: network to/from unsigned long long conversions
+//    - Added: compilation to a stack machine, exp_compile_expression()
+//    - Added: 128-bit addresses (IPv6 literals, ADDR, /len) when compiled
 //
 //    program:
 //	END			   // END is end-of-input
@@ -75,6 +77,8 @@
 //	~ primary
 //	! primary
 //	( expression )
+//	ADDRESS			   // IPv6 literal, only when compiled
+//	primary / NUMBER	   // An address masked to a prefix length
 //
 //  Notes:
 //   - This code has only been tested on LITTLE_ENDIAN (Intel) machines.
@@ -82,7 +86,7 @@
 //
 //*****************************************************************************
 
-#define PARSER_LIBRARY_VERSION  "0.9.10"
+#define PARSER_LIBRARY_VERSION  "0.9.11"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -176,11 +180,10 @@ s_function_abs(exp_pstat_t* pstat)
   return v;
 }
 
+// Bits endbit to startbit set, as mask(startbit, endbit)
 static unsigned long long
-s_function_mask(exp_pstat_t* pstat)
+s_mask_value(long long startbit, long long endbit)
 {
-  long long startbit = 0;
-  long long endbit = 0;
   long long tmpbit = 0;
   unsigned long long value = 0;
   unsigned char* vp = 0;
@@ -188,25 +191,6 @@ s_function_mask(exp_pstat_t* pstat)
   int shift = 0;
   int mask = 0;
 
-  if(s_get_token(pstat) != LP)
-  {
-    fprintf(stderr, "( expected: %d(0x%x)", pstat->curr_tok, pstat->curr_tok);
-    return 0;
-  }
-  startbit = s_expression(pstat, 1);
-  if(pstat->curr_tok != COMMA)
-  { 
-    fprintf(stderr, ", expected: %d(0x%x)", pstat->curr_tok, pstat->curr_tok);
-    return 0;
-  }
-  endbit = s_expression(pstat, 1);
-  if(pstat->curr_tok != RP)
-  { 
-    fprintf(stderr, ") expected: %d(0x%x)", pstat->curr_tok, pstat->curr_tok);
-    return 0;
-  }
-  s_get_token(pstat);
-
   value = 0;
   vp = (unsigned char*)&value+7;
 
@@ -251,6 +235,58 @@ s_function_mask(exp_pstat_t* pstat)
   return value;
 }
 
+static unsigned long long
+s_function_mask(exp_pstat_t* pstat)
+{
+  long long startbit = 0;
+  long long endbit = 0;
+
+  if(s_get_token(pstat) != LP)
+  {
+    fprintf(stderr, "( expected: %d(0x%x)", pstat->curr_tok, pstat->curr_tok);
+    return 0;
+  }
+  startbit = s_expression(pstat, 1);
+  if(pstat->curr_tok != COMMA)
+  { 
+    fprintf(stderr, ", expected: %d(0x%x)", pstat->curr_tok, pstat->curr_tok);
+    return 0;
+  }
+  endbit = s_expression(pstat, 1);
+  if(pstat->curr_tok != RP)
+  { 
+    fprintf(stderr, ") expected: %d(0x%x)", pstat->curr_tok, pstat->curr_tok);
+    return 0;
+  }
+  s_get_token(pstat);
+
+  return s_mask_value(startbit, endbit);
+}
+
+// An IPv6 literal, if that's what's next
+static int
+s_get_address(exp_pstat_t* pstat)
+{
+  char text[INET6_ADDRSTRLEN];
+  struct in6_addr ipv6;
+  size_t length = strspn(pstat->input, "0123456789abcdefABCDEF:.");
+
+  if((length >= sizeof(text)) || (memchr(pstat->input, ':', length) == NULL))
+  {
+    return 0;
+  }
+  memcpy(text, pstat->input, length);
+  text[length] = 0;
+  if(inet_pton(AF_INET6, text, &ipv6) != 1)
+  {
+    return 0;
+  }
+  pstat->address_value[0] = exp_ipv6_prefix_to_ull(&ipv6);
+  pstat->address_value[1] = exp_ipv6_host_to_ull(&ipv6);
+  pstat->input += length;
+  return 1;
+}
+
 static Token_value_t
 s_get_token(exp_pstat_t* pstat)
 {
@@ -272,6 +308,11 @@ s_get_token(exp_pstat_t* pstat)
 
   ch = *pstat->input;
 
+  if(((isxdigit(ch)) || (ch == ':')) && (s_get_address(pstat)))
+  {
+    return pstat->curr_tok = ADDRESS;
+  }
+
   switch(ch)
   {
     case ';':
@@ -654,6 +695,653 @@ exp_parse_expression(exp_pstat_t* pstat, char* expr, unsigned long long* result)
   return 0;
 }
 
+//*****************************************************************************
+//  Compiler
+//
+//  exp_compile_expression() parses an expression once, by the same grammar
+//  as above, into code for a small stack machine, and exp_run_program()
+//  runs it. Values come off the stack in the order the interpreter would
+//  have worked them out. The only differences are at the edges:
+//   - Syntax errors, which the interpreter printed and skipped, fail the
+//     compile instead, as does anything left over after an expression.
+//   - A divide or modulus by zero stops the program and fails it, where
+//     the interpreter marked an error and carried on.
+//   - Shift counts are taken modulo 64.
+//  It also knows 128-bit addresses, which the interpreter doesn't: an IPv6
+//  literal, ADDR, or & | ^ ~ of those, each masked to a prefix length by
+//  /len if wanted. They run as (upper, lower) pairs on the stack. Compared
+//  they give a number, but they can't be stored or used as one.
+//*****************************************************************************
+
+typedef struct _exp_cstat {
+  exp_pstat_t pstat;            // For the tokenizer
+  exp_symtab_t* symtab;
+  exp_program_t* program;
+  int depth;
+  int failed;
+  int wide;                     // What was just compiled is an address
+  char* token;                  // Where the current token starts
+  char* error;
+  int error_length;
+} exp_cstat_t;
+
+static void s_compile_expression(exp_cstat_t* cstat, int get);
+
+static void
+s_compile_error(exp_cstat_t* cstat, char* message)
+{
+  if(cstat->failed)
+  {
+    return;
+  }
+  cstat->failed = 1;
+  while(isspace(*cstat->token))
+  {
+    cstat->token++;
+  }
+  if(*cstat->token)
+  {
+    snprintf(cstat->error, cstat->error_length, "%s at \"%.16s\"", message, cstat->token);
+  }
+  else
+  {
+    snprintf(cstat->error, cstat->error_length, "%s at end", message);
+  }
+}
+
+static Token_value_t
+s_compile_token(exp_cstat_t* cstat)
+{
+  int errors = cstat->pstat.errors;
+
+  cstat->token = cstat->pstat.input;
+  s_get_token(&cstat->pstat);
+  if(cstat->pstat.errors != errors)
+  {
+    s_compile_error(cstat, "bad character");
+  }
+  return cstat->pstat.curr_tok;
+}
+
+static void
+s_emit(exp_cstat_t* cstat, Exp_opcode_t op, int arg)
+{
+  exp_program_t* program = cstat->program;
+
+  if(cstat->failed)
+  {
+    return;
+  }
+  if(program->length >= EXP_MAX_PROGRAM)
+  {
+    s_compile_error(cstat, "expression too long");
+    return;
+  }
+  program->code[program->length].op = op;
+  program->code[program->length].arg = arg;
+  program->length++;
+
+  switch(op)
+  {
+    case EXP_OP_PUSH:
+    case EXP_OP_LOAD:
+      cstat->depth++;
+      break;
+    case EXP_OP_END:
+    case EXP_OP_STORE:
+    case EXP_OP_NEG:
+    case EXP_OP_NOT:
+    case EXP_OP_LNOT:
+    case EXP_OP_ABS:
+    case EXP_OP_WNOT:
+      break;
+    case EXP_OP_WAND:
+    case EXP_OP_WOR:
+    case EXP_OP_WXOR:
+      cstat->depth -= 2;
+      break;
+    case EXP_OP_WCE:
+    case EXP_OP_WCNE:
+    case EXP_OP_WCGT:
+    case EXP_OP_WCLT:
+    case EXP_OP_WCGE:
+    case EXP_OP_WCLE:
+      cstat->depth -= 3;
+      break;
+    default:
+      cstat->depth--;
+      break;
+  }
+  if(cstat->depth > EXP_MAX_STACK)
+  {
+    s_compile_error(cstat, "expression nested too deeply");
+  }
+  if(cstat->depth > program->depth)
+  {
+    program->depth = cstat->depth;
+  }
+}
+
+static void
+s_emit_constant(exp_cstat_t* cstat, unsigned long long value)
+{
+  exp_program_t* program = cstat->program;
+  int i;
+
+  for(i=0; i<program->constant_count; i++)
+  {
+    if(program->constants[i] == value)
+    {
+      s_emit(cstat, EXP_OP_PUSH, i);
+      return;
+    }
+  }
+  if(program->constant_count >= EXP_MAX_CONSTANTS)
+  {
+    s_compile_error(cstat, "too many constants");
+    return;
+  }
+  program->constants[program->constant_count] = value;
+  s_emit(cstat, EXP_OP_PUSH, program->constant_count++);
+}
+
+// What was just compiled should be a number
+static void
+s_compile_number(exp_cstat_t* cstat)
+{
+  if(cstat->wide)
+  {
+    s_compile_error(cstat, "number expected, not an address");
+  }
+}
+
+// The mask for an address's /len, if it has one. All ones if not.
+static void
+s_compile_prefix(exp_cstat_t* cstat, unsigned long long* mask)
+{
+  unsigned long long length = 128;
+
+  if(cstat->pstat.curr_tok == DIV)
+  {
+    if((s_compile_token(cstat) != NUMBER) || (cstat->pstat.number_value > 128))
+    {
+      s_compile_error(cstat, "prefix length expected");
+    }
+    else
+    {
+      length = cstat->pstat.number_value;
+      s_compile_token(cstat);
+    }
+  }
+  mask[0] = (length == 0) ? 0 : (length >= 64) ? ~0ULL : ~0ULL << (64 - length);
+  mask[1] = (length <= 64) ? 0 : ~0ULL << (128 - length);
+}
+
+// Mask the address just compiled to its /len, if it has one
+static void
+s_compile_masked(exp_cstat_t* cstat)
+{
+  unsigned long long mask[2];
+
+  s_compile_prefix(cstat, mask);
+  if((mask[0] & mask[1]) != ~0ULL)
+  {
+    s_emit_constant(cstat, mask[0]);
+    s_emit_constant(cstat, mask[1]);
+    s_emit(cstat, EXP_OP_WAND, 0);
+  }
+}
+
+// abs() or mask(), with the name just read
+static void
+s_compile_function(exp_cstat_t* cstat, int args, Exp_opcode_t op)
+{
+  int arg;
+
+  if(s_compile_token(cstat) != LP)
+  {
+    s_compile_error(cstat, "( expected");
+    return;
+  }
+  for(arg=0; arg<args; arg++)
+  {
+    s_compile_expression(cstat, 1);
+    s_compile_number(cstat);
+    if(cstat->pstat.curr_tok != ((arg == args-1) ? RP : COMMA))
+    {
+      s_compile_error(cstat, (arg == args-1) ? ") expected" : ", expected");
+      return;
+    }
+  }
+  s_compile_token(cstat);
+  s_emit(cstat, op, 0);
+}
+
+static void
+s_compile_primary(exp_cstat_t* cstat, int get)
+{
+  exp_pstat_t* pstat = &cstat->pstat;
+  unsigned long long value[2], mask[2];
+  int slot = 0;
+
+  if(get)
+  {
+    s_compile_token(cstat);
+  }
+  if(cstat->failed)
+  {
+    return;
+  }
+
+  cstat->wide = 0;
+  switch(pstat->curr_tok)
+  {
+    case NUMBER:
+      s_emit_constant(cstat, pstat->number_value);
+      s_compile_token(cstat);
+      return;
+
+    case ADDRESS:
+      value[0] = pstat->address_value[0];
+      value[1] = pstat->address_value[1];
+      s_compile_token(cstat);
+      s_compile_prefix(cstat, mask);
+      s_emit_constant(cstat, value[0] & mask[0]);
+      s_emit_constant(cstat, value[1] & mask[1]);
+      cstat->wide = 1;
+      return;
+
+    case NAME:
+      if((strcasecmp(pstat->string_value, EXP_FUNCTION_ABS)) == 0)
+      {
+        s_compile_function(cstat, 1, EXP_OP_ABS);
+        return;
+      }
+      if((strcasecmp(pstat->string_value, EXP_FUNCTION_MASK)) == 0)
+      {
+        s_compile_function(cstat, 2, EXP_OP_MASK);
+        return;
+      }
+      if((strcmp(pstat->string_value, EXP_NAME_ADDRESS)) == 0)
+      {
+        if(s_compile_token(cstat) == ASSIGN)
+        {
+          s_compile_error(cstat, "an address can't be stored");
+          return;
+        }
+        slot = exp_symbol_slot(cstat->symtab, EXP_NAME_PREFIX);
+        if((slot < 0) || (exp_symbol_slot(cstat->symtab, EXP_NAME_HOST) < 0))
+        {
+          s_compile_error(cstat, "too many variables");
+          return;
+        }
+        s_emit(cstat, EXP_OP_LOAD, slot);
+        s_emit(cstat, EXP_OP_LOAD, exp_symbol_slot(cstat->symtab, EXP_NAME_HOST));
+        cstat->wide = 1;
+        s_compile_masked(cstat);
+        return;
+      }
+
+      slot = exp_symbol_slot(cstat->symtab, pstat->string_value);
+      if(slot < 0)
+      {
+        s_compile_error(cstat, "too many variables, or name too long");
+        return;
+      }
+      if(s_compile_token(cstat) == ASSIGN)
+      {
+        s_compile_expression(cstat, 1);
+        s_compile_number(cstat);
+        s_emit(cstat, EXP_OP_STORE, slot);
+      }
+      else
+      {
+        s_emit(cstat, EXP_OP_LOAD, slot);
+      }
+      return;
+
+    case MINUS:
+      s_compile_primary(cstat, 1);
+      s_compile_number(cstat);
+      s_emit(cstat, EXP_OP_NEG, 0);
+      return;
+
+    case PLUS:
+      s_compile_primary(cstat, 1);
+      return;
+
+    case NOT:
+      s_compile_primary(cstat, 1);
+      s_emit(cstat, cstat->wide ? EXP_OP_WNOT : EXP_OP_NOT, 0);
+      return;
+
+    case LNOT:
+      s_compile_primary(cstat, 1);
+      s_compile_number(cstat);
+      s_emit(cstat, EXP_OP_LNOT, 0);
+      return;
+
+    case LP:
+      s_compile_expression(cstat, 1);
+      if(pstat->curr_tok != RP)
+      {
+        s_compile_error(cstat, ") expected");
+        return;
+      }
+      s_compile_token(cstat);
+      if(cstat->wide)
+      {
+        s_compile_masked(cstat);
+      }
+      return;
+
+    default:
+      s_compile_error(cstat, "value expected");
+      return;
+  }
+}
+
+static void
+s_compile_term(exp_cstat_t* cstat, int get)
+{
+  Exp_opcode_t op;
+  int wide;
+
+  s_compile_primary(cstat, get);
+
+  while(!cstat->failed)
+  {
+    switch(cstat->pstat.curr_tok)
+    {
+      case AND:  op = EXP_OP_AND;  break;
+      case OR:   op = EXP_OP_OR;   break;
+      case MUL:  op = EXP_OP_MUL;  break;
+      case DIV:  op = EXP_OP_DIV;  break;
+      case SR:   op = EXP_OP_SHR;  break;
+      case SL:   op = EXP_OP_SHL;  break;
+      case MOD:  op = EXP_OP_MOD;  break;
+      case XOR:  op = EXP_OP_XOR;  break;
+      case CE:   op = EXP_OP_CE;   break;
+      case CNE:  op = EXP_OP_CNE;  break;
+      case CGT:  op = EXP_OP_CGT;  break;
+      case CLT:  op = EXP_OP_CLT;  break;
+      case CGE:  op = EXP_OP_CGE;  break;
+      case CLE:  op = EXP_OP_CLE;  break;
+      case LOR:  op = EXP_OP_LOR;  break;
+      case LAND: op = EXP_OP_LAND; break;
+      default:
+        return;
+    }
+    wide = cstat->wide;
+    s_compile_primary(cstat, 1);
+    if(wide != cstat->wide)
+    {
+      s_compile_error(cstat, "address and number mixed");
+      return;
+    }
+    if(wide)
+    {
+      // Addresses can be masked, flipped and compared
+      if((op >= EXP_OP_AND) && (op <= EXP_OP_XOR))
+      {
+        op = op - EXP_OP_AND + EXP_OP_WAND;
+      }
+      else if((op >= EXP_OP_CE) && (op <= EXP_OP_CLE))
+      {
+        op = op - EXP_OP_CE + EXP_OP_WCE;
+        cstat->wide = 0;
+      }
+      else
+      {
+        s_compile_error(cstat, "can't be done to an address");
+        return;
+      }
+    }
+    s_emit(cstat, op, 0);
+  }
+}
+
+static void
+s_compile_expression(exp_cstat_t* cstat, int get)
+{
+  Exp_opcode_t op;
+
+  s_compile_term(cstat, get);
+
+  while(!cstat->failed)
+  {
+    switch(cstat->pstat.curr_tok)
+    {
+      case PLUS:  op = EXP_OP_ADD; break;
+      case MINUS: op = EXP_OP_SUB; break;
+      default:
+        return;
+    }
+    s_compile_number(cstat);
+    s_compile_term(cstat, 1);
+    s_compile_number(cstat);
+    s_emit(cstat, op, 0);
+  }
+}
+
+// A variable's slot, added if it's new. -1 if the table is full.
+int
+exp_symbol_slot(exp_symtab_t* symtab, char* name)
+{
+  int i;
+
+  for(i=0; i<symtab->count; i++)
+  {
+    if((strcmp(name, symtab->name[i])) == 0)
+    {
+      return i;
+    }
+  }
+  if((symtab->count >= EXP_MAX_MAPPED_SYMBOLS) || (strlen(name) >= sizeof(symtab->name[0])))
+  {
+    return -1;
+  }
+  strcpy(symtab->name[symtab->count], name);
+  return symtab->count++;
+}
+
+// Compile expr into program, with its variables in symtab. On a syntax
+// error returns -1, with a message in error.
+int
+exp_compile_expression(exp_symtab_t* symtab, char* expr, exp_program_t* program,
+                       char* error, int length)
+{
+  exp_cstat_t cstat;
+  int statements = 0;
+
+  memset(&cstat, 0, sizeof(cstat));
+  memset(program, 0, sizeof(exp_program_t));
+  cstat.symtab = symtab;
+  cstat.program = program;
+  cstat.error = error;
+  cstat.error_length = length;
+  cstat.pstat.input = expr;
+  cstat.token = expr;
+
+  while(!cstat.failed)
+  {
+    if(s_compile_token(&cstat) == END)
+    {
+      break;
+    }
+    if(cstat.pstat.curr_tok == PRINT)
+    {
+      continue;
+    }
+
+    // Only the last statement's value is the result
+    if(statements++)
+    {
+      s_emit(&cstat, EXP_OP_POP, 0);
+    }
+    s_compile_expression(&cstat, 0);
+    s_compile_number(&cstat);
+    if(cstat.pstat.curr_tok == END)
+    {
+      break;
+    }
+    if(cstat.pstat.curr_tok != PRINT)
+    {
+      s_compile_error(&cstat, "operator expected");
+    }
+  }
+
+  if(statements == 0)
+  {
+    s_compile_error(&cstat, "empty expression");
+  }
+  s_emit(&cstat, EXP_OP_END, 0);
+  return cstat.failed ? -1 : 0;
+}
+
+// Apply an operator to a value, or two (a being the left). Returns -1, and
+// no result, on a divide or modulus by zero.
+static inline int
+s_apply_operator(int op, unsigned long long a, unsigned long long b,
+                 unsigned long long* result)
+{
+  long long sv = 0;
+
+  switch(op)
+  {
+    case EXP_OP_NEG:  *result = -a; break;
+    case EXP_OP_NOT:  *result = ~a; break;
+    case EXP_OP_LNOT: *result = !a; break;
+
+    case EXP_OP_ABS:
+      sv = (long long)a;
+      *result = (sv < 0) ? -(unsigned long long)sv : a;
+      break;
+
+    case EXP_OP_MASK:
+      *result = s_mask_value((long long)a, (long long)b);
+      break;
+
+    case EXP_OP_DIV:
+    case EXP_OP_MOD:
+      if(b == 0)
+      {
+        return -1;
+      }
+      *result = (op == EXP_OP_DIV) ? a / b : a % b;
+      break;
+
+    case EXP_OP_SHL:  *result = a << (b & 63); break;
+    case EXP_OP_SHR:  *result = a >> (b & 63); break;
+    case EXP_OP_ADD:  *result = a + b; break;
+    case EXP_OP_SUB:  *result = a - b; break;
+    case EXP_OP_MUL:  *result = a * b; break;
+    case EXP_OP_AND:  *result = a & b; break;
+    case EXP_OP_OR:   *result = a | b; break;
+    case EXP_OP_XOR:  *result = a ^ b; break;
+    case EXP_OP_CE:   *result = a == b; break;
+    case EXP_OP_CNE:  *result = a != b; break;
+    case EXP_OP_CGT:  *result = a > b; break;
+    case EXP_OP_CLT:  *result = a < b; break;
+    case EXP_OP_CGE:  *result = a >= b; break;
+    case EXP_OP_CLE:  *result = a <= b; break;
+    case EXP_OP_LAND: *result = a && b; break;
+    case EXP_OP_LOR:  *result = a || b; break;
+
+    default:
+      return -1;
+  }
+  return 0;
+}
+
+// Compare two addresses, a and b, each upper then lower
+static inline unsigned long long
+s_wide_compare(int op, unsigned long long a0, unsigned long long a1,
+               unsigned long long b0, unsigned long long b1)
+{
+  unsigned long long result = 0;
+
+  // Upper halves decide it unless they're equal
+  if(a0 != b0)
+  {
+    a1 = a0;
+    b1 = b0;
+  }
+  s_apply_operator(op - EXP_OP_WCE + EXP_OP_CE, a1, b1, &result);
+  return result;
+}
+
+int
+exp_apply_operator(int op, unsigned long long a, unsigned long long b,
+                   unsigned long long* result)
+{
+  return s_apply_operator(op, a, b, result);
+}
+
+// Run a compiled expression, with its variables in slots. Returns -1, and
+// no result, on a divide or modulus by zero.
+int
+exp_run_program(const exp_program_t* program, unsigned long long* slots,
+                unsigned long long* result)
+{
+  unsigned long long stack[EXP_MAX_STACK];
+  unsigned long long* sp = stack;
+  const exp_insn_t* pc = program->code;
+
+  for(;; pc++)
+  {
+    switch(pc->op)
+    {
+      case EXP_OP_END:
+        *result = sp[-1];
+        return 0;
+
+      case EXP_OP_PUSH:  *sp++ = program->constants[pc->arg]; break;
+      case EXP_OP_LOAD:  *sp++ = slots[pc->arg]; break;
+      case EXP_OP_STORE: slots[pc->arg] = sp[-1]; break;
+      case EXP_OP_POP:   sp--; break;
+
+      case EXP_OP_NEG:
+      case EXP_OP_NOT:
+      case EXP_OP_LNOT:
+      case EXP_OP_ABS:
+        s_apply_operator(pc->op, sp[-1], 0, &sp[-1]);
+        break;
+
+      case EXP_OP_WNOT:
+        sp[-2] = ~sp[-2];
+        sp[-1] = ~sp[-1];
+        break;
+
+      case EXP_OP_WAND:
+      case EXP_OP_WOR:
+      case EXP_OP_WXOR:
+        sp -= 2;
+        s_apply_operator(pc->op - EXP_OP_WAND + EXP_OP_AND, sp[-2], sp[0], &sp[-2]);
+        s_apply_operator(pc->op - EXP_OP_WAND + EXP_OP_AND, sp[-1], sp[1], &sp[-1]);
+        break;
+
+      case EXP_OP_WCE:
+      case EXP_OP_WCNE:
+      case EXP_OP_WCGT:
+      case EXP_OP_WCLT:
+      case EXP_OP_WCGE:
+      case EXP_OP_WCLE:
+        sp -= 3;
+        sp[-1] = s_wide_compare(pc->op, sp[-1], sp[0], sp[1], sp[2]);
+        break;
+
+      default:
+        sp--;
+        if(s_apply_operator(pc->op, sp[-1], sp[0], &sp[-1]))
+        {
+          return -1;
+        }
+        break;
+    }
+  }
+}
+
 unsigned long long
 exp_ipv6_prefix_to_ull(struct in6_addr* ipv6)
 {
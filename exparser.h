@@ -40,10 +40,16 @@ extern "C" {
 #define EXP_FUNCTION_ABS       "abs"
 #define EXP_FUNCTION_MASK      "mask"
 
+// ADDR is the 128-bit value made of PREFIX (upper) and HOST (lower)
+#define EXP_NAME_ADDRESS       "ADDR"
+#define EXP_NAME_PREFIX        "PREFIX"
+#define EXP_NAME_HOST          "HOST"
+
 typedef enum Token_value {
         NAME,
         NUMBER,
         END,
+        ADDRESS,
         PLUS='+',
         MINUS='-',
         MUL='*',
@@ -71,6 +77,72 @@ typedef enum Token_value {
         CLE=EXP_RELATIONAL2|'<',
 } Token_value_t;
 
+// Compiled expressions (see exp_compile_expression())
+#define EXP_MAX_PROGRAM        (256)
+#define EXP_MAX_CONSTANTS      (64)
+#define EXP_MAX_STACK          (32)
+
+typedef enum Exp_opcode {
+        EXP_OP_END,             // Result is on top of the stack
+        EXP_OP_PUSH,            // Push constants[arg]
+        EXP_OP_LOAD,            // Push slots[arg]
+        EXP_OP_STORE,           // slots[arg] = top, which stays
+        EXP_OP_POP,
+        EXP_OP_NEG,
+        EXP_OP_NOT,
+        EXP_OP_LNOT,
+        EXP_OP_ABS,
+        EXP_OP_MASK,            // mask(next, top)
+        EXP_OP_ADD,
+        EXP_OP_SUB,
+        EXP_OP_MUL,
+        EXP_OP_DIV,
+        EXP_OP_MOD,
+        EXP_OP_AND,
+        EXP_OP_OR,
+        EXP_OP_XOR,
+        EXP_OP_SHL,
+        EXP_OP_SHR,
+        EXP_OP_CE,
+        EXP_OP_CNE,
+        EXP_OP_CGT,
+        EXP_OP_CLT,
+        EXP_OP_CGE,
+        EXP_OP_CLE,
+        EXP_OP_LAND,
+        EXP_OP_LOR,
+        EXP_OP_WNOT,            // Addresses, each an (upper, lower) pair
+        EXP_OP_WAND,            //  on the stack. In the same order as
+        EXP_OP_WOR,             //  the 64-bit ops.
+        EXP_OP_WXOR,
+        EXP_OP_WCE,
+        EXP_OP_WCNE,
+        EXP_OP_WCGT,
+        EXP_OP_WCLT,
+        EXP_OP_WCGE,
+        EXP_OP_WCLE,
+} Exp_opcode_t;
+
+typedef struct _exp_insn {
+  unsigned char op;
+  unsigned char arg;
+} exp_insn_t;
+
+typedef struct _exp_program {
+  int length;
+  int constant_count;
+  int depth;                    // Most the stack holds
+  exp_insn_t code[EXP_MAX_PROGRAM];
+  unsigned long long constants[EXP_MAX_CONSTANTS];
+} exp_program_t;
+
+// Variable names, to slots. Programs compiled against the same table
+// share their variables.
+typedef struct _exp_symtab {
+  int count;
+  char name[EXP_MAX_MAPPED_SYMBOLS][32];
+} exp_symtab_t;
+
 typedef struct _exp_parse_map {
   char name[32];
   unsigned long long value;
@@ -79,6 +151,7 @@ typedef struct _exp_parse_map {
 typedef struct _exp_pstat {
   int errors;
   unsigned long long number_value;
+  unsigned long long address_value[2];  // Upper, then lower 64 bits
   char string_value[256];
   Token_value_t curr_tok;
   char* input;
@@ -89,6 +162,14 @@ char* exp_get_library_version();
 int   exp_parse_expression(exp_pstat_t* pstat, char* expr, unsigned long long* result);
 int   exp_set_mapped_value(exp_pstat_t* pstat, char* name, unsigned long long value);
 
+int   exp_symbol_slot(exp_symtab_t* symtab, char* name);
+int   exp_compile_expression(exp_symtab_t* symtab, char* expr, exp_program_t* program,
+                             char* error, int length);
+int   exp_run_program(const exp_program_t* program, unsigned long long* slots,
+                      unsigned long long* result);
+int   exp_apply_operator(int op, unsigned long long a, unsigned long long b,
+                         unsigned long long* result);
+
 unsigned long long exp_ipv6_prefix_to_ull(struct in6_addr* ipv6);
 unsigned long long exp_ipv6_host_to_ull(struct in6_addr* ipv6);
 void exp_pull_hull_to_ipv6(unsigned long long prefix, unsigned long long host, struct in6_addr* ipv6);
@@ -1,56 +1,999 @@
 // Interface to the expression parser
 
-#include <stdio.h>
-#include <string.h>
-#include <netinet/ip6.h>
-
+#include "includes.h"
+#include "npd6.h"
 #include "expintf.h"
 #include "exparser.h"
 
-#define MAX_EXPRESSION_LENGTH  128
-#define MAX_EXPRESSION_ENTRIES 64
+// Each exprlist is compiled once, at config load. They share one set of
+// variables, PREFIX and HOST first.
+//
+// Once they're all in, buildExpressions() merges them. Each is run through
+// with nodes in place of values, giving a DAG over PREFIX and HOST in
+// which a subexpression used by several exprlists is only there once.
+// Most exprlists test some field, or a masked part of one, for a value
+// or a range: those testing the same field are put in a group, so a
+// target needs one look at the field per group rather than a run of
+// every exprlist. An exprlist that's no more than such a test is lowered
+// into its group's hash of values or array of ranges, and needs nothing
+// more. Where there's more to it, it's kept by the value it needs,
+// sorted. The rest are worked out in turn. Anything worked out - a
+// field, or an exprlist - has a plan: the nodes it needs, each once, in
+// order.
+//
+// Address ops on ADDR are split into ops on PREFIX and HOST here, so
+// (ADDR/64 == 2001:db8::/64) merges as PREFIX == 0x20010db800000000.
+//
+// An exprlist that reads a variable set where a divide by zero might
+// have stopped it being set can't be merged, and is run as it stands.
+
+static int            sExpression = 0;
+static int            sAlloc = 0;
+static exp_program_t* sPrograms = NULL;
+static exp_symtab_t   sSymbols;
+
+typedef struct _expr_node {
+  unsigned char op;             // EXP_OP_*: PUSH a constant, LOAD PREFIX or HOST
+  unsigned char fallible;       // Might divide by zero
+  int a, b;                     // Operands, -1 if none
+  unsigned long long value;     // PUSH's constant, LOAD's slot
+} expr_node_t;
+
+#define EXPR_MAX_PLAN 512
+
+typedef struct _expr_step {
+  unsigned char op;             // As the node
+  unsigned short a, b;          // Earlier steps
+  unsigned long long value;
+} expr_step_t;
+
+typedef struct _expr_plan {
+  int start, length;            // In sSteps[]
+} expr_plan_t;
+
+typedef struct _expr_entry {
+  unsigned long long value;     // What the group's field must be
+  expr_plan_t plan;             // The whole exprlist
+} expr_entry_t;
+
+typedef struct _expr_range {
+  unsigned long long low, high; // Inclusive
+} expr_range_t;
+
+typedef struct _expr_group {
+  int field;                    // The node tested
+  expr_plan_t plan;
+  unsigned long long* values;   // Hash of values which match outright
+  unsigned int valueMask;       // Its size - 1
+  int valueCount;
+  int hasEmpty;                 // EXPR_EMPTY is one of them
+  expr_range_t* ranges;         // Ranges which do, sorted and merged
+  int rangeCount, rangeAlloc;
+  expr_entry_t* entries;        // Values which need more, sorted
+  int count, alloc;
+} expr_group_t;
+
+#define EXPR_EMPTY (~0ULL)      // Free slot in a group's values
+
+static expr_node_t*  sNodes = NULL;
+static int           sNodeCount = 0;
+static int           sNodeAlloc = 0;
+static int*          sNodeHash = NULL;      // For sharing nodes
+static int           sNodeHashSize = 0;
+static expr_step_t*  sSteps = NULL;
+static int           sStepCount = 0;
+static int           sStepAlloc = 0;
+static int*          sPlanAt = NULL;        // Node's step while planning
+static expr_group_t* sGroups = NULL;
+static int           sGroupCount = 0;
+static expr_plan_t*  sOthers = NULL;        // Tried in turn
+static int           sOtherCount = 0;
+static int           sLastUnmerged = -1;    // Run programs up to this one
 
-static int  sExpression = 0;
-static char sExpressions[MAX_EXPRESSION_ENTRIES][MAX_EXPRESSION_LENGTH];
 
-int storeExpression(char* expression)
+void clearExpressions(void)
 {
-  if(sExpression >= MAX_EXPRESSION_ENTRIES)
+  int group;
+
+  for(group=0; group<sGroupCount; group++)
+  {
+    free(sGroups[group].values);
+    free(sGroups[group].ranges);
+    free(sGroups[group].entries);
+  }
+  free(sGroups);
+  free(sOthers);
+  free(sNodes);
+  free(sNodeHash);
+  free(sSteps);
+  sGroups = NULL;
+  sOthers = NULL;
+  sNodes = NULL;
+  sNodeHash = NULL;
+  sSteps = NULL;
+  sGroupCount = sOtherCount = sNodeCount = sNodeAlloc = sNodeHashSize = 0;
+  sStepCount = sStepAlloc = 0;
+  sLastUnmerged = -1;
+
+  sExpression = 0;
+  memset(&sSymbols, 0, sizeof(sSymbols));
+  exp_symbol_slot(&sSymbols, EXP_NAME_PREFIX);
+  exp_symbol_slot(&sSymbols, EXP_NAME_HOST);
+}
+
+int storeExpression(char* expression, char* error, int length)
+{
+  exp_program_t* programs;
+
+  if(sExpression >= sAlloc)
+  {
+    programs = realloc(sPrograms, (sAlloc ? sAlloc*2 : 64) * sizeof(exp_program_t));
+    if(programs == NULL)
+    {
+      snprintf(error, length, "out of memory");
+      return -1;
+    }
+    sPrograms = programs;
+    sAlloc = sAlloc ? sAlloc*2 : 64;
+  }
+  if(exp_compile_expression(&sSymbols, expression+sizeof("exprlist=")-1,
+                            &sPrograms[sExpression], error, length) < 0)
   {
     return -1;
   }
-  strncpy(&sExpressions[sExpression][0], expression+sizeof("exprlist=")-1, MAX_EXPRESSION_LENGTH);
-  sExpressions[sExpression][MAX_EXPRESSION_LENGTH-1] = 0;
   sExpression++;
   return 0;
 }
 
-int compareExpression(struct in6_addr* ipv6)
+
+static unsigned int s_node_hash(int op, int a, int b, unsigned long long value)
+{
+  unsigned long long h = value * 0x9e3779b97f4a7c15ULL;
+
+  h ^= ((unsigned long long)op << 56) ^ ((unsigned long long)(unsigned int)a << 28) ^ (unsigned int)b;
+  h *= 0xff51afd7ed558ccdULL;
+  return (unsigned int)(h >> 32);
+}
+
+static int s_node_rehash(void)
+{
+  int size = sNodeHashSize ? sNodeHashSize*2 : 1024, node;
+  unsigned int slot;
+  int* hash = malloc(size * sizeof(int));
+
+  if(hash == NULL)
+  {
+    return -1;
+  }
+  memset(hash, 0xff, size * sizeof(int));
+  for(node=0; node<sNodeCount; node++)
+  {
+    slot = s_node_hash(sNodes[node].op, sNodes[node].a, sNodes[node].b, sNodes[node].value);
+    while(hash[slot & (size-1)] >= 0)
+    {
+      slot++;
+    }
+    hash[slot & (size-1)] = node;
+  }
+  free(sNodeHash);
+  sNodeHash = hash;
+  sNodeHashSize = size;
+  return 0;
+}
+
+// The node for op on a and b, the same one each time it's asked for.
+// Constants are folded, and operands put in order so that (HOST & 1) and
+// (1 & HOST) are the same node. -1 if out of memory.
+static int s_node(int op, int a, int b, unsigned long long value)
+{
+  expr_node_t* nodes;
+  unsigned long long folded, constant;
+  unsigned int slot;
+  int node, swap;
+
+  if((op == EXP_OP_PUSH) || (op == EXP_OP_LOAD))
+  {
+    a = b = -1;
+  }
+  else if((a < 0) || ((b < 0) && (op >= EXP_OP_MASK)))
+  {
+    return -1;
+  }
+  else if((sNodes[a].op == EXP_OP_PUSH) && ((b < 0) || (sNodes[b].op == EXP_OP_PUSH)) &&
+          (exp_apply_operator(op, sNodes[a].value, (b < 0) ? 0 : sNodes[b].value, &folded) == 0))
+  {
+    return s_node(EXP_OP_PUSH, -1, -1, folded);
+  }
+  else if(op == EXP_OP_LNOT)
+  {
+    return s_node(EXP_OP_CE, a, s_node(EXP_OP_PUSH, -1, -1, 0), 0);
+  }
+  else if((op == EXP_OP_ADD) || (op == EXP_OP_MUL) || (op == EXP_OP_AND) || (op == EXP_OP_OR) ||
+          (op == EXP_OP_XOR) || (op == EXP_OP_CE) || (op == EXP_OP_CNE) ||
+          (op == EXP_OP_LAND) || (op == EXP_OP_LOR))
+  {
+    // Constants last
+    if((sNodes[a].op == EXP_OP_PUSH) ? (sNodes[b].op != EXP_OP_PUSH) :
+                                       ((sNodes[b].op != EXP_OP_PUSH) && (a > b)))
+    {
+      swap = a;
+      a = b;
+      b = swap;
+    }
+
+    // Nothing to do with all or none of the bits, or with a truth value
+    if(sNodes[b].op == EXP_OP_PUSH)
+    {
+      constant = sNodes[b].value;
+      if(((op == EXP_OP_AND) && (constant == ~0ULL)) ||
+         (((op == EXP_OP_OR) || (op == EXP_OP_XOR)) && (constant == 0)) ||
+         ((((op == EXP_OP_LAND) && constant) || ((op == EXP_OP_LOR) && !constant)) &&
+          (sNodes[a].op >= EXP_OP_CE) && (sNodes[a].op <= EXP_OP_LOR)))
+      {
+        return a;
+      }
+      if((op == EXP_OP_AND) && (constant == 0) && !sNodes[a].fallible)
+      {
+        return b;
+      }
+    }
+  }
+
+  if((sNodeCount+1)*2 > sNodeHashSize)
+  {
+    if(s_node_rehash())
+    {
+      return -1;
+    }
+  }
+  for(slot = s_node_hash(op, a, b, value); (node = sNodeHash[slot & (sNodeHashSize-1)]) >= 0; slot++)
+  {
+    if((sNodes[node].op == op) && (sNodes[node].a == a) && (sNodes[node].b == b) &&
+       (sNodes[node].value == value))
+    {
+      return node;
+    }
+  }
+
+  if(sNodeCount >= sNodeAlloc)
+  {
+    nodes = realloc(sNodes, (sNodeAlloc ? sNodeAlloc*2 : 256) * sizeof(expr_node_t));
+    if(nodes == NULL)
+    {
+      return -1;
+    }
+    sNodes = nodes;
+    sNodeAlloc = sNodeAlloc ? sNodeAlloc*2 : 256;
+  }
+  node = sNodeCount++;
+  sNodeHash[slot & (sNodeHashSize-1)] = node;
+  sNodes[node].op = op;
+  sNodes[node].a = a;
+  sNodes[node].b = b;
+  sNodes[node].value = value;
+  sNodes[node].fallible = ((a >= 0) && sNodes[a].fallible) || ((b >= 0) && sNodes[b].fallible) ||
+                          (((op == EXP_OP_DIV) || (op == EXP_OP_MOD)) &&
+                           ((sNodes[b].op != EXP_OP_PUSH) || (sNodes[b].value == 0)));
+  return node;
+}
+
+// List the nodes under this one, up to one more than a plan can have
+static void s_plan_mark(int node, int* marked)
+{
+  if((sPlanAt[node] != -1) || (marked[0] > EXPR_MAX_PLAN))
+  {
+    return;
+  }
+  sPlanAt[node] = -2;
+  marked[++marked[0]] = node;
+  if(sNodes[node].a >= 0)
+  {
+    s_plan_mark(sNodes[node].a, marked);
+  }
+  if(sNodes[node].b >= 0)
+  {
+    s_plan_mark(sNodes[node].b, marked);
+  }
+}
+
+static int s_int_compare(const void* a, const void* b)
 {
-  int expression = 0;
-  unsigned long long prefix = 0;
-  unsigned long long host = 0;
-  unsigned long long result = 0;
-  exp_pstat_t pstat;
+  return *(const int*)a - *(const int*)b;
+}
+
+// The steps to work out a node: those under it, each once. A node's
+// operands are always older than it, so they go in order of age. -1 if
+// there'd be too many, or no memory for them.
+static int s_plan(int root, expr_plan_t* plan)
+{
+  int marked[EXPR_MAX_PLAN + 2], step, node, rc = -1;
+  expr_step_t* steps;
+
+  marked[0] = 0;
+  s_plan_mark(root, marked);
+  if(marked[0] > EXPR_MAX_PLAN)
+  {
+    goto done;
+  }
+  qsort(marked+1, marked[0], sizeof(int), s_int_compare);
+
+  if(sStepCount + marked[0] > sStepAlloc)
+  {
+    steps = realloc(sSteps, (sStepAlloc*2 + marked[0]) * sizeof(expr_step_t));
+    if(steps == NULL)
+    {
+      goto done;
+    }
+    sSteps = steps;
+    sStepAlloc = sStepAlloc*2 + marked[0];
+  }
+
+  plan->start = sStepCount;
+  plan->length = marked[0];
+  for(step=0; step<marked[0]; step++)
+  {
+    node = marked[step+1];
+    sPlanAt[node] = step;
+    sSteps[sStepCount].op = sNodes[node].op;
+    sSteps[sStepCount].a = (sNodes[node].a >= 0) ? sPlanAt[sNodes[node].a] : 0;
+    sSteps[sStepCount].b = (sNodes[node].b >= 0) ? sPlanAt[sNodes[node].b] : 0;
+    sSteps[sStepCount++].value = sNodes[node].value;
+  }
+  rc = 0;
+
+done:
+  for(step=0; step<marked[0]; step++)
+  {
+    sPlanAt[marked[step+1]] = -1;
+  }
+  return rc;
+}
+
+// Carry out a plan. Returns -1 on a divide by zero, just as the program it
+// came from would have: both sides of && and || are worked out, so that
+// happens the same way too.
+static int s_run_plan(const expr_plan_t* plan, const unsigned long long* in,
+                      unsigned long long* result)
+{
+  unsigned long long value[EXPR_MAX_PLAN];
+  const expr_step_t* step = &sSteps[plan->start];
+  int loop;
+
+  for(loop=0; loop<plan->length; loop++, step++)
+  {
+    switch(step->op)
+    {
+      case EXP_OP_PUSH:
+        value[loop] = step->value;
+        break;
+      case EXP_OP_LOAD:
+        value[loop] = in[step->value];
+        break;
+      default:
+        if(exp_apply_operator(step->op, value[step->a], value[step->b], &value[loop]))
+        {
+          return -1;
+        }
+        break;
+    }
+  }
+  *result = value[plan->length-1];
+  return 0;
+}
+
+// An address op, as ops on the halves. operand[] is the stack from the
+// first address's upper half on, and gets the result. Returns how many
+// nodes that is.
+static int s_wide_node(int op, int* operand)
+{
+  int narrow, upper;
+
+  if(op == EXP_OP_WNOT)
+  {
+    operand[0] = s_node(EXP_OP_NOT, operand[0], -1, 0);
+    operand[1] = s_node(EXP_OP_NOT, operand[1], -1, 0);
+    return 2;
+  }
+  if(op <= EXP_OP_WXOR)
+  {
+    narrow = op - EXP_OP_WAND + EXP_OP_AND;
+    operand[0] = s_node(narrow, operand[0], operand[2], 0);
+    operand[1] = s_node(narrow, operand[1], operand[3], 0);
+    return 2;
+  }
+
+  narrow = op - EXP_OP_WCE + EXP_OP_CE;
+  switch(op)
+  {
+    case EXP_OP_WCE:
+    case EXP_OP_WCNE:
+      upper = s_node(narrow, operand[0], operand[2], 0);
+      operand[0] = s_node((op == EXP_OP_WCE) ? EXP_OP_LAND : EXP_OP_LOR, upper,
+                          s_node(narrow, operand[1], operand[3], 0), 0);
+      break;
+    default:
+      // Upper halves decide it unless they're equal
+      upper = s_node(((op == EXP_OP_WCGT) || (op == EXP_OP_WCGE)) ? EXP_OP_CGT : EXP_OP_CLT,
+                     operand[0], operand[2], 0);
+      operand[0] = s_node(EXP_OP_LOR, upper,
+                          s_node(EXP_OP_LAND, s_node(EXP_OP_CE, operand[0], operand[2], 0),
+                                 s_node(narrow, operand[1], operand[3], 0), 0), 0);
+      break;
+  }
+  return 1;
+}
+
+// Run a program through with nodes in place of values. slots[] holds the
+// variables' nodes as the programs before it left them, and unknown[]
+// those which might not have been set. Returns its node, or -1 if it
+// can't be followed.
+static int s_expression_tree(const exp_program_t* program, int* slots, unsigned char* unknown)
+{
+  int stack[EXP_MAX_STACK], sp = 0, pc, node = -1, failed = 0, count;
+  const exp_insn_t* insn;
+
+  for(pc=0; pc<program->length; pc++)
+  {
+    insn = &program->code[pc];
+    switch(insn->op)
+    {
+      case EXP_OP_END:
+        return stack[sp-1];
+      case EXP_OP_PUSH:
+        node = s_node(EXP_OP_PUSH, -1, -1, program->constants[insn->arg]);
+        break;
+      case EXP_OP_LOAD:
+        if(unknown[insn->arg])
+        {
+          return -1;
+        }
+        node = slots[insn->arg];
+        break;
+      case EXP_OP_STORE:
+        // Not set if the program's already stopped
+        slots[insn->arg] = stack[sp-1];
+        if(failed)
+        {
+          unknown[insn->arg] = 1;
+        }
+        continue;
+      case EXP_OP_POP:
+        // A divide by zero still counts, even in a statement that's dropped
+        if(sNodes[stack[--sp]].fallible)
+        {
+          return -1;
+        }
+        continue;
+      case EXP_OP_NEG:
+      case EXP_OP_NOT:
+      case EXP_OP_LNOT:
+      case EXP_OP_ABS:
+        node = s_node(insn->op, stack[--sp], -1, 0);
+        break;
+      case EXP_OP_WNOT:
+      case EXP_OP_WAND:
+      case EXP_OP_WOR:
+      case EXP_OP_WXOR:
+      case EXP_OP_WCE:
+      case EXP_OP_WCNE:
+      case EXP_OP_WCGT:
+      case EXP_OP_WCLT:
+      case EXP_OP_WCGE:
+      case EXP_OP_WCLE:
+        sp -= (insn->op == EXP_OP_WNOT) ? 2 : 4;
+        for(count = s_wide_node(insn->op, &stack[sp]); count > 0; count--, sp++)
+        {
+          if(stack[sp] < 0)
+          {
+            return -1;
+          }
+        }
+        continue;
+      default:
+        sp -= 2;
+        node = s_node(insn->op, stack[sp], stack[sp+1], 0);
+        break;
+    }
+    if(node < 0)
+    {
+      return -1;
+    }
+    failed |= sNodes[node].fallible;
+    stack[sp++] = node;
+  }
+  return -1;
+}
+
+// Count, for each field == value test, the exprlists which must pass it
+static void s_expression_tests(int root, int* uses)
+{
+  if(sNodes[root].op == EXP_OP_LAND)
+  {
+    s_expression_tests(sNodes[root].a, uses);
+    s_expression_tests(sNodes[root].b, uses);
+  }
+  else if((sNodes[root].op == EXP_OP_CE) && (sNodes[sNodes[root].b].op == EXP_OP_PUSH))
+  {
+    uses[root]++;
+  }
+}
+
+// The field == value test root must pass that fewest others must, if any.
+// ADDR == 2001:db8::5 is then looked up by HOST rather than PREFIX.
+static int s_expression_test(int root, const int* uses)
+{
+  int a, b;
+
+  if(sNodes[root].op == EXP_OP_LAND)
+  {
+    a = s_expression_test(sNodes[root].a, uses);
+    b = s_expression_test(sNodes[root].b, uses);
+    return ((a < 0) || ((b >= 0) && (uses[b] < uses[a]))) ? b : a;
+  }
+  if((sNodes[root].op == EXP_OP_CE) && (sNodes[sNodes[root].b].op == EXP_OP_PUSH))
+  {
+    return root;
+  }
+  return -1;
+}
+
+// Whether a node is no more than a test of one field against constants:
+// ==, <, <=, >, >= or && of those. If so, the values which pass are low
+// to high, and none do if low > high.
+static int s_expression_range(int node, int* field, unsigned long long* low,
+                              unsigned long long* high)
+{
+  const expr_node_t* n = &sNodes[node];
+  unsigned long long value, low2, high2;
+  int op = n->op, field2;
+
+  if(op == EXP_OP_LAND)
+  {
+    if(s_expression_range(n->a, field, low, high) ||
+       s_expression_range(n->b, &field2, &low2, &high2) || (field2 != *field))
+    {
+      return -1;
+    }
+    *low = (low2 > *low) ? low2 : *low;
+    *high = (high2 < *high) ? high2 : *high;
+    return 0;
+  }
+  if((op < EXP_OP_CE) || (op > EXP_OP_CLE) || (op == EXP_OP_CNE))
+  {
+    return -1;
+  }
+
+  if((sNodes[n->b].op == EXP_OP_PUSH) && (sNodes[n->a].op != EXP_OP_PUSH))
+  {
+    *field = n->a;
+    value = sNodes[n->b].value;
+  }
+  else if((sNodes[n->a].op == EXP_OP_PUSH) && (sNodes[n->b].op != EXP_OP_PUSH))
+  {
+    // value < field is field > value, and so on
+    *field = n->b;
+    value = sNodes[n->a].value;
+    op = (op == EXP_OP_CGT) ? EXP_OP_CLT : (op == EXP_OP_CLT) ? EXP_OP_CGT :
+         (op == EXP_OP_CGE) ? EXP_OP_CLE : (op == EXP_OP_CLE) ? EXP_OP_CGE : op;
+  }
+  else
+  {
+    return -1;
+  }
 
-  memset(&pstat, 0, sizeof(exp_pstat_t));
+  *low = 0;
+  *high = ~0ULL;
+  switch(op)
+  {
+    case EXP_OP_CE:  *low = *high = value; break;
+    case EXP_OP_CGE: *low = value; break;
+    case EXP_OP_CLE: *high = value; break;
+    case EXP_OP_CGT: *low = value + 1; break;
+    case EXP_OP_CLT: *high = value - 1; break;
+  }
 
-  // Convert the IPv6 address into two 64-bit values
-  prefix = exp_ipv6_prefix_to_ull(ipv6);
-  host = exp_ipv6_host_to_ull(ipv6);
+  // Nothing is above the top or below zero
+  if(((op == EXP_OP_CGT) && (value == ~0ULL)) || ((op == EXP_OP_CLT) && (value == 0)))
+  {
+    *low = 1;
+    *high = 0;
+  }
+  return 0;
+}
 
-  // Preload variables with the 64-bit values
-  exp_set_mapped_value(&pstat, "PREFIX", prefix);
-  exp_set_mapped_value(&pstat, "HOST", host);
+static int s_entry_compare(const void* a, const void* b)
+{
+  const expr_entry_t* ea = a;
+  const expr_entry_t* eb = b;
 
-  // Compare each compression to the values
+  return (ea->value < eb->value) ? -1 : (ea->value > eb->value);
+}
+
+static int s_range_compare(const void* a, const void* b)
+{
+  const expr_range_t* ra = a;
+  const expr_range_t* rb = b;
+
+  return (ra->low < rb->low) ? -1 : (ra->low > rb->low);
+}
+
+static unsigned int s_value_hash(unsigned long long value)
+{
+  return (unsigned int)((value * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+// Room for one more in an array that grows as needed
+static int s_grow(void** array, int* alloc, int count, size_t size)
+{
+  void* grown;
+
+  if(count < *alloc)
+  {
+    return 0;
+  }
+  grown = realloc(*array, (*alloc ? *alloc*2 : 8) * size);
+  if(grown == NULL)
+  {
+    return -1;
+  }
+  *array = grown;
+  *alloc = *alloc ? *alloc*2 : 8;
+  return 0;
+}
+
+// The group for a field, made if need be. -1 if it can't be.
+static int s_group(int field, int* groupOf)
+{
+  expr_group_t* g;
+
+  if(groupOf[field] >= 0)
+  {
+    return groupOf[field];
+  }
+  g = &sGroups[sGroupCount];
+  memset(g, 0, sizeof(expr_group_t));
+  g->field = field;
+  if(s_plan(field, &g->plan))
+  {
+    return -1;
+  }
+  return groupOf[field] = sGroupCount++;
+}
+
+// Merge a group's ranges, and take those of one value out into the hash
+static int s_group_finish(expr_group_t* g)
+{
+  expr_range_t* r = g->ranges;
+  unsigned int slot, size = 8;
+  int in, out = 0, values = 0;
+
+  qsort(g->entries, g->count, sizeof(expr_entry_t), s_entry_compare);
+  if(g->rangeCount == 0)
+  {
+    return 0;
+  }
+
+  qsort(r, g->rangeCount, sizeof(expr_range_t), s_range_compare);
+  for(in=1; in<g->rangeCount; in++)
+  {
+    if((r[out].high == ~0ULL) || (r[in].low <= r[out].high + 1))
+    {
+      r[out].high = (r[in].high > r[out].high) ? r[in].high : r[out].high;
+    }
+    else
+    {
+      r[++out] = r[in];
+    }
+  }
+  g->rangeCount = out + 1;
+
+  for(in=0; in<g->rangeCount; in++)
+  {
+    values += (r[in].low == r[in].high);
+  }
+  if(values)
+  {
+    while(size < (unsigned int)values*2)
+    {
+      size *= 2;
+    }
+    g->values = malloc(size * sizeof(unsigned long long));
+    if(g->values == NULL)
+    {
+      return -1;
+    }
+    memset(g->values, 0xff, size * sizeof(unsigned long long));
+    g->valueMask = size - 1;
+  }
+  for(in=0, out=0; in<g->rangeCount; in++)
+  {
+    if(r[in].low != r[in].high)
+    {
+      r[out++] = r[in];
+    }
+    else if(r[in].low == EXPR_EMPTY)
+    {
+      g->hasEmpty = 1;
+    }
+    else
+    {
+      for(slot=s_value_hash(r[in].low); g->values[slot & g->valueMask] != EXPR_EMPTY; slot++)
+      {
+      }
+      g->values[slot & g->valueMask] = r[in].low;
+      g->valueCount++;
+    }
+  }
+  g->rangeCount = out;
+  return 0;
+}
+
+// Whether a group's hash or ranges have a value
+static int s_group_lowered(const expr_group_t* g, unsigned long long value)
+{
+  unsigned int slot;
+  int lo, hi, mid;
+
+  if(value == EXPR_EMPTY)
+  {
+    if(g->hasEmpty)
+    {
+      return 1;
+    }
+  }
+  else if(g->valueCount)
+  {
+    for(slot=s_value_hash(value); g->values[slot & g->valueMask] != EXPR_EMPTY; slot++)
+    {
+      if(g->values[slot & g->valueMask] == value)
+      {
+        return 1;
+      }
+    }
+  }
+
+  // The last range starting at or before it
+  for(lo=0, hi=g->rangeCount; lo<hi; )
+  {
+    mid = (lo+hi) / 2;
+    if(g->ranges[mid].low <= value)
+    {
+      lo = mid+1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+  return (lo > 0) && (value <= g->ranges[lo-1].high);
+}
+
+int buildExpressions(void)
+{
+  int slots[EXP_MAX_MAPPED_SYMBOLS], *groupOf = NULL, *roots = NULL, *uses = NULL;
+  unsigned char unknown[EXP_MAX_MAPPED_SYMBOLS];
+  int expression, slot, root, test, field, group, merged = 0, lowered = 0;
+  int values = 0, ranges = 0;
+  unsigned long long low, high;
+  expr_group_t* g;
+  size_t bytes;
+
+  if(sExpression == 0)
+  {
+    return 0;
+  }
+
+  memset(unknown, 0, sizeof(unknown));
+  for(slot=0; slot<EXP_MAX_MAPPED_SYMBOLS; slot++)
+  {
+    slots[slot] = s_node(EXP_OP_PUSH, -1, -1, 0);
+  }
+  slots[EXPR_SLOT_PREFIX] = s_node(EXP_OP_LOAD, -1, -1, EXPR_SLOT_PREFIX);
+  slots[EXPR_SLOT_HOST] = s_node(EXP_OP_LOAD, -1, -1, EXPR_SLOT_HOST);
+  roots = malloc(sExpression * sizeof(int));
+  if((slots[EXPR_SLOT_HOST] < 0) || (roots == NULL))
+  {
+    goto nomem;
+  }
+
+  for(expression=0; expression<sExpression; expression++)
+  {
+    roots[expression] = s_expression_tree(&sPrograms[expression], slots, unknown);
+    if(roots[expression] < 0)
+    {
+      // Whatever it sets can't be followed from here on
+      for(slot=0; slot<sPrograms[expression].length; slot++)
+      {
+        if(sPrograms[expression].code[slot].op == EXP_OP_STORE)
+        {
+          unknown[sPrograms[expression].code[slot].arg] = 1;
+        }
+      }
+    }
+  }
+
+  // Sort them out by field
+  groupOf = malloc(sNodeCount * sizeof(int));
+  uses = calloc(sNodeCount, sizeof(int));
+  sPlanAt = malloc(sNodeCount * sizeof(int));
+  sGroups = malloc(sExpression * sizeof(expr_group_t));
+  sOthers = malloc(sExpression * sizeof(expr_plan_t));
+  if((groupOf == NULL) || (uses == NULL) || (sPlanAt == NULL) || (sGroups == NULL) ||
+     (sOthers == NULL))
+  {
+    goto nomem;
+  }
+  memset(groupOf, 0xff, sNodeCount * sizeof(int));
+  memset(sPlanAt, 0xff, sNodeCount * sizeof(int));
   for(expression=0; expression<sExpression; expression++)
   {
-    pstat.errors = 0; result = 0;
-    exp_parse_expression(&pstat, sExpressions[expression], &result);
-    if(pstat.errors == 0)
+    if(roots[expression] >= 0)
+    {
+      s_expression_tests(roots[expression], uses);
+    }
+  }
+  for(expression=0; expression<sExpression; expression++)
+  {
+    if((root = roots[expression]) < 0)
+    {
+      continue;
+    }
+
+    if(s_expression_range(root, &field, &low, &high) == 0)
     {
-      if(result != 0)
+      // One that can never match needn't go anywhere
+      if(low > high)
+      {
+        lowered++;
+        continue;
+      }
+      if((group = s_group(field, groupOf)) >= 0)
+      {
+        g = &sGroups[group];
+        if(s_grow((void**)&g->ranges, &g->rangeAlloc, g->rangeCount, sizeof(expr_range_t)))
+        {
+          goto nomem;
+        }
+        g->ranges[g->rangeCount].low = low;
+        g->ranges[g->rangeCount++].high = high;
+        lowered++;
+        continue;
+      }
+    }
+    else if((test = s_expression_test(root, uses)) >= 0)
+    {
+      if((group = s_group(sNodes[test].a, groupOf)) >= 0)
+      {
+        g = &sGroups[group];
+        if(s_grow((void**)&g->entries, &g->alloc, g->count, sizeof(expr_entry_t)))
+        {
+          goto nomem;
+        }
+        if(s_plan(root, &g->entries[g->count].plan) == 0)
+        {
+          g->entries[g->count++].value = sNodes[sNodes[test].b].value;
+          continue;
+        }
+      }
+    }
+    else if(s_plan(root, &sOthers[sOtherCount]) == 0)
+    {
+      sOtherCount++;
+      continue;
+    }
+    roots[expression] = -1;
+  }
+
+  // Anything left out is run as it stands
+  for(expression=0; expression<sExpression; expression++)
+  {
+    if(roots[expression] < 0)
+    {
+      sLastUnmerged = expression;
+    }
+    else
+    {
+      merged++;
+    }
+  }
+
+  bytes = sNodeCount * sizeof(expr_node_t) + sStepCount * sizeof(expr_step_t);
+  for(group=0; group<sGroupCount; group++)
+  {
+    g = &sGroups[group];
+    if(s_group_finish(g))
+    {
+      goto nomem;
+    }
+    values += g->valueCount + g->hasEmpty;
+    ranges += g->rangeCount;
+    bytes += (g->valueCount ? (g->valueMask+1) * sizeof(unsigned long long) : 0) +
+             g->rangeCount * sizeof(expr_range_t) + g->count * sizeof(expr_entry_t);
+  }
+
+  flog(LOG_INFO, "Exprlist: %d of %d lowered into %d values and %d ranges", lowered,
+       sExpression, values, ranges);
+  flog(LOG_INFO, "Exprlist: %d merged into %d nodes, %d bytes - %d in %d groups, "
+       "%d in turn, %d unmerged", merged, sNodeCount, (int)bytes, merged - sOtherCount,
+       sGroupCount, sOtherCount, sExpression - merged);
+  free(groupOf);
+  free(uses);
+  free(sPlanAt);
+  sPlanAt = NULL;
+  free(roots);
+  return 0;
+
+nomem:
+  flog(LOG_ERR, "Out of memory merging exprlists");
+  free(groupOf);
+  free(uses);
+  free(sPlanAt);
+  sPlanAt = NULL;
+  free(roots);
+  return -1;
+}
+
+int compareExpression(struct in6_addr* ipv6)
+{
+  int expression = 0, group, lo, hi, mid;
+  unsigned long long slots[EXP_MAX_MAPPED_SYMBOLS];
+  unsigned long long result = 0, field;
+  const expr_group_t* g;
+
+  // PREFIX and HOST are the two 64-bit halves of the address
+  slots[EXPR_SLOT_PREFIX] = exp_ipv6_prefix_to_ull(ipv6);
+  slots[EXPR_SLOT_HOST] = exp_ipv6_host_to_ull(ipv6);
+
+  // Each group's field, then its lowered exprlists, then any others
+  // needing that value
+  for(group=0; group<sGroupCount; group++)
+  {
+    g = &sGroups[group];
+    if(s_run_plan(&g->plan, slots, &field))
+    {
+      continue;
+    }
+    if(s_group_lowered(g, field))
+    {
+      return 1;
+    }
+    for(lo=0, hi=g->count; lo<hi; )
+    {
+      mid = (lo+hi) / 2;
+      if(g->entries[mid].value < field)
+      {
+        lo = mid+1;
+      }
+      else
+      {
+        hi = mid;
+      }
+    }
+    for(; (lo < g->count) && (g->entries[lo].value == field); lo++)
+    {
+      if((s_run_plan(&g->entries[lo].plan, slots, &result) == 0) && (result != 0))
+      {
+        return 1;
+      }
+    }
+  }
+
+  for(expression=0; expression<sOtherCount; expression++)
+  {
+    if((s_run_plan(&sOthers[expression], slots, &result) == 0) && (result != 0))
+    {
+      return 1;
+    }
+  }
+
+  // Those that couldn't be merged. Variables start from zero for each
+  // target, and one that divides by zero doesn't match.
+  if(sLastUnmerged >= 0)
+  {
+    memset(slots+2, 0, (sSymbols.count-2) * sizeof(slots[0]));
+    for(expression=0; expression<=sLastUnmerged; expression++)
+    {
+      if((exp_run_program(&sPrograms[expression], slots, &result) == 0) && (result != 0))
       {
         return 1;
       }
@@ -59,3 +1002,13 @@ int compareExpression(struct in6_addr* ipv6)
   return 0;
 }
 
+int countExpressions(void)
+{
+  return sExpression;
+}
+
+// For filter.c to translate
+const exp_program_t* getExpression(int expression)
+{
+  return &sPrograms[expression];
+}
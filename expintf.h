@@ -1,5 +1,15 @@
 // Interface to expression parser
 
-int storeExpression(char* expression);
+// Where compiled expressions find the target's halves
+#define EXPR_SLOT_PREFIX 0
+#define EXPR_SLOT_HOST   1
+
+struct _exp_program;
+
+void clearExpressions(void);
+int storeExpression(char* expression, char* error, int length);
+int buildExpressions(void);
 int compareExpression(struct in6_addr* ipv6);
+int countExpressions(void);
+const struct _exp_program* getExpression(int expression);
 
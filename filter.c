@@ -0,0 +1,1417 @@
+/*
+ *   This software is Copyright 2011 by Sean Groarke <sgroarke@gmail.com>
+ *   All rights reserved.
+ *
+ *   This file is part of npd6.
+ *
+ *   npd6 is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   npd6 is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with npd6.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* $Id$
+ * $HeadURL$
+ */
+
+/*
+ * Generation of the per-interface socket filter. Rather than a fixed
+ * "is it an NS?" filter, each packet socket gets one built from the
+ * config, so that the kernel throws away everything processNS() would
+ * only have discarded anyway.
+ */
+
+#include "includes.h"
+#include "npd6.h"
+#include "expintf.h"
+#include "exparser.h"
+#include "ebpf.h"
+
+// Jump targets, resolved once the whole program is laid out. Anything
+// >= 0 is a plain relative skip.
+#define NSF_DROP        -1
+#define NSF_ACCEPT      -2
+#define NSF_LABEL(l)    (-3 - (l))      // Local to an exprlist's code
+
+// Accepting returns. An eBPF filter goes on from an accept to check the
+// addrlist map, but not from a final one.
+#define NSF_RET_ACCEPT  0xffffffff
+#define NSF_RET_FINAL   0xfffffffe
+
+// Offsets into the frame
+#define NSF_IP6         ETH_HLEN
+#define NSF_ICMP6       (ETH_HLEN + sizeof(struct ip6_hdr))
+#define NSF_SRC         (NSF_IP6 + offsetof(struct ip6_hdr, ip6_src))
+#define NSF_DST         (NSF_IP6 + offsetof(struct ip6_hdr, ip6_dst))
+#define NSF_TARGET      (NSF_ICMP6 + offsetof(struct nd_neighbor_solicit, nd_ns_target))
+#define NSF_MINLEN      (NSF_ICMP6 + sizeof(struct nd_neighbor_solicit))
+
+#define NSF_MAXLABELS   256
+
+// Where the eBPF filter keeps cBPF's M[]: under the map key on the stack
+#define NSF_EBPF_MEM(k) (-(int)(sizeof(struct in6_addr) + BPF_MEMWORDS*4) + (int)(k)*4)
+
+struct nsFilter {
+    struct sock_filter  insn[NSFILTER_MAXINSNS];
+    int                 jt[NSFILTER_MAXINSNS];
+    int                 jf[NSFILTER_MAXINSNS];
+    unsigned int        len;
+    int                 full;           // Ran out of room
+    int                 labelAt[NSF_MAXLABELS];
+    int                 labels;
+    unsigned int        heldAt;         // A is still M[heldMem] if nothing
+    unsigned int        heldMem;        //  has been added since
+};
+
+// The eBPF filters' addrlist map, shared by all interfaces and kept
+// across reloads.
+static int              listMapFd = -1;
+static int              listMapOK;
+
+
+static void nsf_stmt(struct nsFilter *nf, unsigned short code, unsigned int k)
+{
+    if (nf->len >= NSFILTER_MAXINSNS)
+    {
+        nf->full = 1;
+        return;
+    }
+    nf->jt[nf->len] = nf->jf[nf->len] = 0;
+    nf->insn[nf->len++] = (struct sock_filter)BPF_STMT(code, k);
+}
+
+static void nsf_jump(struct nsFilter *nf, unsigned short code, unsigned int k, int jt, int jf)
+{
+    if (nf->len >= NSFILTER_MAXINSNS)
+    {
+        nf->full = 1;
+        return;
+    }
+    nf->jt[nf->len] = jt;
+    nf->jf[nf->len] = jf;
+    nf->insn[nf->len++] = (struct sock_filter)BPF_JUMP(code, k, 0, 0);
+}
+
+// Load the 32-bit word at off and insist on it equalling val
+static void nsf_word_eq(struct nsFilter *nf, unsigned int off, uint32_t val, int jf)
+{
+    nsf_stmt(nf, BPF_LD|BPF_W|BPF_ABS, off);
+    nsf_jump(nf, BPF_JMP|BPF_JEQ|BPF_K, val, 0, jf);
+}
+
+// Compare the target with addr, falling through if equal and skipping
+// the following insn otherwise. Takes 8 insns.
+static void nsf_target_eq(struct nsFilter *nf, struct in6_addr *addr)
+{
+    int         word;
+    uint32_t    val;
+
+    for (word = 0; word < 4; word++)
+    {
+        memcpy(&val, &addr->s6_addr[word*4], sizeof(val));
+        nsf_word_eq(nf, NSF_TARGET + word*4, ntohl(val), (3-word)*2 + 1);
+    }
+}
+
+/*
+ * exprlists in the filter. Each compiled expression (see exparser.c) is
+ * run through symbolically, giving a tree over PREFIX and HOST. Those
+ * with nothing cBPF can't do - abs(), mask() of anything but constants,
+ * multiply, divide or modulus by anything but a power of 2, shifts by
+ * anything but a constant - become code for the filter. The rest, and
+ * any that read a variable one of the rest sets, are left to processNS().
+ *
+ * cBPF works in 32 bits, so each 64-bit value is handled as two halves.
+ * A half is a constant, a word of the target, or one of the scratch
+ * words M[]. Halves known at load time are folded away, so that e.g.
+ * (HOST & 0xffff) == 0x555 comes down to a load, an and and a jump.
+ */
+
+#define NSF_EXPRNODES   4096
+
+struct nsfNode {
+    unsigned char   op;             // EXP_OP_*: PUSH is a constant, LOAD
+    int             kid[2];         //  one of the target's 64-bit halves
+    uint64_t        value;          // The constant, or the half's offset
+};
+
+static struct nsfNode   exprNodes[NSF_EXPRNODES];
+static int              exprNodeCount;
+static int              *exprRoots;     // Per expression, -1 if untranslatable
+static int              exprRootAlloc;
+static int              exprsInFilter;  // As built by the last build_ns_filter()
+
+#define NSF_HALF_K      0
+#define NSF_HALF_PKT    1
+#define NSF_HALF_MEM    2
+
+struct nsfHalf {
+    int             kind;
+    uint32_t        k;              // Constant, packet offset or M[] index
+};
+
+struct nsfValue {
+    struct nsfHalf  half[2];        // Upper 32 bits, then lower
+};
+
+
+static int nsf_node(int op, int a, int b, uint64_t value)
+{
+    if (exprNodeCount >= NSF_EXPRNODES)
+        return -1;
+    exprNodes[exprNodeCount].op = op;
+    exprNodes[exprNodeCount].kid[0] = a;
+    exprNodes[exprNodeCount].kid[1] = b;
+    exprNodes[exprNodeCount].value = value;
+    return exprNodeCount++;
+}
+
+#define nsf_const(value)    nsf_node(EXP_OP_PUSH, -1, -1, (value))
+#define nsf_is_const(node)  (exprNodes[node].op == EXP_OP_PUSH)
+
+// A node for op on a (and b), folded if it can be, and rewritten into the
+// ops nsf_gen_value() and nsf_gen_cond() know. -1 if cBPF can't do it.
+static int nsf_op(int op, int args, int a, int b)
+{
+    unsigned long long  value;
+    int                 swap;
+
+    if ( (a < 0) || ((args == 2) && (b < 0)) )
+        return -1;
+
+    if ( nsf_is_const(a) && ((args == 1) || nsf_is_const(b)) )
+    {
+        // Just as processNS() would work it out
+        if (exp_apply_operator(op, exprNodes[a].value, (args == 2) ? exprNodes[b].value : 0, &value))
+            return -1;
+        return nsf_const(value);
+    }
+
+    switch (op)
+    {
+        case EXP_OP_NEG:
+            return nsf_op(EXP_OP_SUB, 2, nsf_const(0), a);
+        case EXP_OP_NOT:
+            return nsf_op(EXP_OP_XOR, 2, a, nsf_const(~0ULL));
+        case EXP_OP_LNOT:
+            return nsf_op(EXP_OP_CE, 2, a, nsf_const(0));
+        case EXP_OP_ABS:
+        case EXP_OP_MASK:
+            return -1;
+
+        case EXP_OP_MUL:
+            if (nsf_is_const(a))
+            {
+                swap = a;
+                a = b;
+                b = swap;
+            }
+            value = exprNodes[b].value;
+            if (!nsf_is_const(b) || (value & (value - 1)))
+                return -1;
+            if (value == 0)
+                return b;
+            return nsf_op(EXP_OP_SHL, 2, a, nsf_const(__builtin_ctzll(value)));
+
+        case EXP_OP_DIV:
+        case EXP_OP_MOD:
+            value = exprNodes[b].value;
+            if (!nsf_is_const(b) || (value == 0) || (value & (value - 1)))
+                return -1;
+            if (op == EXP_OP_MOD)
+                return nsf_op(EXP_OP_AND, 2, a, nsf_const(value - 1));
+            return nsf_op(EXP_OP_SHR, 2, a, nsf_const(__builtin_ctzll(value)));
+
+        case EXP_OP_SHL:
+        case EXP_OP_SHR:
+            if (!nsf_is_const(b))
+                return -1;
+            if ((exprNodes[b].value & 63) == 0)
+                return a;
+            b = nsf_const(exprNodes[b].value & 63);
+            return (b < 0) ? -1 : nsf_node(op, a, b, 0);
+
+        default:
+            return nsf_node(op, a, b, 0);
+    }
+}
+
+// An address op, as ops on the halves. operand[] is the stack from the
+// first address's upper half on, and gets the result. Returns how many
+// nodes that is.
+static int nsf_wide_op(int op, int *operand)
+{
+    int     narrow, upper;
+
+    if (op == EXP_OP_WNOT)
+    {
+        operand[0] = nsf_op(EXP_OP_NOT, 1, operand[0], -1);
+        operand[1] = nsf_op(EXP_OP_NOT, 1, operand[1], -1);
+        return 2;
+    }
+    if (op <= EXP_OP_WXOR)
+    {
+        narrow = op - EXP_OP_WAND + EXP_OP_AND;
+        operand[0] = nsf_op(narrow, 2, operand[0], operand[2]);
+        operand[1] = nsf_op(narrow, 2, operand[1], operand[3]);
+        return 2;
+    }
+
+    narrow = op - EXP_OP_WCE + EXP_OP_CE;
+    if ( (op == EXP_OP_WCE) || (op == EXP_OP_WCNE) )
+    {
+        upper = nsf_op(narrow, 2, operand[0], operand[2]);
+        operand[0] = nsf_op((op == EXP_OP_WCE) ? EXP_OP_LAND : EXP_OP_LOR, 2, upper,
+                            nsf_op(narrow, 2, operand[1], operand[3]));
+        return 1;
+    }
+    // Upper halves decide it unless they're equal
+    upper = nsf_op(((op == EXP_OP_WCGT) || (op == EXP_OP_WCGE)) ? EXP_OP_CGT : EXP_OP_CLT, 2,
+                   operand[0], operand[2]);
+    operand[0] = nsf_op(EXP_OP_LOR, 2, upper,
+                        nsf_op(EXP_OP_LAND, 2, nsf_op(EXP_OP_CE, 2, operand[0], operand[2]),
+                               nsf_op(narrow, 2, operand[1], operand[3])));
+    return 1;
+}
+
+// Run an expression through with nodes in place of values. slots[] holds
+// the variables' nodes as the expressions before it left them.
+static int nsf_expr_tree(const exp_program_t *prog, int *slots, unsigned char *unknown)
+{
+    int                 stack[EXP_MAX_STACK], sp = 0, pc, node, count;
+    const exp_insn_t    *insn;
+
+    for (pc = 0; pc < prog->length; pc++)
+    {
+        insn = &prog->code[pc];
+        switch (insn->op)
+        {
+            case EXP_OP_END:
+                return stack[sp - 1];
+            case EXP_OP_PUSH:
+                node = nsf_const(prog->constants[insn->arg]);
+                break;
+            case EXP_OP_LOAD:
+                if (unknown[insn->arg])
+                    return -1;
+                node = slots[insn->arg];
+                break;
+            case EXP_OP_STORE:
+                slots[insn->arg] = stack[sp - 1];
+                continue;
+            case EXP_OP_POP:
+                sp--;
+                continue;
+            case EXP_OP_NEG:
+            case EXP_OP_NOT:
+            case EXP_OP_LNOT:
+            case EXP_OP_ABS:
+                node = nsf_op(insn->op, 1, stack[--sp], -1);
+                break;
+            case EXP_OP_WNOT:
+            case EXP_OP_WAND:
+            case EXP_OP_WOR:
+            case EXP_OP_WXOR:
+            case EXP_OP_WCE:
+            case EXP_OP_WCNE:
+            case EXP_OP_WCGT:
+            case EXP_OP_WCLT:
+            case EXP_OP_WCGE:
+            case EXP_OP_WCLE:
+                sp -= (insn->op == EXP_OP_WNOT) ? 2 : 4;
+                for (count = nsf_wide_op(insn->op, &stack[sp]); count > 0; count--, sp++)
+                {
+                    if (stack[sp] < 0)
+                        return -1;
+                }
+                continue;
+            default:
+                sp -= 2;
+                node = nsf_op(insn->op, 2, stack[sp], stack[sp + 1]);
+                break;
+        }
+        if (node < 0)
+            return -1;
+        stack[sp++] = node;
+    }
+    return -1;
+}
+
+// Build trees for all the expressions. Returns how many translate.
+static int nsf_expr_analyse(void)
+{
+    int                 slots[EXP_MAX_MAPPED_SYMBOLS];
+    unsigned char       unknown[EXP_MAX_MAPPED_SYMBOLS];
+    const exp_program_t *prog;
+    int                 expr, pc, count = countExpressions(), translated = 0;
+
+    if (count > exprRootAlloc)
+    {
+        free(exprRoots);
+        exprRoots = malloc(count * sizeof(int));
+        exprRootAlloc = exprRoots ? count : 0;
+        if (exprRoots == NULL)
+            return 0;
+    }
+
+    exprNodeCount = 0;
+    memset(unknown, 0, sizeof(unknown));
+    for (pc = 0; pc < EXP_MAX_MAPPED_SYMBOLS; pc++)
+        slots[pc] = nsf_const(0);
+    slots[EXPR_SLOT_PREFIX] = nsf_node(EXP_OP_LOAD, -1, -1, NSF_TARGET);
+    slots[EXPR_SLOT_HOST] = nsf_node(EXP_OP_LOAD, -1, -1, NSF_TARGET + 8);
+
+    for (expr = 0; expr < count; expr++)
+    {
+        prog = getExpression(expr);
+        exprRoots[expr] = nsf_expr_tree(prog, slots, unknown);
+        if (exprRoots[expr] >= 0)
+        {
+            translated++;
+            continue;
+        }
+        // Whatever it sets is unknown from here on
+        for (pc = 0; pc < prog->length; pc++)
+        {
+            if (prog->code[pc].op == EXP_OP_STORE)
+                unknown[prog->code[pc].arg] = 1;
+        }
+    }
+    return translated;
+}
+
+
+static int nsf_label(struct nsFilter *nf)
+{
+    if (nf->labels >= NSF_MAXLABELS)
+    {
+        nf->full = 1;
+        return 0;
+    }
+    nf->labelAt[nf->labels] = -1;
+    return nf->labels++;
+}
+
+static void nsf_place(struct nsFilter *nf, int label)
+{
+    nf->labelAt[label] = nf->len;
+    // Whatever jumps here may not have A the same
+    nf->heldAt = ~0U;
+}
+
+static void nsf_goto(struct nsFilter *nf, int label)
+{
+    nsf_jump(nf, BPF_JMP|BPF_JA, 0, NSF_LABEL(label), NSF_LABEL(label));
+}
+
+// Turn labels from 'start' on into relative skips. -1 if one's out of reach.
+static int nsf_resolve_labels(struct nsFilter *nf, unsigned int start)
+{
+    unsigned int    loop;
+    int             *j, off, side, ja;
+
+    for (loop = start; loop < nf->len; loop++)
+    {
+        if (BPF_CLASS(nf->insn[loop].code) != BPF_JMP)
+            continue;
+        ja = (BPF_OP(nf->insn[loop].code) == BPF_JA);
+        for (side = 0; side < 2; side++)
+        {
+            j = side ? &nf->jf[loop] : &nf->jt[loop];
+            if (*j > NSF_LABEL(0))
+                continue;
+            off = nf->labelAt[NSF_LABEL(0) - *j] - (int)loop - 1;
+            if ( (off < 0) || ((off > 255) && !ja) )
+                return -1;
+            *j = off;
+        }
+        // A JA's skip is in k, and it's done with
+        if ( ja && (nf->jt[loop] >= 0) )
+            nf->insn[loop].k = nf->jt[loop];
+    }
+    return 0;
+}
+
+static void nsf_store(struct nsFilter *nf, unsigned int m)
+{
+    nsf_stmt(nf, BPF_ST, m);
+    nf->heldAt = nf->len;
+    nf->heldMem = m;
+}
+
+static int nsf_a_holds(struct nsFilter *nf, struct nsfHalf h)
+{
+    return (h.kind == NSF_HALF_MEM) && (nf->heldAt == nf->len) && (nf->heldMem == h.k);
+}
+
+static void nsf_load_a(struct nsFilter *nf, struct nsfHalf h)
+{
+    if (h.kind == NSF_HALF_K)
+        nsf_stmt(nf, BPF_LD|BPF_IMM, h.k);
+    else if (h.kind == NSF_HALF_PKT)
+        nsf_stmt(nf, BPF_LD|BPF_W|BPF_ABS, h.k);
+    else if (!nsf_a_holds(nf, h))
+        nsf_stmt(nf, BPF_LD|BPF_MEM, h.k);
+}
+
+// Get A = a, and b ready as the next insn's operand. Returns BPF_K or BPF_X.
+static int nsf_operands(struct nsFilter *nf, struct nsfHalf a, struct nsfHalf b)
+{
+    if (b.kind == NSF_HALF_K)
+    {
+        nsf_load_a(nf, a);
+        return BPF_K;
+    }
+    if (b.kind == NSF_HALF_PKT)
+    {
+        nsf_stmt(nf, BPF_LD|BPF_W|BPF_ABS, b.k);
+        nsf_stmt(nf, BPF_MISC|BPF_TAX, 0);
+        nsf_load_a(nf, a);
+    }
+    else if (nsf_a_holds(nf, a))
+        nsf_stmt(nf, BPF_LDX|BPF_MEM, b.k);
+    else
+    {
+        nsf_stmt(nf, BPF_LDX|BPF_MEM, b.k);
+        nsf_load_a(nf, a);
+    }
+    return BPF_X;
+}
+
+// a op b into M[m], unless known already
+static struct nsfHalf nsf_half_alu(struct nsFilter *nf, int op, struct nsfHalf a,
+                                   struct nsfHalf b, unsigned int m)
+{
+    struct nsfHalf  r = { NSF_HALF_K, 0 }, swap;
+    int             src;
+
+    if ( (a.kind == NSF_HALF_K) && (b.kind == NSF_HALF_K) )
+    {
+        switch (op)
+        {
+            case BPF_AND:   r.k = a.k & b.k;    break;
+            case BPF_OR:    r.k = a.k | b.k;    break;
+            case BPF_XOR:   r.k = a.k ^ b.k;    break;
+            case BPF_ADD:   r.k = a.k + b.k;    break;
+            case BPF_SUB:   r.k = a.k - b.k;    break;
+            case BPF_LSH:   r.k = a.k << b.k;   break;
+            case BPF_RSH:   r.k = a.k >> b.k;   break;
+        }
+        return r;
+    }
+    if ( (a.kind == NSF_HALF_K) && ((op == BPF_AND) || (op == BPF_OR) || (op == BPF_XOR) || (op == BPF_ADD)) )
+    {
+        swap = a;
+        a = b;
+        b = swap;
+    }
+    if (b.kind == NSF_HALF_K)
+    {
+        if ( (b.k == 0) && (op != BPF_AND) )
+            return a;
+        if ( (b.k == 0) || ((b.k == 0xffffffff) && (op == BPF_OR)) )
+            return b;
+        if ( (b.k == 0xffffffff) && (op == BPF_AND) )
+            return a;
+    }
+
+    src = nsf_operands(nf, a, b);
+    nsf_stmt(nf, BPF_ALU|op|src, (src == BPF_K) ? b.k : 0);
+    nsf_store(nf, m);
+    r.kind = NSF_HALF_MEM;
+    r.k = m;
+    return r;
+}
+
+// Make sure a half isn't left in someone else's M[]
+static void nsf_half_own(struct nsFilter *nf, struct nsfHalf *h, unsigned int m)
+{
+    if ( (h->kind == NSF_HALF_MEM) && (h->k != m) )
+    {
+        nsf_load_a(nf, *h);
+        nsf_store(nf, m);
+        h->k = m;
+    }
+}
+
+// 0 or 1 into M[m], from the jump that lands on t or f
+static void nsf_flag(struct nsFilter *nf, int t, int f, unsigned int m)
+{
+    int     done = nsf_label(nf);
+
+    nsf_place(nf, f);
+    nsf_stmt(nf, BPF_LD|BPF_IMM, 0);
+    nsf_goto(nf, done);
+    nsf_place(nf, t);
+    nsf_stmt(nf, BPF_LD|BPF_IMM, 1);
+    nsf_place(nf, done);
+    nsf_store(nf, m);
+}
+
+static int nsf_gen_cond(struct nsFilter *nf, int node, unsigned int base, int t, int f);
+
+// Where the next operand's scratch starts, after one already worked out
+static unsigned int nsf_next_base(unsigned int base, struct nsfValue *v)
+{
+    return ( (v->half[0].kind == NSF_HALF_MEM) || (v->half[1].kind == NSF_HALF_MEM) ) ? base + 2 : base;
+}
+
+/*****************************************************************************
+ * nsf_gen_value
+ *      Generate code for a node's value.
+ *
+ * Inputs:
+ *  node, and base - the code may use M[base] on. The value ends up in
+ *  M[base] and M[base+1], where it isn't known or a word of the target.
+ *
+ * Outputs:
+ *  *v, where the value is.
+ *
+ * Return:
+ *      0, or -1 if it needs more than the 16 words of M[].
+ */
+static int nsf_gen_value(struct nsFilter *nf, int node, unsigned int base, struct nsfValue *v)
+{
+    struct nsfNode  *n = &exprNodes[node];
+    struct nsfValue l, r;
+    struct nsfHalf  t1, t2, carry = { NSF_HALF_K, 0 }, zero = { NSF_HALF_K, 0 };
+    struct nsfHalf  count = { NSF_HALF_K, 0 };
+    unsigned int    c;
+    int             op, src, t, f, h;
+
+    if (base + 1 >= BPF_MEMWORDS)
+        return -1;
+
+    switch (n->op)
+    {
+        case EXP_OP_PUSH:
+            v->half[0].kind = v->half[1].kind = NSF_HALF_K;
+            v->half[0].k = n->value >> 32;
+            v->half[1].k = n->value;
+            return 0;
+
+        case EXP_OP_LOAD:
+            v->half[0].kind = v->half[1].kind = NSF_HALF_PKT;
+            v->half[0].k = n->value;
+            v->half[1].k = n->value + 4;
+            return 0;
+
+        case EXP_OP_AND:
+        case EXP_OP_OR:
+        case EXP_OP_XOR:
+            if ( nsf_gen_value(nf, n->kid[0], base + 2, &l) ||
+                 nsf_gen_value(nf, n->kid[1], nsf_next_base(base + 2, &l), &r) )
+                return -1;
+            op = (n->op == EXP_OP_AND) ? BPF_AND : (n->op == EXP_OP_OR) ? BPF_OR : BPF_XOR;
+            for (h = 0; h < 2; h++)
+                v->half[h] = nsf_half_alu(nf, op, l.half[h], r.half[h], base + h);
+            break;
+
+        case EXP_OP_ADD:
+            if ( nsf_gen_value(nf, n->kid[0], base + 2, &l) ||
+                 nsf_gen_value(nf, n->kid[1], nsf_next_base(base + 2, &l), &r) )
+                return -1;
+            if ( (l.half[1].kind == NSF_HALF_K) && (r.half[1].kind == NSF_HALF_K) )
+            {
+                v->half[1].kind = NSF_HALF_K;
+                v->half[1].k = l.half[1].k + r.half[1].k;
+                carry.k = (v->half[1].k < l.half[1].k);
+            }
+            else if ( ((l.half[1].kind == NSF_HALF_K) && (l.half[1].k == 0)) ||
+                      ((r.half[1].kind == NSF_HALF_K) && (r.half[1].k == 0)) )
+                v->half[1] = nsf_half_alu(nf, BPF_ADD, l.half[1], r.half[1], base + 1);
+            else
+            {
+                // A carry if the sum's less than what was added to
+                v->half[1] = nsf_half_alu(nf, BPF_ADD, l.half[1], r.half[1], base + 1);
+                t = nsf_label(nf);
+                f = nsf_label(nf);
+                src = nsf_operands(nf, v->half[1], l.half[1]);
+                nsf_jump(nf, BPF_JMP|BPF_JGE|src, (src == BPF_K) ? l.half[1].k : 0,
+                         NSF_LABEL(f), NSF_LABEL(t));
+                nsf_flag(nf, t, f, base);
+                carry.kind = NSF_HALF_MEM;
+                carry.k = base;
+            }
+            t1 = nsf_half_alu(nf, BPF_ADD, l.half[0], carry, base);
+            v->half[0] = nsf_half_alu(nf, BPF_ADD, t1, r.half[0], base);
+            break;
+
+        case EXP_OP_SUB:
+            if ( nsf_gen_value(nf, n->kid[0], base + 2, &l) ||
+                 nsf_gen_value(nf, n->kid[1], nsf_next_base(base + 2, &l), &r) )
+                return -1;
+            if ( (l.half[1].kind == NSF_HALF_K) && (r.half[1].kind == NSF_HALF_K) )
+                carry.k = (l.half[1].k < r.half[1].k);
+            else if ( (r.half[1].kind != NSF_HALF_K) || (r.half[1].k != 0) )
+            {
+                // A borrow if less is taken from more
+                t = nsf_label(nf);
+                f = nsf_label(nf);
+                src = nsf_operands(nf, l.half[1], r.half[1]);
+                nsf_jump(nf, BPF_JMP|BPF_JGE|src, (src == BPF_K) ? r.half[1].k : 0,
+                         NSF_LABEL(f), NSF_LABEL(t));
+                nsf_flag(nf, t, f, base);
+                carry.kind = NSF_HALF_MEM;
+                carry.k = base;
+            }
+            v->half[1] = nsf_half_alu(nf, BPF_SUB, l.half[1], r.half[1], base + 1);
+            t1 = nsf_half_alu(nf, BPF_SUB, l.half[0], carry, base);
+            v->half[0] = nsf_half_alu(nf, BPF_SUB, t1, r.half[0], base);
+            break;
+
+        case EXP_OP_SHL:
+        case EXP_OP_SHR:
+            if (nsf_gen_value(nf, n->kid[0], base + 2, &l))
+                return -1;
+            c = exprNodes[n->kid[1]].value;
+            // Which half bits move out of, and which into
+            h = (n->op == EXP_OP_SHL) ? 1 : 0;
+            op = (n->op == EXP_OP_SHL) ? BPF_LSH : BPF_RSH;
+            if (c >= 32)
+            {
+                count.k = c - 32;
+                v->half[!h] = nsf_half_alu(nf, op, l.half[h], count, base + !h);
+                v->half[h] = zero;
+                break;
+            }
+            count.k = 32 - c;
+            t1 = nsf_half_alu(nf, op ^ BPF_LSH ^ BPF_RSH, l.half[h], count, base + !h);
+            count.k = c;
+            t2 = nsf_half_alu(nf, op, l.half[!h], count, base + h);
+            v->half[!h] = nsf_half_alu(nf, BPF_OR, t2, t1, base + !h);
+            nsf_half_own(nf, &v->half[!h], base + !h);
+            v->half[h] = nsf_half_alu(nf, op, l.half[h], count, base + h);
+            break;
+
+        default:
+            // A truth value
+            t = nsf_label(nf);
+            f = nsf_label(nf);
+            if (nsf_gen_cond(nf, node, base, t, f))
+                return -1;
+            nsf_flag(nf, t, f, base + 1);
+            v->half[0] = zero;
+            v->half[1].kind = NSF_HALF_MEM;
+            v->half[1].k = base + 1;
+            return 0;
+    }
+
+    for (h = 0; h < 2; h++)
+        nsf_half_own(nf, &v->half[h], base + h);
+    return 0;
+}
+
+// Jump to t if l op r, to f if not. op is EXP_OP_CE, CGT or CGE.
+static void nsf_gen_compare(struct nsFilter *nf, int op, struct nsfValue *l, struct nsfValue *r,
+                            int t, int f)
+{
+    struct nsfHalf  a, b;
+    int             h, src, last, rev;
+
+    for (h = 0; h < 2; h++)
+    {
+        a = l->half[h];
+        b = r->half[h];
+        last = (h == 1);
+
+        if ( (a.kind == NSF_HALF_K) && (b.kind == NSF_HALF_K) )
+        {
+            if ( (a.k == b.k) && !last )
+                continue;
+            if (op == EXP_OP_CE)
+                nsf_goto(nf, (a.k == b.k) ? t : f);
+            else if ( (a.k > b.k) || ((a.k == b.k) && (op == EXP_OP_CGE)) )
+                nsf_goto(nf, t);
+            else
+                nsf_goto(nf, f);
+            return;
+        }
+
+        if (op == EXP_OP_CE)
+        {
+            if (a.kind == NSF_HALF_K)
+            {
+                b = a;
+                a = r->half[h];
+            }
+            src = nsf_operands(nf, a, b);
+            nsf_jump(nf, BPF_JMP|BPF_JEQ|src, (src == BPF_K) ? b.k : 0, last ? NSF_LABEL(t) : 0, NSF_LABEL(f));
+            continue;
+        }
+
+        // K > b is !(b >= K), which saves going through X
+        rev = (a.kind == NSF_HALF_K);
+        if (rev)
+        {
+            b = a;
+            a = r->half[h];
+        }
+        src = nsf_operands(nf, a, b);
+        if (src == BPF_X)
+            b.k = 0;
+        if (last)
+        {
+            if (rev)
+                nsf_jump(nf, BPF_JMP|((op == EXP_OP_CGT) ? BPF_JGE : BPF_JGT)|src, b.k,
+                         NSF_LABEL(f), NSF_LABEL(t));
+            else
+                nsf_jump(nf, BPF_JMP|((op == EXP_OP_CGT) ? BPF_JGT : BPF_JGE)|src, b.k,
+                         NSF_LABEL(t), NSF_LABEL(f));
+            continue;
+        }
+        // Upper halves decide it unless they're equal
+        if (rev)
+            nsf_jump(nf, BPF_JMP|BPF_JGE|src, b.k, 0, NSF_LABEL(t));
+        else
+            nsf_jump(nf, BPF_JMP|BPF_JGT|src, b.k, NSF_LABEL(t), 0);
+        nsf_jump(nf, BPF_JMP|BPF_JEQ|src, b.k, 0, NSF_LABEL(f));
+    }
+}
+
+/*****************************************************************************
+ * nsf_gen_cond
+ *      Generate code to jump one way or the other on a node's truth.
+ *
+ * Inputs:
+ *  node, base as nsf_gen_value(), and the labels for true and false.
+ *
+ * Return:
+ *      0, or -1 if it needs more than the 16 words of M[].
+ */
+static int nsf_gen_cond(struct nsFilter *nf, int node, unsigned int base, int t, int f)
+{
+    struct nsfNode  *n = &exprNodes[node];
+    struct nsfValue l, r, zero;
+    int             mid, op, a = n->kid[0], b = n->kid[1], swap;
+
+    switch (n->op)
+    {
+        case EXP_OP_PUSH:
+            nsf_goto(nf, n->value ? t : f);
+            return 0;
+
+        case EXP_OP_LAND:
+        case EXP_OP_LOR:
+            mid = nsf_label(nf);
+            if ( nsf_gen_cond(nf, a, base, (n->op == EXP_OP_LAND) ? mid : t,
+                                           (n->op == EXP_OP_LAND) ? f : mid) )
+                return -1;
+            nsf_place(nf, mid);
+            return nsf_gen_cond(nf, b, base, t, f);
+
+        case EXP_OP_CE:
+        case EXP_OP_CNE:
+        case EXP_OP_CGT:
+        case EXP_OP_CGE:
+        case EXP_OP_CLT:
+        case EXP_OP_CLE:
+            op = n->op;
+            if (op == EXP_OP_CNE)
+            {
+                op = EXP_OP_CE;
+                swap = t;
+                t = f;
+                f = swap;
+            }
+            else if ( (op == EXP_OP_CLT) || (op == EXP_OP_CLE) )
+            {
+                op = (op == EXP_OP_CLT) ? EXP_OP_CGT : EXP_OP_CGE;
+                a = n->kid[1];
+                b = n->kid[0];
+            }
+            if ( nsf_gen_value(nf, a, base, &l) ||
+                 nsf_gen_value(nf, b, nsf_next_base(base, &l), &r) )
+                return -1;
+            nsf_gen_compare(nf, op, &l, &r, t, f);
+            return 0;
+
+        default:
+            if (nsf_gen_value(nf, node, base, &l))
+                return -1;
+            memset(&zero, 0, sizeof(zero));
+            nsf_gen_compare(nf, EXP_OP_CE, &l, &zero, f, t);
+            return 0;
+    }
+}
+
+/*****************************************************************************
+ * nsf_expressions
+ *      Append code for the expressions which translate. Where one is
+ *      true the filter returns.
+ *
+ * Inputs:
+ *  ret - what to return.
+ *  all - only if they all go in. Otherwise those which won't fit are
+ *  left out.
+ *
+ * Return:
+ *      How many went in.
+ */
+static int nsf_expressions(struct nsFilter *nf, uint32_t ret, int all)
+{
+    int             expr, t, f, count = countExpressions(), done = 0;
+    unsigned int    start = nf->len, exprStart;
+
+    for (expr = 0; expr < count; expr++)
+    {
+        if (exprRoots[expr] < 0)
+        {
+            if (all)
+                break;
+            continue;
+        }
+
+        exprStart = nf->len;
+        nf->labels = 0;
+        nf->heldAt = ~0U;
+        t = nsf_label(nf);
+        f = nsf_label(nf);
+        if (nsf_gen_cond(nf, exprRoots[expr], 0, t, f) == 0)
+        {
+            nsf_place(nf, t);
+            nsf_stmt(nf, BPF_RET|BPF_K, ret);
+            nsf_place(nf, f);
+            // With room left for build_ns_filter() to finish off
+            if ( !nf->full && (nf->len + 2 <= NSFILTER_MAXINSNS) &&
+                 (nsf_resolve_labels(nf, exprStart) == 0) )
+            {
+                done++;
+                continue;
+            }
+        }
+
+        nf->len = exprStart;
+        nf->full = 0;
+        if (all)
+            break;
+    }
+
+    if ( all && (done != count) )
+    {
+        nf->len = start;
+        return 0;
+    }
+    return done;
+}
+
+// The first "ret #val" after insn 'from'. Going to the nearest rather than
+// the one at the end keeps most jumps within cBPF's reach.
+static unsigned int nsf_ret_after(struct nsFilter *nf, unsigned int from, uint32_t val)
+{
+    for (from++; from < nf->len; from++)
+    {
+        if ( (nf->insn[from].code == (BPF_RET|BPF_K)) && (nf->insn[from].k == val) )
+            break;
+    }
+    return from;
+}
+
+
+/*****************************************************************************
+ * build_ns_filter
+ *      Generate the cBPF program for an interface's packet socket. Only
+ *      frames which could result in an NA get through:
+ *          - long enough to be an NS, ICMPv6, hop limit 255, NS code 0.
+ *          - not DAD, i.e. source not unspecified.
+ *          - target within the interface's prefix(es).
+ *          - if ignoreLocal, target != destination.
+ *          - a black/whitelist too, if small enough to fit. Blocks are
+ *            left to processNS().
+ *          - exprlists, those that translate (see above). In a
+ *            blacklist, any which fit. A whitelist needs all of them and
+ *            no address blocks, as otherwise it may whitelist a target
+ *            the filter knows nothing of.
+ *
+ * Inputs:
+ *  ifIdx is the index into interfaces[].
+ *  withList is 0 if the caller will deal with the addrlist itself.
+ *
+ * Outputs:
+ *  struct sock_filter *filter
+ *      The program. Must have room for NSFILTER_MAXINSNS.
+ *
+ * Return:
+ *      Number of instructions, -1 if we couldn't lay it out.
+ */
+int build_ns_filter(int ifIdx, int withList, struct sock_filter *filter)
+{
+    static struct nsFilter  nf;
+    struct npd6Interface    *iface = &interfaces[ifIdx];
+    unsigned int            dropAt, acceptAt, loop;
+    int                     word, bits, target;
+    struct addrIter         iter = { 0, 0 };
+    uint32_t                val, mask;
+    struct in6_addr         entry;
+    int                     useList = 0, exprs = countExpressions(), translated = 0;
+
+    nf.len = 0;
+    nf.full = 0;
+    exprsInFilter = 0;
+
+    // Basic sanity: long enough, ICMPv6, unforwarded, NS
+    nsf_stmt(&nf, BPF_LD|BPF_W|BPF_LEN, 0);
+    nsf_jump(&nf, BPF_JMP|BPF_JGE|BPF_K, NSF_MINLEN, 0, NSF_DROP);
+    nsf_stmt(&nf, BPF_LD|BPF_B|BPF_ABS, NSF_IP6 + offsetof(struct ip6_hdr, ip6_nxt));
+    nsf_jump(&nf, BPF_JMP|BPF_JEQ|BPF_K, IPPROTO_ICMPV6, 0, NSF_DROP);
+    nsf_stmt(&nf, BPF_LD|BPF_B|BPF_ABS, NSF_IP6 + offsetof(struct ip6_hdr, ip6_hlim));
+    nsf_jump(&nf, BPF_JMP|BPF_JEQ|BPF_K, MAXMAXHOPS, 0, NSF_DROP);
+    nsf_stmt(&nf, BPF_LD|BPF_B|BPF_ABS, NSF_ICMP6 + offsetof(struct icmp6_hdr, icmp6_type));
+    nsf_jump(&nf, BPF_JMP|BPF_JEQ|BPF_K, ND_NEIGHBOR_SOLICIT, 0, NSF_DROP);
+    nsf_stmt(&nf, BPF_LD|BPF_B|BPF_ABS, NSF_ICMP6 + offsetof(struct icmp6_hdr, icmp6_code));
+    nsf_jump(&nf, BPF_JMP|BPF_JEQ|BPF_K, 0, 0, NSF_DROP);
+
+    // DAD - Bug 27
+    for (word = 0; word < 4; word++)
+        nsf_word_eq(&nf, NSF_SRC + word*4, 0, (3-word)*2 + 1);
+    nsf_stmt(&nf, BPF_RET|BPF_K, 0);
+
+    // Target within the prefix, or all of them if there are extras
+    for (word = 0, bits = iface->coverLen; (word < 4) && (bits > 0); word++, bits -= 32)
+    {
+        mask = (bits >= 32) ? 0xffffffff : ~(0xffffffff >> bits);
+        memcpy(&val, &iface->coverPrefix.s6_addr[word*4], sizeof(val));
+        nsf_stmt(&nf, BPF_LD|BPF_W|BPF_ABS, NSF_TARGET + word*4);
+        if (mask != 0xffffffff)
+            nsf_stmt(&nf, BPF_ALU|BPF_AND|BPF_K, mask);
+        nsf_jump(&nf, BPF_JMP|BPF_JEQ|BPF_K, ntohl(val) & mask, 0, NSF_DROP);
+    }
+
+    // tgt == dst will be answered by the kernel itself
+    if (nsIgnoreLocal)
+    {
+        for (word = 0; word < 4; word++)
+        {
+            nsf_stmt(&nf, BPF_LD|BPF_W|BPF_ABS, NSF_TARGET + word*4);
+            nsf_stmt(&nf, BPF_MISC|BPF_TAX, 0);
+            nsf_stmt(&nf, BPF_LD|BPF_W|BPF_ABS, NSF_DST + word*4);
+            nsf_jump(&nf, BPF_JMP|BPF_JEQ|BPF_X, 0, 0, (3-word)*4 + 1);
+        }
+        nsf_stmt(&nf, BPF_RET|BPF_K, 0);
+    }
+
+    if (exprs)
+        translated = nsf_expr_analyse();
+
+    // The addrlist, if it will fit
+    if ( withList && (listType != NOLIST) )
+    {
+        if (lSet.count > NSFILTER_MAXLIST)
+            flog(LOG_DEBUG, "%u addrlist entries - too many for the socket filter", lSet.count);
+        else if ( (listType == WHITELIST) && ((translated < exprs) || addrlist_blocks()) )
+            flog(LOG_DEBUG, "exprlist or address blocks in use - whitelist not put in the socket filter");
+        else
+            useList = 1;
+    }
+
+    // A whitelist's exprlists go first, as the addrlist ends in a drop
+    if ( (listType == WHITELIST) && (translated == exprs) && !addrlist_blocks() &&
+         (useList || !withList) )
+    {
+        exprsInFilter = nsf_expressions(&nf, NSF_RET_FINAL, 1);
+        if (exprsInFilter < exprs)
+        {
+            flog(LOG_DEBUG, "exprlists too big - whitelist not put in the socket filter");
+            useList = 0;
+        }
+    }
+
+    if (useList)
+    {
+        while (addrset_next(&lSet, &iter, &entry))
+        {
+            nsf_target_eq(&nf, &entry);
+            if (listType == WHITELIST)
+                nsf_jump(&nf, BPF_JMP|BPF_JA, 0, NSF_ACCEPT, NSF_ACCEPT);
+            else
+                nsf_stmt(&nf, BPF_RET|BPF_K, 0);
+        }
+        // Nothing on the whitelist matched
+        if (listType == WHITELIST)
+            nsf_stmt(&nf, BPF_RET|BPF_K, 0);
+    }
+
+    // A blacklist's go wherever, and as many as will fit
+    if ( (listType == BLACKLIST) && translated )
+        exprsInFilter = nsf_expressions(&nf, 0, 0);
+
+    acceptAt = nf.len;
+    nsf_stmt(&nf, BPF_RET|BPF_K, NSF_RET_ACCEPT);
+    dropAt = nf.len;
+    nsf_stmt(&nf, BPF_RET|BPF_K, 0);
+    if (nf.full)
+        return -1;
+
+    // Resolve the jumps. Conditional ones only reach 255 insns ahead,
+    // so each goes to the nearest return that does the job.
+    for (loop = 0; loop < nf.len; loop++)
+    {
+        filter[loop] = nf.insn[loop];
+        if (BPF_CLASS(nf.insn[loop].code) != BPF_JMP)
+            continue;
+
+        if (BPF_OP(nf.insn[loop].code) == BPF_JA)
+        {
+            if (nf.jt[loop] < 0)
+                filter[loop].k = ((nf.jt[loop] == NSF_ACCEPT) ? acceptAt : dropAt) - loop - 1;
+            continue;
+        }
+
+        target = (nf.jt[loop] == NSF_DROP) ? nsf_ret_after(&nf, loop, 0) - loop - 1 :
+                 (nf.jt[loop] == NSF_ACCEPT) ? nsf_ret_after(&nf, loop, NSF_RET_ACCEPT) - loop - 1 :
+                 nf.jt[loop];
+        if (target > 255)
+            return -1;
+        filter[loop].jt = target;
+
+        target = (nf.jf[loop] == NSF_DROP) ? nsf_ret_after(&nf, loop, 0) - loop - 1 :
+                 (nf.jf[loop] == NSF_ACCEPT) ? nsf_ret_after(&nf, loop, NSF_RET_ACCEPT) - loop - 1 :
+                 nf.jf[loop];
+        if (target > 255)
+            return -1;
+        filter[loop].jf = target;
+    }
+
+    flog(LOG_DEBUG, "Socket filter for %s: %u insns, %s addrlist, %d/%d exprlists",
+         iface->nameStr, nf.len, useList ? "including" : "without", exprsInFilter, exprs);
+
+    return nf.len;
+}
+
+
+/*****************************************************************************
+ * sync_list_map
+ *      Bring the eBPF filters' addrlist map into line with lSet. The map
+ *      is created the first time round, and after that is updated in
+ *      place, so a reload never leaves a window with no map behind the
+ *      filters.
+ *
+ * Inputs:
+ *  void
+ *
+ * Outputs:
+ *  The map matches lSet. If it couldn't be made to, the filters leave
+ *  the addrlist to processNS().
+ *
+ * Return:
+ *      void
+ */
+void sync_list_map(void)
+{
+    struct in6_addr key, prev, entry;
+    struct addrIter iter = { 0, 0 };
+    unsigned char   present = 1;
+    int             havePrev = 0, removed = 0;
+
+    if (listType == NOLIST)
+        return;
+
+    if (listMapFd < 0)
+    {
+        listMapFd = ebpf_map_create(BPF_MAP_TYPE_HASH, sizeof(struct in6_addr),
+                                    sizeof(unsigned char), NSFILTER_MAPSIZE, BPF_F_NO_PREALLOC);
+        if (listMapFd < 0)
+        {
+            listMapOK = 0;
+            return;
+        }
+    }
+    listMapOK = 1;
+
+    // Out with the old...
+    while (ebpf_map_next_key(listMapFd, havePrev ? &prev : NULL, &key) == 0)
+    {
+        if ( !addrset_find(&lSet, &key) )
+        {
+            ebpf_map_delete(listMapFd, &key);
+            removed++;
+        }
+        else
+        {
+            prev = key;
+            havePrev = 1;
+        }
+    }
+
+    // ...and in with the new.
+    while (addrset_next(&lSet, &iter, &entry))
+    {
+        if (ebpf_map_update(listMapFd, &entry, &present, BPF_ANY) < 0)
+        {
+            flog(LOG_ERR, "addrlist map update failed: %s", strerror(errno));
+            listMapOK = 0;
+            break;
+        }
+    }
+
+    flog(LOG_INFO, "addrlist map synced: %u entries, %d removed%s", lSet.count, removed,
+         listMapOK ? "" : " - incomplete, checking in userspace only");
+}
+
+
+/*****************************************************************************
+ * translate_filter
+ *      Convert one of our cBPF programs into eBPF, much as the kernel
+ *      does itself. Only the handful of opcodes build_ns_filter() uses
+ *      are understood. A = r0, X = r7, ctx in r6.
+ *
+ *      Wherever the cBPF program would accept the frame we continue into
+ *      the tail the caller supplies, which must end by setting r0 and
+ *      exiting. Code that can't be reached is left out, as the verifier
+ *      won't have it.
+ *
+ * Inputs:
+ *  filter, len is the cBPF program.
+ *  tail, tailLen is the code to follow on from an accept.
+ *
+ * Outputs:
+ *  struct bpf_insn *prog
+ *      The eBPF program. Room for EBPF_MAX_INSNS.
+ *
+ * Return:
+ *      Number of instructions, or -1 if it can't be translated.
+ */
+static int translate_filter(struct sock_filter *filter, unsigned int len,
+                            struct bpf_insn *tail, unsigned int tailLen,
+                            struct bpf_insn *prog)
+{
+    static int      epos[NSFILTER_MAXINSNS + 1];
+    static char     reached[NSFILTER_MAXINSNS + 1];
+    unsigned int    loop, pass;
+    int             n, tailAt = 0;
+    struct sock_filter *f;
+
+    // cBPF only jumps forwards, so one pass finds all that's reachable
+    memset(reached, 0, len + 1);
+    reached[0] = 1;
+    for (loop = 0; loop < len; loop++)
+    {
+        f = &filter[loop];
+        if (!reached[loop] || (BPF_CLASS(f->code) == BPF_RET))
+            continue;
+        if (BPF_CLASS(f->code) != BPF_JMP)
+            reached[loop + 1] = 1;
+        else if (BPF_OP(f->code) == BPF_JA)
+            reached[loop + 1 + f->k] = 1;
+        else
+            reached[loop + 1 + f->jt] = reached[loop + 1 + f->jf] = 1;
+    }
+
+    // First pass to work out where everything lands, second to emit
+    for (pass = 0; pass < 2; pass++)
+    {
+        n = 0;
+        prog[n++] = EBPF_MOV64_REG(BPF_REG_6, BPF_REG_1);
+
+        for (loop = 0; loop < len; loop++)
+        {
+            f = &filter[loop];
+            epos[loop] = n;
+            if (!reached[loop])
+                continue;
+            if (n + 2 >= EBPF_MAX_INSNS)
+                return -1;
+
+            switch (f->code)
+            {
+                case BPF_LD|BPF_W|BPF_ABS:
+                case BPF_LD|BPF_H|BPF_ABS:
+                case BPF_LD|BPF_B|BPF_ABS:
+                    prog[n++] = EBPF_LD_ABS(BPF_SIZE(f->code), f->k);
+                    break;
+
+                case BPF_LD|BPF_W|BPF_LEN:
+                    prog[n++] = EBPF_LDX_MEM(BPF_W, BPF_REG_0, BPF_REG_6, offsetof(struct __sk_buff, len));
+                    break;
+
+                case BPF_LD|BPF_IMM:
+                    prog[n++] = EBPF_MOV32_IMM(BPF_REG_0, f->k);
+                    break;
+
+                case BPF_LDX|BPF_IMM:
+                    prog[n++] = EBPF_MOV32_IMM(BPF_REG_7, f->k);
+                    break;
+
+                // M[] lives on the stack, below the map key
+                case BPF_LD|BPF_MEM:
+                    prog[n++] = EBPF_LDX_MEM(BPF_W, BPF_REG_0, BPF_REG_10, NSF_EBPF_MEM(f->k));
+                    break;
+
+                case BPF_LDX|BPF_MEM:
+                    prog[n++] = EBPF_LDX_MEM(BPF_W, BPF_REG_7, BPF_REG_10, NSF_EBPF_MEM(f->k));
+                    break;
+
+                case BPF_ST:
+                    prog[n++] = EBPF_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_0, NSF_EBPF_MEM(f->k));
+                    break;
+
+                case BPF_ALU|BPF_AND|BPF_K:
+                case BPF_ALU|BPF_OR|BPF_K:
+                case BPF_ALU|BPF_XOR|BPF_K:
+                case BPF_ALU|BPF_ADD|BPF_K:
+                case BPF_ALU|BPF_SUB|BPF_K:
+                case BPF_ALU|BPF_LSH|BPF_K:
+                case BPF_ALU|BPF_RSH|BPF_K:
+                    prog[n++] = EBPF_ALU32_IMM(BPF_OP(f->code), BPF_REG_0, f->k);
+                    break;
+
+                case BPF_ALU|BPF_AND|BPF_X:
+                case BPF_ALU|BPF_OR|BPF_X:
+                case BPF_ALU|BPF_XOR|BPF_X:
+                case BPF_ALU|BPF_ADD|BPF_X:
+                case BPF_ALU|BPF_SUB|BPF_X:
+                    prog[n++] = EBPF_ALU32_REG(BPF_OP(f->code), BPF_REG_0, BPF_REG_7);
+                    break;
+
+                case BPF_MISC|BPF_TAX:
+                    prog[n++] = EBPF_MOV32_REG(BPF_REG_7, BPF_REG_0);
+                    break;
+
+                case BPF_RET|BPF_K:
+                    if ( (f->k == 0) || (f->k == NSF_RET_FINAL) )
+                    {
+                        prog[n++] = EBPF_MOV64_IMM(BPF_REG_0, f->k ? -1 : 0);
+                        prog[n++] = EBPF_EXIT();
+                    }
+                    else
+                    {
+                        prog[n] = EBPF_JA(tailAt - n - 1);
+                        n++;
+                    }
+                    break;
+
+                case BPF_JMP|BPF_JA:
+                    prog[n] = EBPF_JA(epos[loop + 1 + f->k] - n - 1);
+                    n++;
+                    break;
+
+                case BPF_JMP|BPF_JEQ|BPF_K:
+                case BPF_JMP|BPF_JGE|BPF_K:
+                case BPF_JMP|BPF_JGT|BPF_K:
+                case BPF_JMP|BPF_JEQ|BPF_X:
+                case BPF_JMP|BPF_JGE|BPF_X:
+                case BPF_JMP|BPF_JGT|BPF_X:
+                    // cBPF compares are unsigned 32-bit, hence JMP32
+                    if (BPF_SRC(f->code) == BPF_X)
+                        prog[n] = EBPF_JMP32_REG(BPF_OP(f->code), BPF_REG_0, BPF_REG_7,
+                                                 epos[loop + 1 + f->jt] - n - 1);
+                    else
+                        prog[n] = EBPF_JMP32_IMM(BPF_OP(f->code), BPF_REG_0, f->k,
+                                                 epos[loop + 1 + f->jt] - n - 1);
+                    n++;
+                    if (f->jf)
+                    {
+                        prog[n] = EBPF_JA(epos[loop + 1 + f->jf] - n - 1);
+                        n++;
+                    }
+                    break;
+
+                default:
+                    flog(LOG_ERR, "Can't translate cBPF opcode 0x%04x", f->code);
+                    return -1;
+            }
+        }
+
+        epos[len] = n;
+        tailAt = n;
+        if (n + tailLen > EBPF_MAX_INSNS)
+            return -1;
+        memcpy(&prog[n], tail, tailLen * sizeof(struct bpf_insn));
+        n += tailLen;
+    }
+
+    return n;
+}
+
+
+/*****************************************************************************
+ * attach_ns_ebpf
+ *      The eBPF alternative to the cBPF socket filter. It does all that
+ *      build_ns_filter()'s program does, except the addrlist is checked
+ *      against the BPF hash map kept by sync_list_map() - no limit on
+ *      size and no need to rebuild the program when the list changes.
+ *
+ * Inputs:
+ *  sock is the packet socket, ifIdx the index into interfaces[].
+ *
+ * Outputs:
+ *  Filter attached to the socket.
+ *
+ * Return:
+ *      0 on success, otherwise -1 and the caller should fall back to cBPF.
+ */
+int attach_ns_ebpf(int sock, int ifIdx)
+{
+    static struct sock_filter   filter[NSFILTER_MAXINSNS];
+    static struct bpf_insn      prog[EBPF_MAX_INSNS];
+    struct bpf_insn             tail[24];
+    struct bpf_insn             ldMap[] = { EBPF_LD_MAP_FD(BPF_REG_1, listMapFd) };
+    unsigned int                t = 0;
+    int                         len, progFd, err;
+    int                         useMap;
+
+    len = build_ns_filter(ifIdx, 0, filter);
+    if (len < 0)
+        return -1;
+
+    // As with the cBPF filter, an exprlist not in the program or an
+    // address block may whitelist targets the map knows nothing about.
+    useMap = (listType != NOLIST) && listMapOK &&
+             !( (listType == WHITELIST) &&
+                ((exprsInFilter < countExpressions()) || addrlist_blocks()) );
+
+    if (useMap)
+    {
+        // Target onto the stack as the key, then look it up
+        tail[t++] = EBPF_MOV64_REG(BPF_REG_1, BPF_REG_6);
+        tail[t++] = EBPF_MOV64_IMM(BPF_REG_2, NSF_TARGET);
+        tail[t++] = EBPF_MOV64_REG(BPF_REG_3, BPF_REG_10);
+        tail[t++] = EBPF_ALU64_IMM(BPF_ADD, BPF_REG_3, -(int)sizeof(struct in6_addr));
+        tail[t++] = EBPF_MOV64_IMM(BPF_REG_4, sizeof(struct in6_addr));
+        tail[t++] = EBPF_CALL(BPF_FUNC_skb_load_bytes);
+        tail[t++] = EBPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 8);
+        tail[t++] = ldMap[0];
+        tail[t++] = ldMap[1];
+        tail[t++] = EBPF_MOV64_REG(BPF_REG_2, BPF_REG_10);
+        tail[t++] = EBPF_ALU64_IMM(BPF_ADD, BPF_REG_2, -(int)sizeof(struct in6_addr));
+        tail[t++] = EBPF_CALL(BPF_FUNC_map_lookup_elem);
+        tail[t++] = EBPF_JMP_IMM((listType == WHITELIST) ? BPF_JEQ : BPF_JNE, BPF_REG_0, 0, 2);
+    }
+    tail[t++] = EBPF_MOV64_IMM(BPF_REG_0, -1);
+    tail[t++] = EBPF_EXIT();
+    if (useMap)
+    {
+        tail[t++] = EBPF_MOV64_IMM(BPF_REG_0, 0);
+        tail[t++] = EBPF_EXIT();
+    }
+
+    len = translate_filter(filter, len, tail, t, prog);
+    if (len < 0)
+        return -1;
+
+    progFd = ebpf_prog_load(BPF_PROG_TYPE_SOCKET_FILTER, prog, len);
+    if (progFd < 0)
+        return -1;
+
+    err = setsockopt(sock, SOL_SOCKET, SO_ATTACH_BPF, &progFd, sizeof(progFd));
+    // The socket holds its own reference from here on
+    close(progFd);
+    if (err < 0)
+    {
+        flog(LOG_ERR, "setsockopt(SO_ATTACH_BPF): %s", strerror(errno));
+        return -1;
+    }
+
+    flog(LOG_DEBUG, "eBPF socket filter for %s: %d insns, %s addrlist map",
+         interfaces[ifIdx].nameStr, len, useMap ? "with" : "without");
+
+    return 0;
+}
@@ -24,16 +24,18 @@
 
 #include "includes.h"
 #include "npd6.h"
-#include <netpacket/packet.h>
+#include <linux/if_packet.h>
+#include <sys/mman.h>
 
 
 /*****************************************************************************
  * open_packet_socket
  *      Opens the packet-level socket, for incoming traffic,
- *      and sets up the appropriate BSD PF.
+ *      and sets up the appropriate BSD PF, as generated from the
+ *      config by build_ns_filter().
  *
  * Inputs:
- *  Index of the interface we're opening it for.
+ *  Index into interfaces[] of the interface we're opening it for.
  *
  * Outputs:
  *  none
@@ -42,24 +44,13 @@
  *      int sock on success, otherwise -1
  *
  */
-int open_packet_socket(int ifIndex)
+int open_packet_socket(int ifIdx)
 {
-    int sock, err;
+    int sock, err, len;
+    int ifIndex = interfaces[ifIdx].index;
     struct sock_fprog fprog;
     struct sockaddr_ll lladdr;
-    static const struct sock_filter filter[] =
-    {
-        BPF_STMT(BPF_LD|BPF_B|BPF_ABS,
-            ETH_HLEN +
-            sizeof(struct ip6_hdr) +
-            offsetof(struct icmp6_hdr, icmp6_type)),
-        BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ND_NEIGHBOR_SOLICIT, 1, 0),
-        BPF_STMT(BPF_RET|BPF_K, 0),
-        BPF_STMT(BPF_RET|BPF_K, 0xffffffff),
-    };
-    
-    fprog.filter = (struct sock_filter *)filter;
-    fprog.len = sizeof filter / sizeof filter[0];
+    static struct sock_filter filter[NSFILTER_MAXINSNS];
    
     sock = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_IPV6) );
     if (sock < 0)
@@ -69,6 +60,38 @@ int open_packet_socket(int ifIndex)
     }
     flog(LOG_DEBUG2, "Created PF_PACKET socket OK.");
 
+    // The filter goes on before the bind, so nothing unfiltered from the
+    // interface gets queued in between. If configured, try for the eBPF
+    // filter with its addrlist map first.
+    err = -1;
+    if (socketFilter == FILTER_EBPF)
+    {
+        err = attach_ns_ebpf(sock, ifIdx);
+        if (err < 0)
+            flog(LOG_ERR, "eBPF socket filter failed on %s - using classic",
+                 interfaces[ifIdx].nameStr);
+    }
+
+    // Otherwise tie the BSD-PF filter to the socket
+    if (err < 0)
+    {
+        len = build_ns_filter(ifIdx, 1, filter);
+        if (len < 0)
+        {
+            flog(LOG_ERR, "Could not build socket filter for %s", interfaces[ifIdx].nameStr);
+            goto fail;
+        }
+        fprog.filter = filter;
+        fprog.len = len;
+        err = setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog));
+        if (err < 0)
+        {
+            flog(LOG_ERR, "setsockopt(SO_ATTACH_FILTER): %s", strerror(errno));
+            goto fail;
+        }
+        flog(LOG_DEBUG2, "setsockopt(SO_ATTACH_FILTER) OK");
+    }
+
     // Bind the socket to the interface we're interested in
     memset(&lladdr, 0, sizeof(lladdr));
     lladdr.sll_family = PF_PACKET;
@@ -81,20 +104,15 @@ int open_packet_socket(int ifIndex)
     if (err < 0)
     {
         flog(LOG_ERR, "packet socket bind to interface %d failed: %s", ifIndex, strerror(errno));
-        return (-1);
+        goto fail;
     }
     flog(LOG_DEBUG2, "packet socket bind to interface %d OK", ifIndex);
 
-    // Tie the BSD-PF filter to the socket
-    err = setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog));
-    if (err < 0)
-    {
-        flog(LOG_ERR, "setsockopt(SO_ATTACH_FILTER): %s", strerror(errno));
-        return (-1);
-    }
-    flog(LOG_DEBUG2, "setsockopt(SO_ATTACH_FILTER) OK");
-
     return sock;
+
+fail:
+    close(sock);
+    return (-1);
 }
 
 
@@ -159,9 +177,12 @@ int open_icmpv6_socket(void)
  *      The data.
  *
  * Return:
- *      int length of data received, otherwise -1 on error
+ *      int length of data received, 0 if nothing was waiting, otherwise
+ *      -1 on error
  *
  * NOTES:
+ * Never blocks: the dispatcher only calls once the socket is readable,
+ * and select() can't take fds past FD_SETSIZE anyway.
  * There's a lot of temp data structures needed here, but we really don't
  * care about them afterwards. Once we've got the raw data and the len
  * we're good.
@@ -172,17 +193,6 @@ int get_rx(int socket, unsigned char *msg)
     struct msghdr mhdr;
     struct iovec iov;
     int len;
-    fd_set rfds;
-
-    FD_ZERO( &rfds );
-    FD_SET( socket, &rfds );
-
-    if( select( socket+1, &rfds, NULL, NULL, NULL ) < 0 )
-    {
-        if (errno != EINTR)
-            flog(LOG_ERR, "select failed with: %s", strerror(errno));
-        return -1;
-    }
 
     iov.iov_len = MAX_MSG_SIZE;
     iov.iov_base = (caddr_t) msg;
@@ -195,7 +205,7 @@ int get_rx(int socket, unsigned char *msg)
     mhdr.msg_control = NULL;
     mhdr.msg_controllen = 0;
 
-    len = recvmsg(socket, &mhdr, 0);
+    len = recvmsg(socket, &mhdr, MSG_DONTWAIT);
 
     /* Impossible.. But let's not take chances */
     if (len > MAX_MSG_SIZE)
@@ -206,6 +216,8 @@ int get_rx(int socket, unsigned char *msg)
     
     if (len < 0)
     {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
         if (errno != EINTR)
             flog(LOG_ERR, "recvmsg failed with: %s", strerror(errno));
         return -1;
@@ -227,9 +239,12 @@ int get_rx(int socket, unsigned char *msg)
  *      The data.
  *
  * Return:
- *      int length of data received, otherwise -1 on error
+ *      int length of data received, 0 if nothing was waiting, otherwise
+ *      -1 on error
  *
  * NOTES:
+ * Never blocks: the dispatcher only calls once the socket is readable,
+ * and select() can't take fds past FD_SETSIZE anyway.
  * There's a lot of temp data structures needed here, but we really don't
  * care about them afterwards. Once we've got the raw data and the len
  * we're good.
@@ -240,7 +255,6 @@ int get_rx_icmp6(int socket, unsigned char *msg, struct in6_addr *addr6)
     struct msghdr mhdr;
     struct iovec iov[2];
     int len;
-    fd_set rfds;
     
     /* For ancillary data */
     u_char cbuf[2048];
@@ -248,16 +262,6 @@ int get_rx_icmp6(int socket, unsigned char *msg, struct in6_addr *addr6)
     struct in6_pktinfo *thispkt6;
     char    addr_str[INET6_ADDRSTRLEN];
 
-    FD_ZERO( &rfds );
-    FD_SET( socket, &rfds );
-
-    if( select( socket+1, &rfds, NULL, NULL, NULL ) < 0 )
-    {
-        if (errno != EINTR)
-            flog(LOG_ERR, "select failed with: %s", strerror(errno));
-        return -1;
-    }
-
     iov[0].iov_len = MAX_MSG_SIZE;
     iov[0].iov_base = (caddr_t) msg;
 
@@ -269,7 +273,15 @@ int get_rx_icmp6(int socket, unsigned char *msg, struct in6_addr *addr6)
     mhdr.msg_control = (caddr_t)cbuf;
     mhdr.msg_controllen = sizeof(cbuf);
    
-    len = recvmsg(socket, &mhdr, 0);
+    len = recvmsg(socket, &mhdr, MSG_DONTWAIT);
+    if (len < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        if (errno != EINTR)
+            flog(LOG_ERR, "recvmsg failed with: %s", strerror(errno));
+        return -1;
+    }
     
     /* Src addr  - copy it for caller*/
     memcpy(addr6, &(saddr.sin6_addr), sizeof(struct in6_addr));
@@ -302,22 +314,240 @@ int get_rx_icmp6(int socket, unsigned char *msg, struct in6_addr *addr6)
         flog(LOG_ERR, "Read more data from socket than we can handle. Ignoring it.");
         return -1;
     }
-    
-    if (len < 0)
+
+    return len;
+}
+
+
+
+
+/*****************************************************************************
+ * get_rx_batch
+ *      Pulls up to a batch of waiting packets off a socket in one go,
+ *      via recvmmsg(). Never blocks.
+ *
+ * Inputs:
+ *  socket is where the data is waiting.
+ *  max is the most we want this time (capped at RX_BATCH).
+ *
+ * Outputs:
+ *  struct rxBatch *batch
+ *      The data, lengths and source addresses.
+ *
+ * Return:
+ *      int number of packets received, 0 if none were waiting,
+ *      otherwise -1 on error
+ */
+int get_rx_batch(int socket, struct rxBatch *batch, int max)
+{
+    int idx, got;
+
+    if (max > RX_BATCH)
+        max = RX_BATCH;
+
+    for (idx = 0; idx < max; idx++)
+    {
+        batch->iov[idx].iov_base = batch->data[idx];
+        batch->iov[idx].iov_len = MAX_MSG_SIZE;
+        memset(&batch->msgs[idx].msg_hdr, 0, sizeof(struct msghdr));
+        batch->msgs[idx].msg_hdr.msg_name = &batch->names[idx];
+        batch->msgs[idx].msg_hdr.msg_namelen = sizeof(batch->names[idx]);
+        batch->msgs[idx].msg_hdr.msg_iov = &batch->iov[idx];
+        batch->msgs[idx].msg_hdr.msg_iovlen = 1;
+    }
+
+    got = recvmmsg(socket, batch->msgs, max, MSG_DONTWAIT, NULL);
+    if (got < 0)
     {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
         if (errno != EINTR)
-            flog(LOG_ERR, "recvmsg failed with: %s", strerror(errno));
+            flog(LOG_ERR, "recvmmsg failed with: %s", strerror(errno));
         return -1;
     }
 
-    return len;
+    return got;
 }
 
 
+// The calling thread's queue for an interface
+static struct txQueue *txQueueFor(int ifIdx)
+{
+    return (self == &mainWorker) ? &interfaces[ifIdx].txq : &self->txq;
+}
 
 
+/*****************************************************************************
+ * queue_na
+ *      Queue an NA for the interface's ICMPv6 socket, to go out with the
+ *      rest of the batch. Flushes first if the queue is full.
+ *
+ * Inputs:
+ *  ifIdx is the index into interfaces[].
+ *  mhdr is the message as it would be given to sendmsg(). It is copied.
+ *
+ * Outputs:
+ *  The calling thread's queue for the interface.
+ *
+ * Return:
+ *      0 if queued, otherwise -1 and the caller should send it itself.
+ */
+int queue_na(int ifIdx, struct msghdr *mhdr)
+{
+    struct txQueue  *q = txQueueFor(ifIdx);
+    struct msghdr   *qhdr;
+    unsigned int    slot;
+
+    if ( (mhdr->msg_iovlen != 1) || (mhdr->msg_iov[0].iov_len > TX_NA_SIZE) ||
+         (mhdr->msg_namelen > sizeof(q->names[0])) ||
+         (mhdr->msg_controllen > sizeof(q->ctrl[0])) )
+        return -1;
+
+    if (q->count == TX_BATCH)
+        flush_tx(ifIdx);
+
+    slot = q->count++;
+    memcpy(q->data[slot], mhdr->msg_iov[0].iov_base, mhdr->msg_iov[0].iov_len);
+    q->iov[slot].iov_base = q->data[slot];
+    q->iov[slot].iov_len = mhdr->msg_iov[0].iov_len;
+    memcpy(&q->names[slot], mhdr->msg_name, mhdr->msg_namelen);
+    memcpy(q->ctrl[slot].buf, mhdr->msg_control, mhdr->msg_controllen);
+
+    qhdr = &q->msgs[slot].msg_hdr;
+    memset(qhdr, 0, sizeof(*qhdr));
+    qhdr->msg_name = &q->names[slot];
+    qhdr->msg_namelen = mhdr->msg_namelen;
+    qhdr->msg_iov = &q->iov[slot];
+    qhdr->msg_iovlen = 1;
+    qhdr->msg_control = q->ctrl[slot].buf;
+    qhdr->msg_controllen = mhdr->msg_controllen;
+
+    return 0;
+}
+
+
+/*****************************************************************************
+ * flush_tx
+ *      Send everything in the calling thread's queue for an interface,
+ *      via sendmmsg(). If only part of the batch goes, the rest is tried
+ *      again; a message the socket refuses outright is counted as an
+ *      error and skipped. The tx ring, if any, is kicked too.
+ *
+ * Inputs:
+ *  ifIdx is the index into interfaces[].
+ *
+ * Outputs:
+ *  Queue emptied, counters updated.
+ *
+ * Return:
+ *      void
+ */
+void flush_tx(int ifIdx)
+{
+    struct txQueue  *q = txQueueFor(ifIdx);
+    unsigned int    sent = 0;
+    int             rc;
+
+    if ( (self == &mainWorker) && interfaces[ifIdx].txRingPending )
+        kick_tx_ring(ifIdx);
+
+    if (q->count == 0)
+        return;
+
+    self->stats.txFlushes++;
+    while (sent < q->count)
+    {
+        rc = sendmmsg(interfaces[ifIdx].icmpSock, &q->msgs[sent], q->count - sent, 0);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            // The first of those remaining failed
+            flog(LOG_ERR, "sendmmsg returned with error %d = %s", errno, strerror(errno));
+            self->stats.naErrors++;
+            sent++;
+        }
+        else
+        {
+            flog(LOG_DEBUG2, "sendmmsg sent %d of %u NAs", rc, q->count - sent);
+            self->stats.naSent += rc;
+            sent += rc;
+        }
+
+        if (sent < q->count)
+            self->stats.txRetries++;
+    }
+    q->count = 0;
+}
+
+
+/*****************************************************************************
+ * flush_all_tx
+ *      flush_tx() on every interface. Called by the dispatcher thread at
+ *      the end of each batch of events.
+ */
+void flush_all_tx(void)
+{
+    unsigned int loop;
+
+    for (loop = 0; loop < interfaceCount; loop++)
+        flush_tx(loop);
+}
 
 
+/*****************************************************************************
+ * send_l2_na
+ *      Build a complete NA frame and send it on the interface's packet
+ *      socket, or put it in the tx ring, addressed straight to the
+ *      solicitor's MAC. Nothing in the kernel's IPv6 output path is
+ *      involved, neighbor resolution least of all.
+ *
+ * Inputs:
+ *  ifIdx is the index into interfaces[].
+ *  dstMac is the solicitor's link-layer address, from its NS.
+ *  dst and tgt are the NA's destination and target addresses.
+ *  withOpt adds the target link-layer address option.
+ *
+ * Outputs:
+ *  The NA is sent.
+ *
+ * Return:
+ *      0 on success, otherwise -1 and the caller should send it itself.
+ *      Always -1 on an AF_XDP interface: its socket takes frames only via
+ *      the TX ring, and a send() on it just kicks that ring, reporting
+ *      success for a frame it never sent.
+ */
+int send_l2_na(int ifIdx, unsigned char *dstMac, struct in6_addr *dst,
+               struct in6_addr *tgt, int withOpt)
+{
+    unsigned char   frame[MAX_PKT_BUFF];
+    unsigned int    len;
+    int             sock;
+
+    if (interfaces[ifIdx].xsk)
+        return -1;
+
+    // Workers receive on their own socket, so send on it too
+    sock = (self == &mainWorker) ? interfaces[ifIdx].pktSock : self->sock;
+    // No source address to put in it yet
+    if ( (sock < 0) || IN6_IS_ADDR_UNSPECIFIED(&interfaces[ifIdx].linkLocal) )
+        return -1;
+
+    // Straight into the tx ring if there is one, sent at the next kick
+    if ( interfaces[ifIdx].txRingMap && (self == &mainWorker) &&
+         (put_tx_ring(ifIdx, dstMac, dst, tgt, withOpt) == 0) )
+        return 0;
+
+    len = build_na_frame(ifIdx, dstMac, dst, tgt, withOpt, frame);
+    if (send(sock, frame, len, 0) < 0)
+    {
+        flog(LOG_ERR, "send on packet socket failed: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
 
 /*****************************************************************************
  * if_allmulti
@@ -388,6 +618,355 @@ sinfulexit:
 }
 
 
+/*****************************************************************************
+ * open_rx_ring
+ *      Switches an interface's packet socket over to TPACKET_V3 and maps
+ *      a receive ring on it. NSs are then handled in place in the ring
+ *      rather than being copied out one recvmsg() at a time.
+ *
+ * Inputs:
+ *  Index into interfaces[] of the interface. Its pktSock must be open.
+ *
+ * Outputs:
+ *  The ring state in interfaces[ifIdx] is set up.
+ *
+ * Return:
+ *      0 on success, otherwise -1
+ */
+int open_rx_ring(int ifIdx)
+{
+    struct npd6Interface *iface = &interfaces[ifIdx];
+    struct tpacket_req3 req;
+    int version = TPACKET_V3;
+    int err;
+    void *map;
+
+    err = setsockopt(iface->pktSock, SOL_PACKET, PACKET_VERSION, &version, sizeof(version));
+    if (err < 0)
+    {
+        flog(LOG_ERR, "setsockopt(PACKET_VERSION): %s", strerror(errno));
+        return (-1);
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = iface->opts.rxRingBlockSize;
+    req.tp_block_nr = iface->opts.rxRingBlocks;
+    req.tp_frame_size = RXRING_FRAMESIZE;
+    req.tp_frame_nr = (req.tp_block_size / req.tp_frame_size) * req.tp_block_nr;
+    req.tp_retire_blk_tov = RXRING_RETIRE_TOV;
+
+    err = setsockopt(iface->pktSock, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req));
+    if (err < 0)
+    {
+        flog(LOG_ERR, "setsockopt(PACKET_RX_RING, %u x %u): %s",
+             req.tp_block_nr, req.tp_block_size, strerror(errno));
+        return (-1);
+    }
+
+    map = mmap(NULL, (size_t)req.tp_block_size * req.tp_block_nr,
+               PROT_READ | PROT_WRITE, MAP_SHARED, iface->pktSock, 0);
+    if (map == MAP_FAILED)
+    {
+        flog(LOG_ERR, "mmap of rx ring failed: %s", strerror(errno));
+        return (-1);
+    }
+
+    iface->ringMap = map;
+    iface->ringBlockSize = req.tp_block_size;
+    iface->ringBlockCount = req.tp_block_nr;
+    iface->ringBlockIdx = 0;
+    flog(LOG_DEBUG, "rx ring on %s: %u blocks of %u bytes",
+         iface->nameStr, req.tp_block_nr, req.tp_block_size);
+
+    return 0;
+}
+
+
+/*****************************************************************************
+ * close_rx_ring
+ *      Unmaps an interface's rx ring, if it has one. The socket itself
+ *      is left for the caller to close.
+ *
+ * Inputs:
+ *  Index into interfaces[] of the interface.
+ *
+ * Outputs:
+ *  The ring state in interfaces[ifIdx] is cleared.
+ *
+ * Return:
+ *      void
+ */
+void close_rx_ring(int ifIdx)
+{
+    struct npd6Interface *iface = &interfaces[ifIdx];
+
+    if (iface->ringMap == NULL)
+        return;
+
+    munmap(iface->ringMap, (size_t)iface->ringBlockSize * iface->ringBlockCount);
+    iface->ringMap = NULL;
+}
+
+
+/*****************************************************************************
+ * open_tx_ring
+ *      Opens a send-only packet socket for an interface and maps a
+ *      TPACKET_V2 tx ring on it. NA frames are then built straight into
+ *      the ring and go out a batch at a time, optionally bypassing the
+ *      qdisc layer as well.
+ *
+ * Inputs:
+ *  Index into interfaces[] of the interface.
+ *
+ * Outputs:
+ *  The tx ring state in interfaces[ifIdx] is set up.
+ *
+ * Return:
+ *      0 on success, otherwise -1
+ */
+int open_tx_ring(int ifIdx)
+{
+    struct npd6Interface *iface = &interfaces[ifIdx];
+    struct sockaddr_ll lladdr;
+    struct tpacket_req req;
+    int version = TPACKET_V2;
+    int sock, err;
+    void *map;
+
+    // Protocol 0, so it never receives anything
+    sock = socket(PF_PACKET, SOCK_RAW, 0);
+    if (sock < 0)
+    {
+        flog(LOG_ERR, "Can't create socket(PF_PACKET): %s", strerror(errno));
+        return (-1);
+    }
+
+    memset(&lladdr, 0, sizeof(lladdr));
+    lladdr.sll_family = PF_PACKET;
+    lladdr.sll_ifindex = iface->index;
+    err = bind(sock, (struct sockaddr *)&lladdr, sizeof(lladdr));
+    if (err < 0)
+    {
+        flog(LOG_ERR, "tx socket bind to interface %d failed: %s", iface->index, strerror(errno));
+        goto fail;
+    }
+
+    err = setsockopt(sock, SOL_PACKET, PACKET_VERSION, &version, sizeof(version));
+    if (err < 0)
+    {
+        flog(LOG_ERR, "setsockopt(PACKET_VERSION): %s", strerror(errno));
+        goto fail;
+    }
+
+    if (qdiscBypass &&
+        (setsockopt(sock, SOL_PACKET, PACKET_QDISC_BYPASS, &qdiscBypass, sizeof(qdiscBypass)) < 0) )
+    {
+        // Not fatal, just slower
+        flog(LOG_WARNING, "setsockopt(PACKET_QDISC_BYPASS): %s", strerror(errno));
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = TXRING_BLOCKSIZE;
+    req.tp_block_nr = TXRING_BLOCKS;
+    req.tp_frame_size = TXRING_FRAMESIZE;
+    req.tp_frame_nr = (req.tp_block_size / req.tp_frame_size) * req.tp_block_nr;
+
+    err = setsockopt(sock, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req));
+    if (err < 0)
+    {
+        flog(LOG_ERR, "setsockopt(PACKET_TX_RING, %u x %u): %s",
+             req.tp_block_nr, req.tp_block_size, strerror(errno));
+        goto fail;
+    }
+
+    map = mmap(NULL, (size_t)req.tp_block_size * req.tp_block_nr,
+               PROT_READ | PROT_WRITE, MAP_SHARED, sock, 0);
+    if (map == MAP_FAILED)
+    {
+        flog(LOG_ERR, "mmap of tx ring failed: %s", strerror(errno));
+        goto fail;
+    }
+
+    iface->txSock = sock;
+    iface->txRingMap = map;
+    iface->txRingFrames = req.tp_frame_nr;
+    iface->txRingIdx = 0;
+    iface->txRingPending = 0;
+    flog(LOG_DEBUG, "tx ring on %s: %u frames%s", iface->nameStr, req.tp_frame_nr,
+         qdiscBypass ? ", bypassing qdisc" : "");
+
+    return 0;
+
+fail:
+    close(sock);
+    return (-1);
+}
+
+
+/*****************************************************************************
+ * close_tx_ring
+ *      Unmaps an interface's tx ring, if it has one, and closes its
+ *      socket.
+ *
+ * Inputs:
+ *  Index into interfaces[] of the interface.
+ *
+ * Outputs:
+ *  The tx ring state in interfaces[ifIdx] is cleared.
+ *
+ * Return:
+ *      void
+ */
+void close_tx_ring(int ifIdx)
+{
+    struct npd6Interface *iface = &interfaces[ifIdx];
+
+    if (iface->txRingMap == NULL)
+        return;
+
+    munmap(iface->txRingMap, (size_t)TXRING_FRAMESIZE * iface->txRingFrames);
+    close(iface->txSock);
+    iface->txRingMap = NULL;
+}
+
+
+/*****************************************************************************
+ * put_tx_ring
+ *      Build an NA frame in the next free slot of the interface's tx ring.
+ *      It goes out at the next kick_tx_ring(). If the ring is full it is
+ *      kicked there and then, and the slot waited on for up to
+ *      TXRING_WAIT ms. The kernel sends the ring strictly in order, so
+ *      there's no skipping ahead to some other slot that happens to be
+ *      free.
+ *
+ * Inputs:
+ *  Index into interfaces[] of the interface, then as per build_na_frame().
+ *
+ * Outputs:
+ *  Slot handed to the kernel.
+ *
+ * Return:
+ *      0 on success, otherwise -1 if the ring has no room and the caller
+ *      should send it itself.
+ */
+int put_tx_ring(int ifIdx, unsigned char *dstMac, struct in6_addr *dst,
+                struct in6_addr *tgt, int withOpt)
+{
+    struct npd6Interface    *iface = &interfaces[ifIdx];
+    struct tpacket2_hdr     *hdr;
+    struct pollfd           pfd;
+    unsigned int            status;
+
+    hdr = (struct tpacket2_hdr *)(iface->txRingMap + (size_t)iface->txRingIdx * TXRING_FRAMESIZE);
+    status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+    if (status & TP_STATUS_WRONG_FORMAT)
+    {
+        // The kernel stops at a frame it won't send; reclaim the slot
+        flog(LOG_ERR, "tx ring on %s rejected a frame", iface->nameStr);
+        self->stats.txRingErrors++;
+        status = TP_STATUS_AVAILABLE;
+    }
+    else if (status != TP_STATUS_AVAILABLE)
+    {
+        // Full. Frames in flight free up as the driver finishes with them,
+        // and that wakes POLLOUT.
+        kick_tx_ring(ifIdx);
+        pfd.fd = iface->txSock;
+        pfd.events = POLLOUT;
+        status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+        if ( (status != TP_STATUS_AVAILABLE) && (poll(&pfd, 1, TXRING_WAIT) > 0) )
+            status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+        if (status != TP_STATUS_AVAILABLE)
+        {
+            flog(LOG_DEBUG, "tx ring on %s full", iface->nameStr);
+            return -1;
+        }
+    }
+
+    hdr->tp_len = build_na_frame(ifIdx, dstMac, dst, tgt, withOpt,
+                                 (unsigned char *)hdr + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll));
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+    iface->txRingIdx = (iface->txRingIdx + 1) % iface->txRingFrames;
+    iface->txRingPending++;
+    return 0;
+}
+
+
+/*****************************************************************************
+ * kick_tx_ring
+ *      Have the kernel send everything waiting in an interface's tx ring.
+ *      Anything it couldn't take this time stays in the ring for the
+ *      next kick.
+ */
+void kick_tx_ring(int ifIdx)
+{
+    struct npd6Interface *iface = &interfaces[ifIdx];
+
+    if (send(iface->txSock, NULL, 0, MSG_DONTWAIT) < 0)
+    {
+        if ( (errno != EAGAIN) && (errno != ENOBUFS) )
+            flog(LOG_ERR, "tx ring send on %s failed: %s", iface->nameStr, strerror(errno));
+        self->stats.txRingErrors++;
+    }
+    else
+        self->stats.txFlushes++;
+    iface->txRingPending = 0;
+}
+
+
+/*****************************************************************************
+ * get_rx_ring
+ *      Called from the dispatcher when an interface's ring has data.
+ *      Walks every block the kernel has handed over, passes each frame
+ *      directly to processNS() and returns the block to the kernel.
+ *
+ * Inputs:
+ *  Index into interfaces[] of the interface.
+ *
+ * Outputs:
+ *  As per processNS().
+ *
+ * Return:
+ *      int number of frames handled
+ */
+int get_rx_ring(int ifIdx)
+{
+    struct npd6Interface        *iface = &interfaces[ifIdx];
+    struct tpacket_block_desc   *bd;
+    struct tpacket3_hdr         *ppd;
+    unsigned int                pkt, numPkts;
+    int                         frames = 0;
+
+    for (;;)
+    {
+        bd = (struct tpacket_block_desc *)
+             (iface->ringMap + (size_t)iface->ringBlockIdx * iface->ringBlockSize);
+
+        if ( !(bd->hdr.bh1.block_status & TP_STATUS_USER) )
+            break;
+        // Don't read the block contents ahead of its status
+        __sync_synchronize();
+
+        numPkts = bd->hdr.bh1.num_pkts;
+        ppd = (struct tpacket3_hdr *)((unsigned char *)bd + bd->hdr.bh1.offset_to_first_pkt);
+        for (pkt = 0; pkt < numPkts; pkt++)
+        {
+            processNS(ifIdx, (unsigned char *)ppd + ppd->tp_mac, ppd->tp_snaplen);
+            ppd = (struct tpacket3_hdr *)((unsigned char *)ppd + ppd->tp_next_offset);
+        }
+        frames += numPkts;
+
+        // Hand the block back
+        __sync_synchronize();
+        bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        iface->ringBlockIdx = (iface->ringBlockIdx + 1) % iface->ringBlockCount;
+    }
+
+    return frames;
+}
+
+
 /*****************************************************************************
  * init_sockets
  *  Initialises the tx and rx sockets. Normally just called during startup,
@@ -405,14 +984,27 @@ sinfulexit:
 int init_sockets(void)
 {
     int errcount = 0;
-    int loop, sock, sockicmp;
+    int loop, sock, sockicmp, useWorkers;
+
+    /* The eBPF filters' addrlist map, updated in place on a reload */
+    if (socketFilter == FILTER_EBPF)
+        sync_list_map();
 
     /* Raw socket for receiving NSs */
     for (loop=0; loop < interfaceCount; loop++)
     {
-        sock = open_packet_socket(interfaces[loop].index);
+        /* Worker threads have sockets of their own, started below */
+        useWorkers = interfaces[loop].opts.workers && !interfaces[loop].opts.xdp;
+
+        /* Or, if configured, an AF_XDP socket fed by an XDP program */
+        if (interfaces[loop].opts.xdp)
+            sock = open_xdp_socket(loop);
+        else if (useWorkers)
+            sock = -1;
+        else
+            sock = open_packet_socket(loop);
   
-        if (sock < 0)
+        if ( (sock < 0) && !useWorkers )
         {
             flog(LOG_ERR, "open_packet_socket: failed on iteration %d", loop);
             errcount++;
@@ -420,7 +1012,22 @@ int init_sockets(void)
         interfaces[loop].pktSock = sock;
         flog(LOG_DEBUG, "open_packet_socket: %d OK.", loop);
         flog(LOG_DEBUG2, "open_packet_socket value = %d", sock);
+
+        /* Optionally receive via a mapped ring. Moot with AF_XDP. */
+        if ( (sock >= 0) && !interfaces[loop].xsk && interfaces[loop].opts.rxRing )
+        {
+            if (open_rx_ring(loop) < 0)
+            {
+                flog(LOG_ERR, "open_rx_ring: failed on iteration %d", loop);
+                errcount++;
+            }
+        }
     
+        /* Optionally send whole NA frames via a mapped ring. Not with
+           AF_XDP, which has a tx ring of its own. */
+        if ( (naTransmit == NATX_TXRING) && !interfaces[loop].xsk && (open_tx_ring(loop) < 0) )
+            flog(LOG_WARNING, "open_tx_ring: failed on iteration %d, sending without it", loop);
+
         /* ICMPv6 socket for sending NAs */
         sockicmp = open_icmpv6_socket();
         if (sockicmp < 0)
@@ -430,6 +1037,13 @@ int init_sockets(void)
         }
         flog(LOG_DEBUG, "open_icmpv6_socket: OK.");
         interfaces[loop].icmpSock = sockicmp;
+
+        /* Workers last, as they send on the ICMPv6 socket */
+        if (useWorkers && start_workers(loop))
+        {
+            flog(LOG_ERR, "start_workers: failed on iteration %d", loop);
+            errcount++;
+        }
     }
     
     return errcount;
@@ -58,6 +58,8 @@
 #include <getopt.h>
 #include <ifaddrs.h>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <pthread.h>
 #include <linux/netlink.h>
 #include <netinet/in.h>
 #include <ctype.h>
@@ -65,9 +67,6 @@
 #include <linux/filter.h>
 #include <stddef.h>
 
-// For tree handling
-#include <search.h>
-
 
 #endif /* INCLUDES_H */
 
@@ -26,6 +26,44 @@
 #include "npd6.h"
 
 #include "expintf.h"
+#include "cksum.h"
+#include "cpu.h"
+
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif
+
+/*****************************************************************************
+ * findSLLA
+ *  Looks through an NS's options for the Source Link-Layer Address.
+ *
+ * Inputs:
+ *  ns is the NS, icmpLen how much of it there is.
+ *
+ * Return:
+ *      Pointer to the 6-byte MAC within the NS, or NULL if there is none
+ *      or the options are malformed.
+ */
+static unsigned char *findSLLA(struct nd_neighbor_solicit *ns, int icmpLen)
+{
+    unsigned char       *opt = (unsigned char *)(ns + 1);
+    unsigned char       *end = (unsigned char *)ns + icmpLen;
+    struct nd_opt_hdr   *optHdr;
+
+    while (opt + sizeof(struct nd_opt_hdr) <= end)
+    {
+        optHdr = (struct nd_opt_hdr *)opt;
+        // Zero length is invalid, and would loop forever
+        if ( (optHdr->nd_opt_len == 0) || (opt + optHdr->nd_opt_len * 8 > end) )
+            return NULL;
+        if ( (optHdr->nd_opt_type == ND_OPT_SOURCE_LINKADDR) && (optHdr->nd_opt_len == 1) )
+            return (unsigned char *)(optHdr + 1);
+        opt += optHdr->nd_opt_len * 8;
+    }
+
+    return NULL;
+}
+
 
 /*****************************************************************************
  * processNS
@@ -72,31 +110,28 @@ void processNS( int ifIndex,
     // For the interfaceIdx
     struct  in6_addr            prefixaddr = interfaces[ifIndex].prefix;
     int                         prefixaddrlen = interfaces[ifIndex].prefixLen;
-    unsigned char               *linkAddr = interfaces[ifIndex].linkAddr;
-    int                         interfaceIdx = interfaces[ifIndex].index;
     
     // Extracted from the received packet
     struct in6_addr             *srcaddr;
     struct in6_addr             *dstaddr;
     struct in6_addr             *targetaddr;
     unsigned int                multicastNS;
+    int                         icmpLen;
+    unsigned char               *slla;
     
     // For outgoing NA
-    struct in6_addr             srcLinkAddr = IN6ADDR_ANY_INIT;
-    struct in6_pktinfo          *pkt_info;
+    struct naTemplate           *tmpl;
+    int                         withOpt;
     struct sockaddr_in6         sockaddr;
-    unsigned char               nabuff[MAX_PKT_BUFF];
+    unsigned char               nabuff[TX_NA_SIZE];
     struct nd_neighbor_advert   *nad;
-    size_t                      iovlen=0;
     struct iovec                iov;
-    struct cmsghdr              *cmsg;
-    char __attribute__((aligned(8))) chdr[CMSG_SPACE(sizeof(struct in6_pktinfo))];
     struct msghdr               mhdr;
     ssize_t                     err;
-    struct nd_opt_hdr           *opthdr;
-    void                        *optdata;
     
     
+    self->stats.nsReceived++;
+
     // Validate ICMP packet type, to ensure filter was correct
     // In theory not required, as the filter CAN'T be wrong...!
     if ( icmph->icmp6_type == ND_NEIGHBOR_SOLICIT )
@@ -117,6 +152,28 @@ void processNS( int ifIndex,
         flog(LOG_ERR, "Received impossible packet... filter failed. Oooops.");
         return;
     }
+
+    // RFC4861, 7.1.1. The socket filters check this, but AF_XDP frames
+    // never go through them.
+    if ( (ip6h->ip6_hlim != 255) || (icmph->icmp6_code != 0) )
+    {
+        flog(LOG_DEBUG, "Hop limit not 255 or code not 0 - Ignoring NS.");
+        return;
+    }
+
+    // How much of the NS, options included, we actually have
+    icmpLen = min( (int)ntohs(ip6h->ip6_plen),
+                   (int)len - ETH_HLEN - (int)sizeof(struct ip6_hdr) );
+
+    // Nothing has checked the checksum yet on a packet socket
+    if ( (icmpLen < (int)sizeof(struct nd_neighbor_solicit)) ||
+         cksum_fold(cksum_partial(icmph, icmpLen,
+                                  cksum_pseudo6(srcaddr, dstaddr, icmpLen, IPPROTO_ICMPV6))) )
+    {
+        flog(LOG_DEBUG, "Truncated or bad checksum - Ignoring NS.");
+        self->stats.nsBadCksum++;
+        return;
+    }
     
     // Bug 27 - Handle DAD NS as per RFC4862, 5.4.3
     if ( IN6_IS_ADDR_UNSPECIFIED(srcaddr) )
@@ -165,18 +222,19 @@ void processNS( int ifIndex,
             break;
             
         case BLACKLIST:
+            // If active and tgt is in the list, bail. Most targets won't
+            // be, which the Bloom filter usually spots straight away.
+            if ( addrlist_match(targetaddr) )
+            {
+                flog(LISTLOGGING, "NS for blacklisted specific addr: %s", targetaddr_str);
+                return; //Abandon
+            }
             // See if the address matches an expression
-            if((compareExpression(targetaddr) == 1))
+            if ( countExpressions() && (compareExpression(targetaddr) == 1) )
             {
                 flog(LISTLOGGING, "NS for blacklisted EXPR address: %s", targetaddr_str);
                 return; // Abandon
             }
-            // If active and tgt is in the list, bail.
-            if ( tfind( (void *)targetaddr, &lRoot, tCompare) )
-            {
-                flog(LISTLOGGING, "NS for blacklisted specific addr: %s", targetaddr_str);
-                return; //Abandon
-            }
             break;
             
         case WHITELIST:
@@ -188,7 +246,7 @@ void processNS( int ifIndex,
             }
             
             // If active and tgt is NOT in the list (and didn't match an expr above), bail.
-            if ( tfind( (void *)targetaddr, &lRoot, tCompare) )
+            if ( addrlist_match(targetaddr) )
             {
                 flog(LISTLOGGING, "NS for specific addr whitelisted: %s", targetaddr_str);
                 break;
@@ -203,8 +261,10 @@ void processNS( int ifIndex,
             break;
     }
     
-    // Does it match our configured prefix that we're interested in?
-    if (! addr6match( targetaddr, &prefixaddr, prefixaddrlen) )
+    // Does it match our configured prefix that we're interested in? Or
+    // any of them, if the interface has extras.
+    if ( interfaces[ifIndex].lpm ? !lpm_lookup(interfaces[ifIndex].lpm, targetaddr)
+                                 : !addr6match( targetaddr, &prefixaddr, prefixaddrlen) )
     {
         flog(LOG_DEBUG, "Target/:prefix - Ignore NS.");
         return;
@@ -220,91 +280,204 @@ void processNS( int ifIndex,
             storeTarget( targetaddr );
         }
 
-        // Start building up the header for the packet
-        memset(( void *)&sockaddr, 0, sizeof(struct sockaddr_in6));
-        sockaddr.sin6_family = AF_INET6;
-        sockaddr.sin6_port = htons(IPPROTO_ICMPV6);
-        
-        // Set the destination of the NA
-        memcpy(&sockaddr.sin6_addr, srcaddr, sizeof(struct in6_addr));
-        
-        // Set up the NA itself
-        memset( nabuff, 0, sizeof(nabuff) );
-        nad = (struct nd_neighbor_advert *)nabuff;
-        nad->nd_na_type = ND_NEIGHBOR_ADVERT;
-        nad->nd_na_code = 0;
-        nad->nd_na_cksum = 0;
-        if (naRouter)
+        // With AF_XDP the NA goes straight back out on the socket's TX
+        // ring. If that can't take it, fall back to the ICMPv6 socket;
+        // send_l2_na() won't send on an AF_XDP socket.
+        if ( interfaces[ifIndex].xsk &&
+             (xdp_send_na(ifIndex, msg + ETH_ALEN, srcaddr, targetaddr,
+                          multicastNS || naLinkOptFlag) == 0) )
         {
-            nad->nd_na_flags_reserved |= ND_NA_FLAG_SOLICITED | ND_NA_FLAG_ROUTER;
+            flog(LOG_DEBUG2, "NA queued on AF_XDP socket");
+            self->stats.naSent++;
+            return;
         }
-        else
+
+        // Or, given the solicitor's MAC, build and send the whole frame
+        // ourselves rather than have the kernel resolve it.
+        if ( (naTransmit != NATX_ICMP) &&
+             (slla = findSLLA(ns, icmpLen)) &&
+             (send_l2_na(ifIndex, slla, srcaddr, targetaddr, multicastNS || naLinkOptFlag) == 0) )
         {
-            nad->nd_na_flags_reserved |= ND_NA_FLAG_SOLICITED;
+            flog(LOG_DEBUG2, "NA sent on packet socket");
+            self->stats.naSent++;
+            return;
         }
-        
+
+        // Everything but the target and destination is in the template
+        tmpl = &interfaces[ifIndex].naTmpl;
+        // Per rfc, we must add the target link-layer option for NSs that
+        // came to the multicast group addr, or if the config forces it.
+        withOpt = (multicastNS || naLinkOptFlag) ? NA_WITHOPT : NA_NOOPT;
+        memcpy(nabuff, tmpl->na, tmpl->len[withOpt]);
+        nad = (struct nd_neighbor_advert *)nabuff;
         memcpy(&(nad->nd_na_target), targetaddr, sizeof(struct in6_addr) );
+        iov.iov_len = tmpl->len[withOpt];
+        iov.iov_base = (caddr_t) nabuff;
+
+        // Set the destination of the NA
+        sockaddr = tmpl->dst;
+        memcpy(&sockaddr.sin6_addr, srcaddr, sizeof(struct in6_addr));
         
-        if (multicastNS || naLinkOptFlag)
-        {
-            // If the NS that came in was to a multicast address
-            // or if we have forced the option for all packets anyway
-            // then add a target link-layer option to the outgoing NA.
-            // Per rfc, we must add dest link-addr option for NSs that came
-            // to the multicast group addr.
-            opthdr = (struct nd_opt_hdr *)&nabuff[sizeof(struct nd_neighbor_advert)] ;
-            opthdr->nd_opt_type = ND_OPT_TARGET_LINKADDR;
-            opthdr->nd_opt_len = 1; // Units of 8-octets
-            optdata = (unsigned char *) (opthdr + 1);
-            memcpy( optdata, linkAddr, 6);
-            
-            // Build the io vector
-            iovlen = sizeof(struct nd_neighbor_advert) + sizeof(struct nd_opt_hdr) + ETH_ALEN;
-            iov.iov_len = iovlen;
-            iov.iov_base = (caddr_t) nabuff;
-        } else
-        {
-            // The NS was unicast AND the config option was unset.
-            // Build the io vector
-            iovlen = sizeof(struct nd_neighbor_advert);
-            iov.iov_len = iovlen;
-            iov.iov_base = (caddr_t) nabuff;
-        }
-        
-        // Build the cmsg
-        memset(chdr, 0, sizeof(chdr) );
-        cmsg = (struct cmsghdr *) chdr;
-        cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo) );
-        cmsg->cmsg_level = IPPROTO_IPV6;
-        cmsg->cmsg_type = IPV6_PKTINFO;
-        
-        pkt_info = (struct in6_pktinfo *)CMSG_DATA(cmsg);
-        
-        // Set src (sending) addr and outgoing i/f for the datagram            
-        memcpy(&pkt_info->ipi6_addr, &srcLinkAddr, sizeof(struct in6_addr) );
-        pkt_info->ipi6_ifindex = interfaceIdx;        
-        
-        // Build the mhdr
+        // Build the mhdr. The cmsg never changes, so is used in place.
         memset(&mhdr, 0, sizeof(mhdr) );
         mhdr.msg_name = (caddr_t)&sockaddr;
         mhdr.msg_namelen = sizeof(sockaddr);
         mhdr.msg_iov = &iov;
         mhdr.msg_iovlen = 1;
-        mhdr.msg_control = (void *) cmsg;
-        mhdr.msg_controllen = sizeof(chdr);
+        mhdr.msg_control = (void *) tmpl->ctrl.buf;
+        mhdr.msg_controllen = sizeof(tmpl->ctrl.buf);
         
         flog(LOG_DEBUG2, "Outbound message built");
+
+        // With io_uring it goes out with the next submission and is
+        // counted when it completes
+        if (uring_send(interfaces[ifIndex].icmpSock, &mhdr) == 0)
+        {
+            flog(LOG_DEBUG2, "NA queued on io_uring");
+            return;
+        }
+
+        // Otherwise it waits for the end of the batch
+        if (queue_na(ifIndex, &mhdr) == 0)
+        {
+            flog(LOG_DEBUG2, "NA queued for sendmmsg");
+            return;
+        }
         
         err = sendmsg( interfaces[ifIndex].icmpSock, &mhdr, 0);
         if (err < 0)
+        {
             flog(LOG_ERR, "sendmsg returned with error %d = %s", errno, strerror(errno));
+            self->stats.naErrors++;
+        }
         else
+        {
             flog(LOG_DEBUG2, "sendmsg completed OK");
+            self->stats.naSent++;
+        }
         
     }
 }
 
 
+/*****************************************************************************
+ * build_na_template
+ *  Prebuild an interface's NA, and the addressing for sending it on the
+ *  ICMPv6 socket, from the config. Called whenever the config is loaded.
+ *
+ * Inputs:
+ *  ifIndex is the index into interfaces[], with linkAddr and index set.
+ *
+ * Outputs:
+ *  interfaces[ifIndex].naTmpl
+ *
+ * Return:
+ *      void
+ */
+void build_na_template(int ifIndex)
+{
+    struct naTemplate           *tmpl = &interfaces[ifIndex].naTmpl;
+    struct nd_neighbor_advert   *nad = (struct nd_neighbor_advert *)tmpl->na;
+    struct nd_opt_hdr           *opthdr = (struct nd_opt_hdr *)(nad + 1);
+    struct cmsghdr              *cmsg;
+    struct in6_pktinfo          *pkt_info;
+
+    memset(tmpl, 0, sizeof(struct naTemplate));
+
+    nad->nd_na_type = ND_NEIGHBOR_ADVERT;
+    nad->nd_na_code = 0;
+    nad->nd_na_flags_reserved = ND_NA_FLAG_SOLICITED;
+    if (naRouter)
+        nad->nd_na_flags_reserved |= ND_NA_FLAG_ROUTER;
+
+    // The target link-layer option, only sent when len[NA_WITHOPT] is used
+    opthdr->nd_opt_type = ND_OPT_TARGET_LINKADDR;
+    opthdr->nd_opt_len = 1; // Units of 8-octets
+    memcpy(opthdr + 1, interfaces[ifIndex].linkAddr, ETH_ALEN);
+
+    tmpl->len[NA_NOOPT] = sizeof(struct nd_neighbor_advert);
+    tmpl->len[NA_WITHOPT] = sizeof(struct nd_neighbor_advert) + sizeof(struct nd_opt_hdr) + ETH_ALEN;
+
+    // Checksums of both, bar the addresses, which build_na_frame() adds
+    tmpl->sum[NA_NOOPT] = cksum_partial(tmpl->na, tmpl->len[NA_NOOPT],
+                                        cksum_add32(htonl(tmpl->len[NA_NOOPT]), htonl(IPPROTO_ICMPV6)));
+    tmpl->sum[NA_WITHOPT] = cksum_partial(tmpl->na, tmpl->len[NA_WITHOPT],
+                                          cksum_add32(htonl(tmpl->len[NA_WITHOPT]), htonl(IPPROTO_ICMPV6)));
+
+    tmpl->dst.sin6_family = AF_INET6;
+    tmpl->dst.sin6_port = htons(IPPROTO_ICMPV6);
+
+    // Unspecified src addr, so the kernel picks it, on the interface
+    cmsg = &tmpl->ctrl.align;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
+    cmsg->cmsg_level = IPPROTO_IPV6;
+    cmsg->cmsg_type = IPV6_PKTINFO;
+    pkt_info = (struct in6_pktinfo *)CMSG_DATA(cmsg);
+    pkt_info->ipi6_addr = in6addr_any;
+    pkt_info->ipi6_ifindex = interfaces[ifIndex].index;
+}
+
+
+/*****************************************************************************
+ * build_na_frame
+ *  Build a complete NA, Ethernet header and all, for backends which
+ *  transmit at layer 2 and so get no help from the kernel's IPv6 stack.
+ *  Content is as per the NA that processNS() sends via the ICMPv6 socket.
+ *
+ * Inputs:
+ *  ifIndex is the index into interfaces[]. Its linkLocal must be set.
+ *  dstMac and dstaddr are where the NA is going.
+ *  targetaddr is the target being advertised.
+ *  withOpt adds the target link-layer address option.
+ *
+ * Outputs:
+ *  unsigned char *frame
+ *      The frame. Must have room for MAX_PKT_BUFF bytes.
+ *
+ * Return:
+ *      Length of the frame.
+ *
+ */
+unsigned int build_na_frame( int ifIndex,
+                             unsigned char *dstMac,
+                             struct in6_addr *dstaddr,
+                             struct in6_addr *targetaddr,
+                             int withOpt,
+                             unsigned char *frame)
+{
+    struct ethhdr               *eth = (struct ethhdr *)frame;
+    struct ip6_hdr              *ip6h = (struct ip6_hdr *)(frame + ETH_HLEN);
+    struct nd_neighbor_advert   *nad =
+    (struct nd_neighbor_advert *)(frame + ETH_HLEN + sizeof(struct ip6_hdr));
+    struct naTemplate           *tmpl = &interfaces[ifIndex].naTmpl;
+    int                         variant = withOpt ? NA_WITHOPT : NA_NOOPT;
+    unsigned int                icmpLen = tmpl->len[variant];
+    uint32_t                    sum;
+
+    memcpy(eth->h_dest, dstMac, ETH_ALEN);
+    memcpy(eth->h_source, interfaces[ifIndex].linkAddr, ETH_ALEN);
+    eth->h_proto = htons(ETH_P_IPV6);
+
+    memcpy(nad, tmpl->na, icmpLen);
+    memcpy(&nad->nd_na_target, targetaddr, sizeof(struct in6_addr));
+
+    ip6h->ip6_flow = htonl(6 << 28);
+    ip6h->ip6_plen = htons(icmpLen);
+    ip6h->ip6_nxt = IPPROTO_ICMPV6;
+    ip6h->ip6_hlim = maxHops;
+    memcpy(&ip6h->ip6_src, &interfaces[ifIndex].linkLocal, sizeof(struct in6_addr));
+    memcpy(&ip6h->ip6_dst, dstaddr, sizeof(struct in6_addr));
+
+    // Patch the addresses into the template's checksum
+    sum = cksum_add_addr(tmpl->sum[variant], &ip6h->ip6_src);
+    sum = cksum_add_addr(sum, &ip6h->ip6_dst);
+    sum = cksum_add_addr(sum, targetaddr);
+    nad->nd_na_cksum = cksum_fold(sum);
+
+    return ETH_HLEN + sizeof(struct ip6_hdr) + icmpLen;
+}
+
+
 /*****************************************************************************
  * processICMP
  * Takes a received ICMP message and handles it. At first, we don't
@@ -466,6 +639,13 @@ void processICMP( int ifIndex,
  *
  */
 int addr6match( struct in6_addr *a1, struct in6_addr *a2, int bits)
+{
+    return addr6matchImpl(a1, a2, bits);
+}
+
+
+// The original, octet at a time, with commentary
+static int addr6match_bytewise( struct in6_addr *a1, struct in6_addr *a2, int bits)
 {
     int idx, bdx;
     unsigned int mask;
@@ -521,3 +701,62 @@ int addr6match( struct in6_addr *a1, struct in6_addr *a2, int bits)
     return 1;
 }
 
+
+// Prefix mask for the 64 bits of an address starting at bit 'from',
+// in network byte order
+static inline uint64_t prefixMask64(int bits, int from)
+{
+    bits -= from;
+    if (bits <= 0)
+        return 0;
+    if (bits >= 64)
+        return ~0ULL;
+    return htobe64(~0ULL << (64 - bits));
+}
+
+// Two 64-bit halves at a time
+static int addr6match_u64( struct in6_addr *a1, struct in6_addr *a2, int bits)
+{
+    uint64_t    w1[2], w2[2];
+
+    if (bits > 128)
+    {
+        flog(LOG_ERR, "Bits > 128 (%d) does not make sense.", bits);
+        return 0;
+    }
+
+    memcpy(w1, a1, sizeof(w1));
+    memcpy(w2, a2, sizeof(w2));
+    return ( !((w1[0] ^ w2[0]) & prefixMask64(bits, 0)) &&
+             !((w1[1] ^ w2[1]) & prefixMask64(bits, 64)) );
+}
+
+#ifdef CPU_X86
+// The whole address in one register
+__attribute__((target("sse2")))
+static int addr6match_sse2( struct in6_addr *a1, struct in6_addr *a2, int bits)
+{
+    __m128i     diff, mask;
+
+    if (bits > 128)
+    {
+        flog(LOG_ERR, "Bits > 128 (%d) does not make sense.", bits);
+        return 0;
+    }
+
+    mask = _mm_set_epi64x(prefixMask64(bits, 64), prefixMask64(bits, 0));
+    diff = _mm_and_si128(_mm_xor_si128(_mm_loadu_si128((__m128i *)a1),
+                                       _mm_loadu_si128((__m128i *)a2)), mask);
+    return (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) == 0xffff);
+}
+#endif
+
+struct cpuVariant addr6matchVariants[] = {
+    { "bytewise",   0,          addr6match_bytewise },
+    { "u64",        0,          addr6match_u64 },
+#ifdef CPU_X86
+    { "sse2",       CPU_SSE2,   addr6match_sse2 },
+#endif
+    { NULL,         0,          NULL }
+};
+
@@ -0,0 +1,59 @@
+/*
+ *   This software is Copyright 2011 by Sean Groarke <sgroarke@gmail.com>
+ *   All rights reserved.
+ *
+ *   This file is part of npd6.
+ *
+ *   npd6 is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   npd6 is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with npd6.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* $Id$
+ * $HeadURL$
+ */
+
+#ifndef LISTFILE_H
+#define LISTFILE_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+// The binary addrlist file, as written by npd6list and mapped by npd6
+// (NPD6LISTFILE). A header, then count+1 addresses in network byte order:
+// a zero address, so that the rest can be indexed from 1, then the sorted
+// addresses in Eytzinger (breadth-first tree) order. i.e. address k's
+// children are at 2k and 2k+1.
+//
+// With the header a cache line long and the file mapped page-aligned, the
+// eight addresses at 8k..8k+7 - address k's great-grandchildren - always
+// fill exactly two cache lines, which a lookup prefetches three levels
+// ahead.
+//
+// The header is in the writer's byte order. A file from a machine of the
+// other order will fail the version check.
+
+#define LISTFILE_MAGIC      "NPD6LIST"
+#define LISTFILE_VERSION    1
+
+struct listFileHeader {
+    char            magic[8];
+    uint32_t        version;
+    uint32_t        headerSize;         // sizeof(struct listFileHeader)
+    uint64_t        count;              // Addresses, not counting the zero one
+    char            pad[40];
+};
+
+#define LISTFILE_SIZE(count) \
+    (sizeof(struct listFileHeader) + ((count) + 1) * sizeof(struct in6_addr))
+
+#endif
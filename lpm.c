@@ -0,0 +1,402 @@
+/*
+ *   This software is Copyright 2011 by Sean Groarke <sgroarke@gmail.com>
+ *   All rights reserved.
+ *
+ *   This file is part of npd6.
+ *
+ *   npd6 is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   npd6 is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with npd6.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* $Id$
+ * $HeadURL$
+ */
+
+/*
+ * Longest-prefix match over all of an interface's prefixes, as a
+ * poptrie (Asai & Ohara, SIGCOMM 2015). Each node covers 6 bits of the
+ * address, with one 64-bit bitmap of which of its 64 slots lead to child
+ * nodes and another marking where runs of identical leaves start. A
+ * node's children and leaves are stored contiguously, so a popcount of
+ * the bitmap below a slot gives its index. A lookup touches at most one
+ * node per 6 bits of the longest prefix, however many prefixes there are.
+ *
+ * The table is built from a plain 64-way trie, with prefixes expanded to
+ * the 6-bit boundaries, then compiled and the plain trie thrown away.
+ * Tables are only built at config load, so are read-only afterwards.
+ */
+
+#include "includes.h"
+#include "npd6.h"
+#include "cpu.h"
+
+#define LPM_STRIDE      6
+#define LPM_FANOUT      (1 << LPM_STRIDE)
+
+struct lpmNode {
+    uint64_t        vector;             // Slots with a child node
+    uint64_t        leafvec;            // Slots starting a run of leaves
+    uint32_t        base0;              // First leaf in leaves[]
+    uint32_t        base1;              // First child in nodes[]
+};
+
+struct lpmTable {
+    struct lpmNode  *nodes;
+    uint16_t        *leaves;
+    unsigned int    nodeCount;
+    unsigned int    leafCount;
+};
+
+// Build-time trie, before compression
+struct lpmBuild {
+    struct lpmBuild *child[LPM_FANOUT];
+    uint16_t        leaf[LPM_FANOUT];
+};
+
+
+// The 6 bits of addr starting at bit 'off', zero beyond bit 127
+static inline unsigned int chunk(const uint64_t *words, unsigned int off)
+{
+    unsigned int    word = off / 64, bit = off % 64;
+    uint64_t        val = words[word] << bit;
+
+    if ( (bit > 64 - LPM_STRIDE) && (word == 0) )
+        val |= words[1] >> (64 - bit);
+    return val >> (64 - LPM_STRIDE);
+}
+
+static inline void loadWords(const struct in6_addr *addr, uint64_t *words)
+{
+    memcpy(words, addr, 16);
+    words[0] = be64toh(words[0]);
+    words[1] = be64toh(words[1]);
+}
+
+
+/*****************************************************************************
+ * lpm_lookup_generic / lpm_lookup_popcnt
+ *      The lookup itself. Identical bar the instruction the compiler may
+ *      use for the popcounts.
+ */
+#define LPM_LOOKUP_BODY                                                     \
+    struct lpmNode  *node = table->nodes;                                   \
+    uint64_t        words[2], below;                                        \
+    unsigned int    off = 0, slot;                                          \
+                                                                            \
+    loadWords(addr, words);                                                 \
+    slot = chunk(words, 0);                                                 \
+    while (node->vector & (1ULL << slot))                                   \
+    {                                                                       \
+        below = 2ULL << slot;   /* 0, i.e. all bits, for slot 63 */         \
+        node = &table->nodes[node->base1 +                                  \
+                             __builtin_popcountll(node->vector & (below - 1)) - 1]; \
+        off += LPM_STRIDE;                                                  \
+        slot = chunk(words, off);                                           \
+    }                                                                       \
+    below = 2ULL << slot;                                                   \
+    return table->leaves[node->base0 +                                      \
+                         __builtin_popcountll(node->leafvec & (below - 1)) - 1];
+
+static uint16_t lpm_lookup_generic(struct lpmTable *table, const struct in6_addr *addr)
+{
+    LPM_LOOKUP_BODY
+}
+
+#ifdef CPU_X86
+__attribute__((target("popcnt")))
+static uint16_t lpm_lookup_popcnt(struct lpmTable *table, const struct in6_addr *addr)
+{
+    LPM_LOOKUP_BODY
+}
+#endif
+
+struct cpuVariant lpmLookupVariants[] = {
+    { "generic",    0,          lpm_lookup_generic },
+#ifdef CPU_X86
+    { "popcnt",     CPU_POPCNT, lpm_lookup_popcnt },
+#endif
+    { NULL,         0,          NULL }
+};
+
+
+/*****************************************************************************
+ * lpm_lookup
+ *      Find the longest of an interface's prefixes matching an address.
+ *
+ * Inputs:
+ *  table from lpm_build(), and the address.
+ *
+ * Return:
+ *      The matching prefix's value as given to lpm_build(), or 0 if none.
+ */
+uint16_t lpm_lookup(struct lpmTable *table, const struct in6_addr *addr)
+{
+    return lpmLookupImpl(table, addr);
+}
+
+
+// Put one prefix into the build-time trie. Prefixes must come shortest
+// first, so a prefix never lands where a longer one already has a child.
+static int buildInsert(struct lpmBuild *root, struct npd6Prefix *pfx, uint16_t value)
+{
+    struct lpmBuild *node = root;
+    uint64_t        words[2];
+    unsigned int    level, last, slot, span, loop;
+
+    loadWords(&pfx->prefix, words);
+    last = (pfx->len > 0) ? (pfx->len - 1) / LPM_STRIDE : 0;
+
+    for (level = 0; level < last; level++)
+    {
+        slot = chunk(words, level * LPM_STRIDE);
+        if (node->child[slot] == NULL)
+        {
+            node->child[slot] = malloc(sizeof(struct lpmBuild));
+            if (node->child[slot] == NULL)
+                return -1;
+            // Whatever covered this slot now covers all of the new node
+            memset(node->child[slot]->child, 0, sizeof(node->child[slot]->child));
+            for (loop = 0; loop < LPM_FANOUT; loop++)
+                node->child[slot]->leaf[loop] = node->leaf[slot];
+        }
+        node = node->child[slot];
+    }
+
+    // Expand to the slots it covers at the last level
+    span = 1 << (LPM_STRIDE * (last + 1) - pfx->len);
+    slot = chunk(words, last * LPM_STRIDE) & ~(span - 1);
+    for (loop = slot; loop < slot + span; loop++)
+        node->leaf[loop] = value;
+
+    return 0;
+}
+
+static void buildFree(struct lpmBuild *node)
+{
+    unsigned int loop;
+
+    for (loop = 0; loop < LPM_FANOUT; loop++)
+    {
+        if (node->child[loop])
+            buildFree(node->child[loop]);
+    }
+    free(node);
+}
+
+// Nodes and leaves needed for the compiled form of a subtree
+static void buildCount(struct lpmBuild *node, unsigned int *nodes, unsigned int *leaves)
+{
+    unsigned int    loop;
+    int             prev = -1;
+
+    (*nodes)++;
+    for (loop = 0; loop < LPM_FANOUT; loop++)
+    {
+        if (node->child[loop])
+            buildCount(node->child[loop], nodes, leaves);
+        else if (node->leaf[loop] != prev)
+        {
+            (*leaves)++;
+            prev = node->leaf[loop];
+        }
+    }
+}
+
+// Compile a node into table->nodes[idx], laying its children out together
+// at the end of the node array, and its leaves at the end of the leaves.
+static void buildCompile(struct lpmTable *table, struct lpmBuild *node, unsigned int idx)
+{
+    struct lpmNode  *out = &table->nodes[idx];
+    unsigned int    loop, children = 0, child;
+    int             prev = -1;
+
+    out->vector = 0;
+    out->leafvec = 0;
+    out->base0 = table->leafCount;
+    for (loop = 0; loop < LPM_FANOUT; loop++)
+    {
+        if (node->child[loop])
+        {
+            out->vector |= 1ULL << loop;
+            children++;
+        }
+        else if (node->leaf[loop] != prev)
+        {
+            // A new run of leaves. Child slots in between don't break one.
+            out->leafvec |= 1ULL << loop;
+            table->leaves[table->leafCount++] = node->leaf[loop];
+            prev = node->leaf[loop];
+        }
+    }
+
+    out->base1 = table->nodeCount;
+    table->nodeCount += children;
+    for (loop = 0, child = out->base1; loop < LPM_FANOUT; loop++)
+    {
+        if (node->child[loop])
+            buildCompile(table, node->child[loop], child++);
+    }
+}
+
+static int prefixLenCompare(const void *a, const void *b)
+{
+    return ((struct npd6Prefix *)a)->len - ((struct npd6Prefix *)b)->len;
+}
+
+
+/*****************************************************************************
+ * lpm_build
+ *      Build a table from a list of prefixes.
+ *
+ * Inputs:
+ *  prefixes and how many. Prefix N (from 0) matches with value N+1. Host
+ *  bits beyond each prefix's length are ignored.
+ *
+ * Outputs:
+ *  none
+ *
+ * Return:
+ *      The table, or NULL on failure.
+ */
+struct lpmTable *lpm_build(struct npd6Prefix *prefixes, unsigned int count)
+{
+    struct lpmTable     *table = NULL;
+    struct lpmBuild     *root;
+    struct npd6Prefix   *sorted;
+    unsigned int        loop, nodes = 0, leaves = 0;
+
+    if (count > LPM_MAXPREFIXES)
+    {
+        flog(LOG_ERR, "Too many prefixes (%u) - max is %d", count, LPM_MAXPREFIXES);
+        return NULL;
+    }
+
+    // Shortest first, each remembering its value
+    sorted = malloc(count * sizeof(struct npd6Prefix));
+    root = calloc(1, sizeof(struct lpmBuild));
+    if ( (sorted == NULL) || (root == NULL) )
+        goto out;
+    memcpy(sorted, prefixes, count * sizeof(struct npd6Prefix));
+    for (loop = 0; loop < count; loop++)
+        sorted[loop].value = loop + 1;
+    qsort(sorted, count, sizeof(struct npd6Prefix), prefixLenCompare);
+
+    for (loop = 0; loop < count; loop++)
+    {
+        if (buildInsert(root, &sorted[loop], sorted[loop].value))
+            goto out;
+    }
+
+    buildCount(root, &nodes, &leaves);
+    table = calloc(1, sizeof(struct lpmTable));
+    if (table == NULL)
+        goto out;
+    table->nodes = malloc(nodes * sizeof(struct lpmNode));
+    table->leaves = malloc(leaves * sizeof(uint16_t));
+    if ( (table->nodes == NULL) || (table->leaves == NULL) )
+    {
+        lpm_free(table);
+        table = NULL;
+        goto out;
+    }
+    table->nodeCount = 1;
+    buildCompile(table, root, 0);
+    flog(LOG_DEBUG, "LPM table: %u prefixes, %u nodes, %u leaves", count,
+         table->nodeCount, table->leafCount);
+
+out:
+    if (table == NULL)
+        flog(LOG_ERR, "Failed to build LPM table");
+    if (root)
+        buildFree(root);
+    free(sorted);
+    return table;
+}
+
+
+void lpm_free(struct lpmTable *table)
+{
+    if (table == NULL)
+        return;
+    free(table->nodes);
+    free(table->leaves);
+    free(table);
+}
+
+
+/*****************************************************************************
+ * lpm_setup
+ *      Build an interface's LPM table from its main prefix (value 1) and
+ *      extra prefixes (value 2 onwards), and work out the prefix covering
+ *      all of them. With no extras, just the main prefix is the cover.
+ *
+ * Inputs:
+ *  ifIndex into interfaces[]
+ *
+ * Outputs:
+ *  interfaces[ifIndex].lpm, coverPrefix and coverLen.
+ *
+ * Return:
+ *      0 on success, -1 if the table could not be built.
+ */
+int lpm_setup(int ifIndex)
+{
+    struct npd6Interface    *iface = &interfaces[ifIndex];
+    struct npd6Prefix       *all;
+    unsigned int            loop;
+    int                     bit;
+
+    iface->coverPrefix = iface->prefix;
+    iface->coverLen = iface->prefixLen;
+    iface->lpm = NULL;
+    if (iface->extraCount == 0)
+        return 0;
+
+    all = malloc((iface->extraCount + 1) * sizeof(struct npd6Prefix));
+    if (all == NULL)
+    {
+        flog(LOG_ERR, "malloc failed building LPM table for %s", iface->nameStr);
+        return -1;
+    }
+    all[0].prefix = iface->prefix;
+    all[0].len = iface->prefixLen;
+    memcpy(&all[1], iface->extraPrefixes, iface->extraCount * sizeof(struct npd6Prefix));
+
+    // Cover: shorten until every prefix agrees with the main one
+    for (loop = 1; loop <= iface->extraCount; loop++)
+    {
+        if (all[loop].len < iface->coverLen)
+            iface->coverLen = all[loop].len;
+        for (bit = 0; bit < iface->coverLen; bit++)
+        {
+            if ( (all[loop].prefix.s6_addr[bit/8] ^ all[0].prefix.s6_addr[bit/8])
+                 & (0x80 >> (bit % 8)) )
+            {
+                iface->coverLen = bit;
+                break;
+            }
+        }
+    }
+    memset(&iface->coverPrefix, 0, sizeof(iface->coverPrefix));
+    for (bit = 0; bit < iface->coverLen; bit++)
+        iface->coverPrefix.s6_addr[bit/8] |= iface->prefix.s6_addr[bit/8] & (0x80 >> (bit % 8));
+
+    iface->lpm = lpm_build(all, iface->extraCount + 1);
+    free(all);
+    if (iface->lpm == NULL)
+        return -1;
+
+    flog(LOG_INFO, "Interface %s: %u prefixes, kernel filter on the first %d bits",
+         iface->nameStr, iface->extraCount + 1, iface->coverLen);
+    return 0;
+}
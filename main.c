@@ -24,6 +24,7 @@
 
 #include "includes.h"
 #include "npd6.h"
+#include "cpu.h"
 
 char usage_str[] =
 {
@@ -58,20 +59,16 @@ int main(int argc, char *argv[])
     char logfile[FILENAME_MAX] = "";
     int c, err, loop;
     
+    // Pick the kernels to suit the CPU, before -v might report them
+    cpu_init();
+
     // Default some globals
     strncpy(configfile, NPD6_CONF, FILENAME_MAX);
     daemonize=1;
-    // Default black/whitelisting to OFF
-    listType = NOLIST;
-    // Default config file values as required
-    naLinkOptFlag = 0;
-    nsIgnoreLocal = 1;
-    naRouter = 1;
-    maxHops = MAXMAXHOPS;
-    
-    // Logging
-    listLog=0;
-    ralog=0;
+    pthread_mutex_init(&mainWorker.tLock, NULL);
+    // Config file values are defaulted by readConfig(), bar this one,
+    // which only the first read gets to set
+    eventLoop = LOOP_EPOLL;
     
     /* Interface info */
     interfaceCount = 0;
@@ -129,6 +126,7 @@ int main(int argc, char *argv[])
         exit (1);
     }
     flog(LOG_INFO, "*********************** npd6 *****************************");
+    cpu_log();
     
     if ( readConfig(configfile) )
     {
@@ -172,113 +170,74 @@ int main(int argc, char *argv[])
     return 0;
 }
 
+/*****************************************************************************
+ * dispatcher
+ *  The main loop. Every socket is registered with epoll carrying its own
+ *  npd6Event, so a wakeup only touches the sockets which are ready and
+ *  each knows its interface and handler without any index arithmetic.
+ *
+ * Inputs:
+ *  void
+ *
+ * Outputs:
+ *  Everything, eventually.
+ *
+ * Return:
+ *  Never.
+ */
 void dispatcher(void)
 {
-    struct pollfd   *fds;
-    unsigned int    msglen;
-    unsigned char   msgdata[MAX_MSG_SIZE * 2];
-    int             rc;
-    int             fdIdx;
-    int             consecutivePollErrors = 0;
-    
-    // Each interface has 2 sockets, so we need to allocate for that + 1
-    fds = (struct pollfd *)calloc( (interfaceCount*2)+1, sizeof(struct pollfd) );
-    flog(LOG_DEBUG2, "Dynamically allocated %d bytes to the master FD array", 
-         (interfaceCount+1) * sizeof(struct pollfd) );
-    
-    // In the fds set, the first N positions are for the v6 sockets, the second N
-    // are for the icmpv6 sockets.
-    for(fdIdx=0; fdIdx < interfaceCount; fdIdx++)
+    struct epoll_event  events[MAX_EVENTS];
+    struct npd6Event    *ev;
+    int                 rc, idx;
+
+    // The event loop is chosen once, here. A reload keeps whichever it has.
+    if (eventLoop == LOOP_URING)
     {
-        // Packet socket
-        fds[fdIdx].fd = interfaces[fdIdx].pktSock;
-        flog(LOG_DEBUG2, "pktSock value is: %d", fds[fdIdx].fd );
-        fds[fdIdx].events = POLLIN;
-        fds[fdIdx].revents = 0;
-        
-        // ICMP socket
-        // We only bother with this as we get inbound junk on this socket 
-        // (including RAs which we might actually care about now cf. bug 60)
-        fds[fdIdx+interfaceCount].fd = interfaces[fdIdx].icmpSock;
-        fds[fdIdx+interfaceCount].events = POLLIN;
-        fds[fdIdx+interfaceCount].revents = 0;
+        if (uring_open() == 0)
+        {
+            registerInterfaces();
+            uring_dispatcher();
+        }
+        flog(LOG_ERR, "io_uring not available - using epoll instead.");
     }
-    
-    // Tail it
-    fds[interfaceCount*2].fd = -1;
-    fds[interfaceCount*2].events = 0;
-    fds[interfaceCount*2].revents = 0;
-    
+
+    epollFD = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFD < 0)
+    {
+        flog(LOG_ERR, "epoll_create1 failed: %s", strerror(errno));
+        exit(1);
+    }
+    registerInterfaces();
+
     for (;;)
     {
-        rc = poll(fds, interfaceCount+1, DISPATCH_TIMEOUT);
-        //flog(LOG_DEBUG2, "Came off poll with rc = %d", rc);
+        rc = epoll_wait(epollFD, events, MAX_EVENTS, DISPATCH_TIMEOUT);
+        //flog(LOG_DEBUG2, "Came off epoll_wait with rc = %d", rc);
         
         if (rc > 0)
         {
-            // Most likely event is a valid data item received.
-            for (fdIdx=0; fdIdx < (interfaceCount*2); fdIdx++)
+            for (idx=0; idx < rc; idx++)
             {
-                if (fds[fdIdx].revents & POLLIN)
+                ev = (struct npd6Event *)events[idx].data.ptr;
+
+                // Most likely event is a valid data item received.
+                if (events[idx].events & EPOLLIN)
                 {
-                    // Was it a packet socket?
-                    if(fdIdx < interfaceCount) {
-                        consecutivePollErrors = 0;	// reset it
-                        msglen = get_rx(interfaces[fdIdx].pktSock, msgdata);
-                        // msglen is checked for sanity already within get_rx()
-                        flog(LOG_DEBUG2, "For packet socket, get_rx() gave msg with len = %d", msglen);
-                        processNS(fdIdx, msgdata, msglen);
-                        continue;
-                    }
-                    // Or was it an ICMP socket?
-                    if(fdIdx >= interfaceCount) {
-                        struct in6_addr icmp6Addr;
-                        consecutivePollErrors = 0;	// reset it
-                        msglen = get_rx_icmp6(interfaces[fdIdx/2].icmpSock, msgdata, &icmp6Addr);
-                        flog(LOG_DEBUG2, "For ICMP6 socket, get_rx_icmp6() gave msg with len = %d", msglen);
-                        // We do nothing at all with the received data!
-                        // Or maybe we do.... Ref. bug/NFR 60: process them
-                        // and yank out the RAs for logging.
-                        // Decide what to do based upon config file option ralog
-                        if (ralog) 
-                        {
-                            processICMP(fdIdx, msgdata, msglen, &icmp6Addr);
-                        }
-                        continue;
-                    }
+                    consecutivePollErrors = 0;	// reset it
+                    ev->handler(ev);
+                    continue;
                 }
                 
-                // If it wasn't a POLLIN, it is likely an significant error
-                if (fds[fdIdx].revents & (POLLERR | POLLHUP | POLLNVAL) )
+                // If it wasn't an EPOLLIN, it is likely an significant error
+                if (events[idx].events & (EPOLLERR | EPOLLHUP) )
                 {
-                    flog(LOG_WARNING, "Major socket error on fds %d", fdIdx);
-                    // Try and recover... long shot
-                    close(interfaces[fdIdx].pktSock);
-                    sleep(1);
-                    interfaces[fdIdx].pktSock = open_packet_socket(interfaces[fdIdx].index);
-                    if ( interfaces[fdIdx].pktSock < 0)
-                    {
-                        // Drop dead. We're stuffed.
-                        flog(LOG_ERR, "dispatcher(): failed to reinit stuck socket. Dead.");
-                        exit(1);
-                    }
-                    fds[fdIdx].fd = interfaces[fdIdx].pktSock;
-                    fds[fdIdx].events = POLLIN;
-                    fds[fdIdx].revents = 0;
-                    
-                    // Have we had more consecutive errors than the threshold value?
-                    consecutivePollErrors++;
-                    if ((pollErrorLimit > 0) && (consecutivePollErrors >= pollErrorLimit) )
-                    {
-                        flog(LOG_ERR, "dispatcher(): %d consecutive major poll errors. Terminating.",
-                             consecutivePollErrors);
-                        dropdead();
-                    }
-                    
+                    recoverSocket(ev);
                     continue;
                 }
             }
-            continue;
+            // Send the NAs that batch produced
+            flush_all_tx();
         }
         else if ( rc == 0 )
         {
@@ -286,23 +245,383 @@ void dispatcher(void)
             consecutivePollErrors = 0; // Using the select timeout as our quantum of error counting
             // Timer fired?
             // One day. If we implement timers.
+            flog(LOG_DEBUG, "Timed out of epoll_wait(). Timeout was %d ms", DISPATCH_TIMEOUT);
         }
         else if ( rc == -1 )
         {
             /* Truly an error or maybe we processed a signal?*/
             if ( errno == EINTR )
             {
-                flog(LOG_ERR, "Broke out of the poll() via a signal event.");
+                flog(LOG_ERR, "Broke out of the epoll_wait() via a signal event.");
             }
             else
             {
-                flog(LOG_ERR, "Weird poll error: %s", strerror(errno));
+                flog(LOG_ERR, "Weird epoll_wait error: %s", strerror(errno));
             }
-            continue;
         }
-        
-        flog(LOG_DEBUG, "Timed out of poll(). Timeout was %d ms", DISPATCH_TIMEOUT);
+
+        // Signals which need more than a signal handler should do
+        if (reloadPending)
+        {
+            reloadPending = 0;
+            reloadConfig();
+        }
+        if (dumpPending)
+        {
+            dumpPending = 0;
+            dumpAddressData();
+            dumpStats();
+        }
+    }
+}
+
+
+/*****************************************************************************
+ * registerInterfaces
+ *  Adds both sockets of every interface to the dispatcher's epoll set,
+ *  each with an npd6Event pointing back at its interface and handler.
+ *
+ * Inputs:
+ *  interfaces[] with sockets open.
+ *
+ * Outputs:
+ *  epollFD has the sockets added.
+ *
+ * Return:
+ *  void - failure is fatal.
+ */
+void registerInterfaces(void)
+{
+    int loop;
+
+    for (loop=0; loop < interfaceCount; loop++)
+    {
+        // Packet socket
+        interfaces[loop].pktEvent.iface = &interfaces[loop];
+        interfaces[loop].pktEvent.fd = interfaces[loop].pktSock;
+        interfaces[loop].pktEvent.handler = handlePktSock;
+        flog(LOG_DEBUG2, "pktSock value is: %d", interfaces[loop].pktSock);
+
+        // ICMP socket
+        // We only bother with this as we get inbound junk on this socket 
+        // (including RAs which we might actually care about now cf. bug 60)
+        interfaces[loop].icmpEvent.iface = &interfaces[loop];
+        interfaces[loop].icmpEvent.fd = interfaces[loop].icmpSock;
+        interfaces[loop].icmpEvent.handler = handleIcmpSock;
+
+        // No packet socket of our own if workers have them
+        if ( ( (interfaces[loop].pktSock >= 0) && registerEvent(&interfaces[loop].pktEvent) ) ||
+             registerEvent(&interfaces[loop].icmpEvent) )
+        {
+            flog(LOG_ERR, "Failed to register sockets for %s. Dead.", interfaces[loop].nameStr);
+            exit(1);
+        }
+    }
+}
+
+
+/*****************************************************************************
+ * registerEvent
+ *  Adds a single npd6Event to the epoll set, or arms it on the io_uring
+ *  if that is what we're using.
+ *
+ * Inputs:
+ *  ev, with fd already set.
+ *
+ * Outputs:
+ *  epollFD updated.
+ *
+ * Return:
+ *  0 on success, else -1
+ */
+int registerEvent(struct npd6Event *ev)
+{
+    struct epoll_event  epev;
+
+    if (uring_active())
+        return uring_arm(ev);
+
+    memset(&epev, 0, sizeof(epev));
+    epev.events = EPOLLIN;
+    epev.data.ptr = ev;
+    if (epoll_ctl(epollFD, EPOLL_CTL_ADD, ev->fd, &epev) < 0)
+    {
+        flog(LOG_ERR, "epoll_ctl(ADD, %d) failed: %s", ev->fd, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+/*****************************************************************************
+ * handlePktSock
+ *  Data is waiting on an interface's packet socket. Pull it in by
+ *  whichever means is configured and process the NS(s).
+ *
+ * Inputs:
+ *  ev is the packet socket's registration.
+ *
+ * Outputs:
+ *  As per processNS().
+ *
+ * Return:
+ *  void
+ */
+void handlePktSock(struct npd6Event *ev)
+{
+    static unsigned char    msgdata[MAX_MSG_SIZE * 2];
+    int                     ifIdx = ev->iface - interfaces;
+    int                     msglen;
+
+    // With AF_XDP or a ring the frames are handled in place
+    if (ev->iface->xsk)
+    {
+        msglen = xdp_rx(ifIdx);
+        flog(LOG_DEBUG2, "For AF_XDP socket, xdp_rx() handled %d frames", msglen);
+        return;
+    }
+    if (ev->iface->ringMap)
+    {
+        msglen = get_rx_ring(ifIdx);
+        flog(LOG_DEBUG2, "For packet socket, get_rx_ring() handled %d frames", msglen);
+        return;
+    }
+    // Or drain the lot in batches
+    if (rxBatch)
+    {
+        msglen = drainSocket(ifIdx, 0);
+        flog(LOG_DEBUG2, "For packet socket, drainSocket() handled %d frames", msglen);
+        return;
+    }
+
+    msglen = get_rx(ev->fd, msgdata);
+    // msglen is checked for sanity already within get_rx()
+    flog(LOG_DEBUG2, "For packet socket, get_rx() gave msg with len = %d", msglen);
+    if (msglen > 0)
+        processNS(ifIdx, msgdata, msglen);
+}
+
+
+/*****************************************************************************
+ * handleIcmpSock
+ *  Data is waiting on an interface's ICMPv6 socket.
+ *
+ * Inputs:
+ *  ev is the ICMPv6 socket's registration.
+ *
+ * Outputs:
+ *  As per processICMP().
+ *
+ * Return:
+ *  void
+ */
+void handleIcmpSock(struct npd6Event *ev)
+{
+    static unsigned char    msgdata[MAX_MSG_SIZE * 2];
+    int                     ifIdx = ev->iface - interfaces;
+    int                     msglen;
+    struct in6_addr         icmp6Addr;
+
+    if (rxBatch)
+    {
+        msglen = drainSocket(ifIdx, 1);
+        flog(LOG_DEBUG2, "For ICMP6 socket, drainSocket() handled %d msgs", msglen);
+        return;
+    }
+
+    msglen = get_rx_icmp6(ev->fd, msgdata, &icmp6Addr);
+    flog(LOG_DEBUG2, "For ICMP6 socket, get_rx_icmp6() gave msg with len = %d", msglen);
+    // We do nothing at all with the received data!
+    // Or maybe we do.... Ref. bug/NFR 60: process them
+    // and yank out the RAs for logging.
+    // Decide what to do based upon config file option ralog
+    if (ralog && (msglen > 0))
+    {
+        processICMP(ifIdx, msgdata, msglen, &icmp6Addr);
+    }
+}
+
+
+/*****************************************************************************
+ * recoverSocket
+ *  A socket reported an error or hangup. Close and reopen it, then
+ *  re-register it. Gives up entirely if this keeps happening.
+ *
+ * Inputs:
+ *  ev is the failed socket's registration.
+ *
+ * Outputs:
+ *  The socket in the interface and ev is replaced.
+ *
+ * Return:
+ *  void
+ */
+void recoverSocket(struct npd6Event *ev)
+{
+    struct npd6Interface    *iface = ev->iface;
+    int                     ifIdx = iface - interfaces;
+    int                     isPkt = (ev == &iface->pktEvent);
+
+    flog(LOG_WARNING, "Major socket error on %s %s socket (fd %d)",
+         iface->nameStr, isPkt ? "packet" : "ICMP6", ev->fd);
+
+    // Try and recover... long shot
+    if (isPkt)
+    {
+        close_xdp_socket(ifIdx);
+        close_rx_ring(ifIdx);
     }
+    // Closing it also takes it out of the epoll set
+    close(ev->fd);
+    sleep(1);
+    if (isPkt)
+    {
+        if (iface->opts.xdp)
+            iface->pktSock = open_xdp_socket(ifIdx);
+        else
+            iface->pktSock = open_packet_socket(ifIdx);
+        if ( (iface->pktSock >= 0) && !iface->xsk && iface->opts.rxRing && (open_rx_ring(ifIdx) < 0) )
+            iface->pktSock = -1;
+        ev->fd = iface->pktSock;
+    }
+    else
+    {
+        iface->icmpSock = open_icmpv6_socket();
+        ev->fd = iface->icmpSock;
+    }
+
+    if ( (ev->fd < 0) || registerEvent(ev) )
+    {
+        // Drop dead. We're stuffed.
+        flog(LOG_ERR, "failed to reinit stuck socket. Dead.");
+        exit(1);
+    }
+
+    // Have we had more consecutive errors than the threshold value?
+    consecutivePollErrors++;
+    if ((pollErrorLimit > 0) && (consecutivePollErrors >= pollErrorLimit) )
+    {
+        flog(LOG_ERR, "%d consecutive major poll errors. Terminating.",
+             consecutivePollErrors);
+        dropdead();
+    }
+}
+
+
+/*****************************************************************************
+ * reloadConfig
+ *  Carries out a SIGUSR1 config re-read. Done from the dispatcher loop
+ *  rather than the signal handler, as the interfaces, their sockets and
+ *  their epoll registrations all get rebuilt.
+ *
+ * Inputs:
+ *  void
+ *
+ * Outputs:
+ *  interfaces[] and the epoll set replaced.
+ *
+ * Return:
+ *  void - a bad config is fatal, as it always has been.
+ */
+void reloadConfig(void)
+{
+    struct npd6Interface    *oldInterfaces = interfaces;
+    int                     loop, usingUring = uring_active();
+
+    flog(LOG_INFO, "SIGUSR1 received: rereading config");
+
+    // Tear down the old interfaces. Closing takes them out of epoll; an
+    // io_uring has to go first, as it holds on to the sockets.
+    stop_workers();
+    if (usingUring)
+        uring_close();
+    for (loop=0; loop < interfaceCount; loop++)
+    {
+        if_allmulti(interfaces[loop].nameStr, interfaces[loop].multiStatus);
+        close_xdp_socket(loop);
+        close_rx_ring(loop);
+        close_tx_ring(loop);
+        lpm_free(interfaces[loop].lpm);
+        free(interfaces[loop].extraPrefixes);
+        close(interfaces[loop].pktSock);
+        close(interfaces[loop].icmpSock);
+    }
+
+    if ( readConfig(configfile) )
+    {
+        flog(LOG_ERR, "Error in config file: %s", configfile);
+        exit(1);
+    }
+    free(oldInterfaces);
+
+    if (init_sockets())
+    {
+        flog(LOG_ERR, "init_sockets: failed after config reload. Dead.");
+        exit(1);
+    }
+    for (loop=0; loop < interfaceCount; loop++)
+    {
+        interfaces[loop].multiStatus = if_allmulti(interfaces[loop].nameStr, TRUE);
+    }
+    if ( usingUring && uring_open() )
+    {
+        flog(LOG_ERR, "io_uring: failed after config reload. Dead.");
+        exit(1);
+    }
+    registerInterfaces();
+}
+
+
+/*****************************************************************************
+ * drainSocket
+ *  Pulls everything waiting on one of an interface's sockets in batches
+ *  via recvmmsg(), without blocking, and handles each message. Stops when
+ *  the socket runs dry or the rxBatch budget for this wakeup is spent.
+ *
+ * Inputs:
+ *  ifIdx is the index into interfaces[].
+ *  icmp selects the icmpSock rather than the pktSock.
+ *
+ * Outputs:
+ *  As per processNS() or processICMP().
+ *
+ * Return:
+ *  Number of messages handled.
+ */
+int drainSocket(int ifIdx, int icmp)
+{
+    static struct rxBatch   batch;
+    int                     sock, got, idx, handled = 0;
+    struct sockaddr_in6     *from;
+
+    sock = icmp ? interfaces[ifIdx].icmpSock : interfaces[ifIdx].pktSock;
+
+    while (handled < rxBatch)
+    {
+        got = get_rx_batch(sock, &batch, rxBatch - handled);
+        if (got <= 0)
+            break;
+
+        for (idx = 0; idx < got; idx++)
+        {
+            if (!icmp)
+            {
+                processNS(ifIdx, batch.data[idx], batch.msgs[idx].msg_len);
+            }
+            else if (ralog)
+            {
+                from = (struct sockaddr_in6 *)&batch.names[idx];
+                processICMP(ifIdx, batch.data[idx], batch.msgs[idx].msg_len, &from->sin6_addr);
+            }
+        }
+        handled += got;
+
+        // A short batch means the socket is empty
+        if (got < RX_BATCH)
+            break;
+    }
+
+    return handled;
 }
 
 
@@ -54,6 +54,7 @@
 #define MAXMAXHOPS          255
 #define HWADDR_MAX          16
 #define DISPATCH_TIMEOUT    30000          // milliseconds 30000 = 30 sec
+#define MAX_EVENTS          64              // Ready sockets taken per epoll_wait()
 #define flog(pri, ...)      npd6log(__FUNCTION__, pri, __VA_ARGS__)
 #define LOG_DEBUG2          8
 #define USE_FILE            1
@@ -62,6 +63,35 @@
 #define MAXTARGETS          1000000         // Ultimate sane limit
 #define LISTLOGGING         (listLog==1?LOG_INFO:LOG_DEBUG)
 #define NOMASK		    9999
+#define RXRING_BLOCKSIZE    (1 << 16)       // Default TPACKET_V3 block size
+#define RXRING_BLOCKS       16              // Default TPACKET_V3 block count
+#define RXRING_FRAMESIZE    2048
+#define RXRING_RETIRE_TOV   10              // milliseconds before a partial block is handed up
+#define TXRING_BLOCKSIZE    (1 << 16)
+#define TXRING_BLOCKS       4
+#define TXRING_FRAMESIZE    2048
+#define TXRING_WAIT         1               // milliseconds to wait for a free slot
+#define RX_BATCH            32              // Max frames pulled per recvmmsg()
+#define TX_BATCH            32              // Max NAs queued per sendmmsg()
+#define TX_NA_SIZE          64              // Largest NA we build
+#define MAXRXBUDGET         4096
+#define MAXWORKERS          64
+#define WORKER_POLL_TIMEOUT 1000            // ms, how soon a worker notices it should stop
+#define FANOUT_HASH         0
+#define FANOUT_CPU          1
+#define NSFILTER_MAXINSNS   1024            // Generated socket filter
+#define NSFILTER_MAXLIST    16              // Max addrlist entries put in the filter
+#define NSFILTER_MAPSIZE    (1 << 20)       // Max addrlist entries in the eBPF map
+#define FILTER_CLASSIC      0
+#define FILTER_EBPF         1
+#define LOOP_EPOLL          0
+#define LOOP_URING          1
+#define NATX_ICMP           0               // Via the kernel, on icmpSock
+#define NATX_L2             1               // Whole frame, on the packet socket
+#define NATX_TXRING         2               // Whole frame, via a PACKET_TX_RING
+#define XDPMODE_OFF         0
+#define XDPMODE_GENERIC     1               // skb mode, works with any driver
+#define XDPMODE_NATIVE      2               // needs driver support
 //*****************************************************************************
 // Globals
 //
@@ -76,6 +106,68 @@ char            configfile[FILENAME_MAX];
 FILE            *configFileFD;
 int             initialIFFlags;
 
+// Per-interface tunables. If they appear in the config before any interface
+// they set the default, otherwise they apply to the latest interface given.
+struct npd6IfOptions {
+    int             rxRing;             // From config file NPD6RXRING
+    unsigned int    rxRingBlockSize;    // From config file NPD6RINGBSIZE
+    unsigned int    rxRingBlocks;       // From config file NPD6RINGBLOCKS
+    int             xdp;                // From config file NPD6XDP
+    unsigned int    xdpQueue;           // From config file NPD6XDPQUEUE
+    unsigned int    workers;            // From config file NPD6WORKERS
+    int             fanout;             // From config file NPD6FANOUT
+};
+struct npd6IfOptions ifDefaults;
+
+// Dispatcher registration. Every socket we wait on carries one of these
+// as its epoll data, so a ready socket leads straight to its handler.
+struct npd6Interface;
+struct npd6Xsk;
+struct npd6Event {
+    struct npd6Interface    *iface;
+    int                     fd;
+    void                    (*handler)(struct npd6Event *);
+};
+
+// NAs waiting to go out on an ICMPv6 socket, flushed with one sendmmsg()
+// at the end of a batch or when full. Only ever used by one thread.
+struct txQueue {
+    unsigned int            count;
+    struct mmsghdr          msgs[TX_BATCH];
+    struct iovec            iov[TX_BATCH];
+    struct sockaddr_in6     names[TX_BATCH];
+    union {
+        struct cmsghdr      align;
+        char                buf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+    }                       ctrl[TX_BATCH];
+    unsigned char           data[TX_BATCH][TX_NA_SIZE];
+};
+
+// An interface's NA, built once at config load. The target link-layer
+// option variant is the plain NA with the option appended, so both share
+// one buffer. Replies only patch in the target and destination.
+#define NA_NOOPT            0
+#define NA_WITHOPT          1
+struct naTemplate {
+    unsigned int            len[2];         // By NA_NOOPT / NA_WITHOPT
+    uint32_t                sum[2];         // Checksum sums, less the addresses
+    unsigned char           na[TX_NA_SIZE];
+    struct sockaddr_in6     dst;
+    union {
+        struct cmsghdr      align;
+        char                buf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+    }                       ctrl;           // IPV6_PKTINFO
+};
+
+// One of an interface's prefixes. value is lpm_build()'s business.
+struct npd6Prefix {
+    struct in6_addr prefix;
+    int             len;
+    uint16_t        value;
+};
+#define LPM_MAXPREFIXES 65535
+struct lpmTable;
+
 // Record of interfaces, prefix, indices, etc.
 struct npd6Interface {
     char            nameStr[INTERFACE_STRLEN];
@@ -83,10 +175,39 @@ struct npd6Interface {
     char            prefixStr[INET6_ADDRSTRLEN];
     struct in6_addr prefix;
     int             prefixLen;
+    // Further prefixes from NPD6EXTRAPREFIX, and the LPM table (see lpm.c)
+    // over those and the one above. lpm is NULL if there are no extras.
+    struct npd6Prefix *extraPrefixes;
+    unsigned int    extraCount;
+    struct lpmTable *lpm;
+    // Shortest prefix covering all of them, for the kernel-side filters
+    struct in6_addr coverPrefix;
+    int             coverLen;
     unsigned char   linkAddr[6];
+    struct in6_addr linkLocal;          // Source for NAs we build ourselves
     unsigned int    multiStatus;
     int             pktSock;
     int             icmpSock;
+    struct npd6Event pktEvent;
+    struct npd6Event icmpEvent;
+    struct npd6IfOptions opts;
+    // TPACKET_V3 rx ring state, ringMap is NULL if not in use
+    unsigned char   *ringMap;
+    unsigned int    ringBlockSize;
+    unsigned int    ringBlockCount;
+    unsigned int    ringBlockIdx;
+    // TPACKET_V2 tx ring on a socket of its own, txRingMap is NULL if
+    // not in use. Only the dispatcher thread writes to it.
+    int             txSock;
+    unsigned char   *txRingMap;
+    unsigned int    txRingFrames;
+    unsigned int    txRingIdx;
+    unsigned int    txRingPending;      // Written since the last kick
+    // AF_XDP state (see xdp.c), NULL if not in use
+    struct npd6Xsk  *xsk;
+    struct naTemplate naTmpl;
+    // The dispatcher thread's NA queue. Workers have their own.
+    struct txQueue  txq;
 };
 unsigned int    interfaceCount;         // Total number of interface/prefix combos
 // We dynaimcally size this at run-time
@@ -98,32 +219,117 @@ int             nsIgnoreLocal;      // From config file NPD6LOCALIG
 int             naRouter;           // From config file NPD6ROUTERNA
 int             maxHops;            // From config file NPD6MAXHOPS
 int             collectTargets;     // From config file NPD6TARGETS
+unsigned int    targetsHeld;        // In all threads' sets, changed atomically
 
-// Target tree data structures etc
-void            *tRoot;
-int             tCompare(const void *, const void *);
-void            tDump(const void *, const VISIT , const int);
-int             tEntries;
+// A set of addresses, grouped by /64 (see addrset.c). Used for the
+// addrlist and for collected targets.
+#define ADDRSET_GROUP   16              // Slots probed at once
+#define ADDRSET_INLINE  2               // IIDs a group holds without a table
+struct addrGroup {
+    uint64_t        upper;              // The /64, as in the address
+    uint32_t        count;              // IIDs held
+    uint32_t        size;               // Table slots, 0 => inl[] in use
+    union {
+        uint64_t    inl[ADDRSET_INLINE];
+        void        *block;             // Table: ctrl bytes, then IIDs
+    };
+};
+struct addrSet {
+    void            *dirBlock;          // Directory: ctrl, /64s, group indices
+    unsigned int    dirSize;            // Directory slots, a power of 2
+    struct addrGroup *groups;
+    unsigned int    groupCount;
+    unsigned int    groupAlloc;
+    unsigned int    count;              // Addresses held
+};
+struct addrIter {
+    unsigned int    group;
+    unsigned int    slot;
+};
+
+// Counters, kept per thread and summed when dumped
+struct npd6Stats {
+    unsigned long   nsReceived;         // Handed to processNS()
+    unsigned long   nsBadCksum;         // Of those, dropped as corrupt
+    unsigned long   naSent;
+    unsigned long   naErrors;
+    unsigned long   txFlushes;          // sendmmsg() batches and tx ring kicks
+    unsigned long   txRetries;          // Of partially sent batches
+    unsigned long   txRingErrors;       // Failed kicks and rejected frames
+    unsigned long   bloomChecks;        // Blacklist Bloom filter lookups
+    unsigned long   bloomPasses;        // Of those, not ruled out
+    unsigned long   bloomFalsePos;      // Of those, not on the list after all
+};
+
+// Per-thread context. The dispatcher thread has mainWorker, and each
+// worker thread (see worker.c) its own. self is the current thread's.
+struct npd6Worker {
+    pthread_t       thread;
+    int             id;
+    int             ifIdx;
+    int             sock;
+    volatile int    stop;
+    struct addrSet  targets;            // Collected targets
+    pthread_mutex_t tLock;              // Held while targets changes
+    struct npd6Stats stats;
+    struct txQueue  txq;
+    struct npd6Worker *next;
+};
+struct npd6Worker mainWorker;
+struct npd6Worker *workerList;
+extern __thread struct npd6Worker *self;
 
 // Black/whitelisting data
-void            *lRoot;
+struct addrSet  lSet;               // From config file NPD6LISTADDR
 int             listType;
 #define         NOLIST      0
 #define         BLACKLIST   1
 #define         WHITELIST   2
 int             listLog;            // From config file NPD6LISTLOG
+int             socketFilter;       // From config file NPD6SOCKFILTER
+int             naTransmit;         // From config file NPD6NATX
+int             qdiscBypass;        // From config file NPD6QDISCBYPASS
+
+// Batched receive
+int             rxBatch;            // From config file NPD6RXBATCH, 0 => off
+struct rxBatch {
+    struct mmsghdr          msgs[RX_BATCH];
+    struct iovec            iov[RX_BATCH];
+    struct sockaddr_storage names[RX_BATCH];
+    unsigned char           data[RX_BATCH][MAX_MSG_SIZE];
+};
 
 // Logging - various
 int             ralog;              // From config file NPD6RALOG
 
 // Error handling
 int		        pollErrorLimit;     // From config file
+int             consecutivePollErrors;
+
+// Hot kernels, bound at startup by cpu.c to suit the CPU
+int             (*addr6matchImpl)(struct in6_addr *, struct in6_addr *, int);
+int             (*tCompareImpl)(const void *, const void *);
+uint16_t        (*lpmLookupImpl)(struct lpmTable *, const struct in6_addr *);
+int             (*addrsetFindImpl)(struct addrSet *, const struct in6_addr *);
+
+// Dispatcher
+int             eventLoop;          // From config file NPD6EVENTLOOP, used at startup
+int             epollFD;
+volatile sig_atomic_t reloadPending;    // Set by SIGUSR1
+volatile sig_atomic_t dumpPending;      // Set by SIGUSR2
 
 //*****************************************************************************
 // Prototypes
 //
 // main.c
 void    dispatcher(void);
+void    registerInterfaces(void);
+int     registerEvent(struct npd6Event *);
+void    handlePktSock(struct npd6Event *);
+void    handleIcmpSock(struct npd6Event *);
+void    recoverSocket(struct npd6Event *);
+void    reloadConfig(void);
+int     drainSocket(int, int);
 void    showUsage(void);
 
 // config.c
@@ -139,13 +345,14 @@ int     prefixset(char []);
 void    stripwhitespace(char *);
 void    dumpHex(unsigned char *, unsigned int);
 int     getLinkaddress( char *, unsigned char *);
+int     getLinkLocal(char *, struct in6_addr *);
 void    showVersion(void);
 int     openLog(char *);
 void    dropdead(void);
 void    dumpAddressData(void);
 void    storeTarget( struct in6_addr *);
+void    mergeTargets(struct addrSet *);
 int     tCompare(const void *, const void *);
-void    tDump(const void *, const VISIT, const int);
 void    storeListEntry(struct in6_addr *);
 
 
@@ -155,13 +362,73 @@ int     open_packet_socket(int);
 int     open_icmpv6_socket(void);
 int     get_rx(int, unsigned char *);
 int     get_rx_icmp6(int, unsigned char *, struct in6_addr *);
+int     get_rx_batch(int, struct rxBatch *, int);
+int     queue_na(int, struct msghdr *);
+void    flush_tx(int);
+void    flush_all_tx(void);
+int     send_l2_na(int, unsigned char *, struct in6_addr *, struct in6_addr *, int);
 int     if_allmulti(char *, unsigned int);
 int     init_sockets(void);
+int     open_rx_ring(int);
+void    close_rx_ring(int);
+int     get_rx_ring(int);
+int     open_tx_ring(int);
+void    close_tx_ring(int);
+int     put_tx_ring(int, unsigned char *, struct in6_addr *, struct in6_addr *, int);
+void    kick_tx_ring(int);
+
+// filter.c
+int     build_ns_filter(int, int, struct sock_filter *);
+void    sync_list_map(void);
+int     attach_ns_ebpf(int, int);
+
+// worker.c
+int     start_workers(int);
+void    stop_workers(void);
+void    dumpStats(void);
 
 // ip6.c
 void    processNS(int, unsigned char *, unsigned int);
 void	processICMP(int, unsigned char *, unsigned int, struct in6_addr *);
 int     addr6match( struct in6_addr *, struct in6_addr *, int);
+void    build_na_template(int);
+unsigned int build_na_frame(int, unsigned char *, struct in6_addr *, struct in6_addr *, int, unsigned char *);
+
+// xdp.c
+int     open_xdp_socket(int);
+void    close_xdp_socket(int);
+int     xdp_rx(int);
+int     xdp_send_na(int, unsigned char *, struct in6_addr *, struct in6_addr *, int);
+
+// addrlist.c
+int     addrlist_add_block(char *);
+int     addrlist_load_file(char *);
+int     addrlist_build(void);
+int     addrlist_match(const struct in6_addr *);
+int     addrlist_blocks(void);
+void    addrlist_log_stats(struct npd6Stats *);
+void    addrlist_free(void);
+
+// addrset.c
+int     addrset_find(struct addrSet *, const struct in6_addr *);
+int     addrset_add(struct addrSet *, const struct in6_addr *);
+int     addrset_next(struct addrSet *, struct addrIter *, struct in6_addr *);
+size_t  addrset_memory(struct addrSet *);
+void    addrset_free(struct addrSet *);
+
+// lpm.c
+struct lpmTable *lpm_build(struct npd6Prefix *, unsigned int);
+void    lpm_free(struct lpmTable *);
+uint16_t lpm_lookup(struct lpmTable *, const struct in6_addr *);
+int     lpm_setup(int);
+
+// uring.c
+int     uring_open(void);
+void    uring_close(void);
+int     uring_active(void);
+int     uring_arm(struct npd6Event *);
+int     uring_send(int, struct msghdr *);
+void    uring_dispatcher(void);
 
 
 #endif
@@ -36,8 +36,23 @@
 #define NPD6LISTLOG     10
 #define NPD6ERRORTH     11
 #define NPD6RALOG       12
+#define NPD6RXRING      13
+#define NPD6RINGBSIZE   14
+#define NPD6RINGBLOCKS  15
+#define NPD6RXBATCH     16
+#define NPD6XDP         17
+#define NPD6XDPQUEUE    18
+#define NPD6SOCKFILTER  19
+#define NPD6WORKERS     20
+#define NPD6FANOUT      21
+#define NPD6EVENTLOOP   22
+#define NPD6NATX        23
+#define NPD6QDISCBYPASS 24
+#define NPD6CPUVARIANT  25
+#define NPD6EXTRAPREFIX 26
+#define NPD6LISTFILE    27
 
-#define CONFIGTOTAL     13
+#define CONFIGTOTAL     28
 #define NOMATCH         -1
 char *configStrs[CONFIGTOTAL] =
 {
@@ -53,7 +68,22 @@ char *configStrs[CONFIGTOTAL] =
     "exprlist",
     "listlogging",
     "pollErrorLimit",
-    "ralogging"
+    "ralogging",
+    "rxRing",
+    "rxRingBlockSize",
+    "rxRingBlocks",
+    "rxBatch",
+    "xdp",
+    "xdpQueue",
+    "socketFilter",
+    "workers",
+    "fanout",
+    "eventLoop",
+    "naTransmit",
+    "qdiscBypass",
+    "cpuVariant",
+    "extraPrefix",
+    "addrlistFile"
 };
 
 // For logging system
@@ -71,3 +101,19 @@ char *configStrs[CONFIGTOTAL] =
 #define NPD6BLACK       "black"
 #define NPD6WHITE       "white"
 
+#define NPD6GENERIC     "generic"
+#define NPD6NATIVE      "native"
+
+#define NPD6CLASSIC     "classic"
+#define NPD6EBPF        "ebpf"
+
+#define NPD6HASH        "hash"
+#define NPD6CPU         "cpu"
+
+#define NPD6EPOLL       "epoll"
+#define NPD6IOURING     "io_uring"
+
+#define NPD6ICMP        "icmp"
+#define NPD6L2          "l2"
+#define NPD6TXRING      "txring"
+
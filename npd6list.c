@@ -0,0 +1,202 @@
+/*
+ *   This software is Copyright 2011 by Sean Groarke <sgroarke@gmail.com>
+ *   All rights reserved.
+ *
+ *   This file is part of npd6.
+ *
+ *   npd6 is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   npd6 is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with npd6.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* $Id$
+ * $HeadURL$
+ */
+
+/*
+ * npd6list - build a binary addrlist file (see listfile.h) from text.
+ *
+ *      npd6list -o outfile [infile]
+ *
+ * Reads one address per line from infile, or stdin. Blank lines and
+ * lines starting '#' or '//' are skipped, and an "addrlist =" in front
+ * of the address is allowed, so a config file's addrlist lines can be
+ * fed straight in. The file only holds single addresses, though: prefix
+ * (addr/len) and range (addr-addr) entries are skipped with a warning,
+ * and are best left in the config. Duplicates are dropped.
+ *
+ * The output is written to a temporary file and renamed into place, so
+ * a running npd6 reloading at the same time sees the old file or the new
+ * one, never a part-written one.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "listfile.h"
+
+static struct in6_addr  *addrs;
+static struct in6_addr  *tree;
+static size_t           count;
+
+static int addrCompare(const void *a, const void *b)
+{
+    return memcmp(a, b, sizeof(struct in6_addr));
+}
+
+// In-order walk of the implicit tree, handing out the sorted addresses
+static size_t eytzinger(size_t next, size_t k)
+{
+    if (k <= count)
+    {
+        next = eytzinger(next, 2 * k);
+        tree[k] = addrs[next++];
+        next = eytzinger(next, 2 * k + 1);
+    }
+    return next;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: npd6list -o outfile [infile]\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    char                    line[256], *p, *end, *outName = NULL, *tmpName;
+    FILE                    *in = stdin, *out;
+    size_t                  size = 0, lineNo = 0, loop, kept, skipped = 0;
+    struct listFileHeader   header;
+    int                     opt, bad = 0;
+
+    while ((opt = getopt(argc, argv, "o:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'o':
+                outName = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (outName == NULL)
+        usage();
+    if (optind < argc)
+    {
+        in = fopen(argv[optind], "r");
+        if (in == NULL)
+        {
+            fprintf(stderr, "npd6list: %s: %s\n", argv[optind], strerror(errno));
+            return 1;
+        }
+    }
+
+    while (fgets(line, sizeof(line), in))
+    {
+        lineNo++;
+        for (p = line; isspace((unsigned char)*p); p++)
+            ;
+        if ( !strncmp(p, "addrlist", 8) )
+        {
+            for (p += 8; isspace((unsigned char)*p) || (*p == '='); p++)
+                ;
+        }
+        for (end = p + strlen(p); (end > p) && isspace((unsigned char)end[-1]); end--)
+            ;
+        *end = '\0';
+        if ( (*p == '\0') || (*p == '#') || !strncmp(p, "//", 2) )
+            continue;
+        if ( strchr(p, '/') || strchr(p, '-') )
+        {
+            fprintf(stderr, "npd6list: line %zu: skipping prefix or range '%s'\n", lineNo, p);
+            skipped++;
+            continue;
+        }
+
+        if (count == size)
+        {
+            size = size ? size * 2 : 4096;
+            addrs = realloc(addrs, size * sizeof(struct in6_addr));
+            if (addrs == NULL)
+            {
+                fprintf(stderr, "npd6list: out of memory\n");
+                return 1;
+            }
+        }
+        if (inet_pton(AF_INET6, p, &addrs[count]) != 1)
+        {
+            fprintf(stderr, "npd6list: line %zu: bad address '%s'\n", lineNo, p);
+            bad++;
+            continue;
+        }
+        count++;
+    }
+    if (bad)
+        return 1;
+    if (skipped)
+        fprintf(stderr, "npd6list: %zu prefixes and ranges skipped - keep them in the config\n",
+                skipped);
+
+    qsort(addrs, count, sizeof(struct in6_addr), addrCompare);
+    for (loop = 1, kept = count ? 1 : 0; loop < count; loop++)
+    {
+        if (addrCompare(&addrs[loop], &addrs[kept - 1]))
+            addrs[kept++] = addrs[loop];
+    }
+    if (kept != count)
+        fprintf(stderr, "npd6list: %zu duplicates dropped\n", count - kept);
+    count = kept;
+
+    tree = calloc(count + 1, sizeof(struct in6_addr));
+    if (tree == NULL)
+    {
+        fprintf(stderr, "npd6list: out of memory\n");
+        return 1;
+    }
+    eytzinger(0, 1);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LISTFILE_MAGIC, sizeof(header.magic));
+    header.version = LISTFILE_VERSION;
+    header.headerSize = sizeof(header);
+    header.count = count;
+
+    if (asprintf(&tmpName, "%s.tmp", outName) < 0)
+        return 1;
+    out = fopen(tmpName, "w");
+    if ( (out == NULL) ||
+         (fwrite(&header, sizeof(header), 1, out) != 1) ||
+         (fwrite(tree, sizeof(struct in6_addr), count + 1, out) != count + 1) ||
+         fclose(out) )
+    {
+        fprintf(stderr, "npd6list: writing %s: %s\n", tmpName, strerror(errno));
+        unlink(tmpName);
+        return 1;
+    }
+    if (rename(tmpName, outName))
+    {
+        fprintf(stderr, "npd6list: renaming %s: %s\n", tmpName, strerror(errno));
+        unlink(tmpName);
+        return 1;
+    }
+
+    printf("npd6list: %zu addresses written to %s\n", count, outName);
+    return 0;
+}
@@ -0,0 +1,605 @@
+/*
+ *   This software is Copyright 2011 by Sean Groarke <sgroarke@gmail.com>
+ *   All rights reserved.
+ *
+ *   This file is part of npd6.
+ *
+ *   npd6 is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   npd6 is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with npd6.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* $Id$
+ * $HeadURL$
+ */
+
+/*
+ * io_uring alternative to the epoll dispatcher. Every socket has a
+ * multishot receive armed on it, which picks buffers from a ring of
+ * them registered with the kernel, so packets simply turn up as
+ * completions. NAs go out as sendmsg requests, submitted along with the
+ * next wait. A busy interface then costs one system call per batch of
+ * packets rather than several per packet.
+ *
+ * The ring is used only from the dispatcher thread. As with ebpf.c, we
+ * use the system calls directly rather than bring in a library.
+ */
+
+#include "includes.h"
+#include "npd6.h"
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+
+#define URING_ENTRIES       256
+#define URING_BUFS          512             // Must be a power of 2
+#define URING_BUFSIZE       MAX_MSG_SIZE
+#define URING_BGID          0
+#define URING_TXSLOTS       128
+#define URING_TX_TAG        1UL             // Low bit of user_data marks a send
+#define URING_CTRLSIZE      64              // Room for an in6_pktinfo cmsg
+
+// An NA in flight. The kernel reads all of this after we've returned
+// from processNS(), so it all needs to live somewhere.
+struct uringTx {
+    struct msghdr           mhdr;
+    struct iovec            iov;
+    struct sockaddr_in6     name;
+    char __attribute__((aligned(8))) control[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+    unsigned char           data[MAX_PKT_BUFF];
+    struct uringTx          *nextFree;
+};
+
+static struct {
+    int                     fd;
+    unsigned int            entries;
+    // Submission queue
+    unsigned int            *sqHead, *sqTail, *sqMask, *sqArray;
+    struct io_uring_sqe     *sqes;
+    unsigned int            sqLocalTail;
+    unsigned int            toSubmit;
+    // Completion queue
+    unsigned int            *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe     *cqes;
+    // Mappings
+    void                    *sqMap, *cqMap;
+    size_t                  sqMapLen, cqMapLen, sqesLen;
+    // Provided receive buffers
+    struct io_uring_buf_ring *bufRing;
+    size_t                  bufRingLen;
+    unsigned char           *bufs;
+    unsigned short          bufTail;
+    // NA transmit slots
+    struct uringTx          *tx;
+    struct uringTx          *txFree;
+} ur = { .fd = -1 };
+
+// Template for the ICMPv6 sockets' multishot recvmsg. Only the lengths
+// are used.
+static struct msghdr recvmsgTemplate = {
+    .msg_namelen = sizeof(struct sockaddr_in6),
+    .msg_controllen = URING_CTRLSIZE,
+};
+
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int toSubmit, unsigned int minComplete,
+                              unsigned int flags, void *arg, size_t argSize)
+{
+    return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nrArgs)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+
+// Hand a receive buffer (back) to the kernel. Published at the next
+// uring_publish_bufs().
+static void uring_recycle_buf(unsigned short bid)
+{
+    struct io_uring_buf *buf = &ur.bufRing->bufs[ur.bufTail & (URING_BUFS - 1)];
+
+    buf->addr = (unsigned long)(ur.bufs + (size_t)bid * URING_BUFSIZE);
+    buf->len = URING_BUFSIZE;
+    buf->bid = bid;
+    ur.bufTail++;
+}
+
+static void uring_publish_bufs(void)
+{
+    __atomic_store_n(&ur.bufRing->tail, ur.bufTail, __ATOMIC_RELEASE);
+}
+
+
+/*****************************************************************************
+ * uring_open
+ *      Set up the ring, its receive buffers and NA slots.
+ *
+ * Inputs:
+ *  void
+ *
+ * Outputs:
+ *  The ring is ready for uring_arm().
+ *
+ * Return:
+ *      0 on success, otherwise -1
+ */
+int uring_open(void)
+{
+    struct io_uring_params  params;
+    struct io_uring_buf_reg bufReg;
+    unsigned int            loop;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    ur.fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if ( (ur.fd < 0) && (errno == EINVAL) )
+    {
+        // Older kernel - do without the hints
+        memset(&params, 0, sizeof(params));
+        ur.fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    }
+    if (ur.fd < 0)
+    {
+        flog(LOG_ERR, "io_uring_setup failed: %s", strerror(errno));
+        return -1;
+    }
+    if ( !(params.features & IORING_FEAT_EXT_ARG) )
+    {
+        flog(LOG_ERR, "io_uring on this kernel is too old to use.");
+        goto fail;
+    }
+    ur.entries = params.sq_entries;
+
+    // The rings themselves
+    ur.sqMapLen = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ur.cqMapLen = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ur.sqesLen = params.sq_entries * sizeof(struct io_uring_sqe);
+    ur.sqMap = mmap(NULL, ur.sqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ur.fd, IORING_OFF_SQ_RING);
+    ur.cqMap = mmap(NULL, ur.cqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ur.fd, IORING_OFF_CQ_RING);
+    ur.sqes = mmap(NULL, ur.sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ur.fd, IORING_OFF_SQES);
+    if ( (ur.sqMap == MAP_FAILED) || (ur.cqMap == MAP_FAILED) || (ur.sqes == MAP_FAILED) )
+    {
+        flog(LOG_ERR, "mmap of io_uring failed: %s", strerror(errno));
+        goto fail;
+    }
+    ur.sqHead = (unsigned int *)((char *)ur.sqMap + params.sq_off.head);
+    ur.sqTail = (unsigned int *)((char *)ur.sqMap + params.sq_off.tail);
+    ur.sqMask = (unsigned int *)((char *)ur.sqMap + params.sq_off.ring_mask);
+    ur.sqArray = (unsigned int *)((char *)ur.sqMap + params.sq_off.array);
+    ur.cqHead = (unsigned int *)((char *)ur.cqMap + params.cq_off.head);
+    ur.cqTail = (unsigned int *)((char *)ur.cqMap + params.cq_off.tail);
+    ur.cqMask = (unsigned int *)((char *)ur.cqMap + params.cq_off.ring_mask);
+    ur.cqes = (struct io_uring_cqe *)((char *)ur.cqMap + params.cq_off.cqes);
+    ur.sqLocalTail = *ur.sqTail;
+    ur.toSubmit = 0;
+
+    // Receive buffers, and the ring through which the kernel takes them
+    ur.bufs = mmap(NULL, (size_t)URING_BUFS * URING_BUFSIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ur.bufRingLen = URING_BUFS * sizeof(struct io_uring_buf);
+    ur.bufRing = mmap(NULL, ur.bufRingLen, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( (ur.bufs == MAP_FAILED) || (ur.bufRing == MAP_FAILED) )
+    {
+        flog(LOG_ERR, "mmap of io_uring buffers failed: %s", strerror(errno));
+        goto fail;
+    }
+    memset(&bufReg, 0, sizeof(bufReg));
+    bufReg.ring_addr = (unsigned long)ur.bufRing;
+    bufReg.ring_entries = URING_BUFS;
+    bufReg.bgid = URING_BGID;
+    if (sys_io_uring_register(ur.fd, IORING_REGISTER_PBUF_RING, &bufReg, 1) < 0)
+    {
+        flog(LOG_ERR, "io_uring buffer ring registration failed: %s", strerror(errno));
+        goto fail;
+    }
+    ur.bufTail = 0;
+    for (loop = 0; loop < URING_BUFS; loop++)
+        uring_recycle_buf(loop);
+    uring_publish_bufs();
+
+    // NA slots
+    ur.tx = calloc(URING_TXSLOTS, sizeof(struct uringTx));
+    if (ur.tx == NULL)
+    {
+        flog(LOG_ERR, "calloc failed");
+        goto fail;
+    }
+    ur.txFree = NULL;
+    for (loop = 0; loop < URING_TXSLOTS; loop++)
+    {
+        ur.tx[loop].nextFree = ur.txFree;
+        ur.txFree = &ur.tx[loop];
+    }
+
+    flog(LOG_INFO, "io_uring dispatcher: %u entries, %d x %d byte receive buffers",
+         ur.entries, URING_BUFS, URING_BUFSIZE);
+    return 0;
+
+fail:
+    uring_close();
+    return -1;
+}
+
+
+/*****************************************************************************
+ * uring_close
+ *      Tear down the ring. Everything outstanding on it is cancelled.
+ *
+ * Inputs:
+ *  void
+ *
+ * Outputs:
+ *  void
+ *
+ * Return:
+ *      void
+ */
+void uring_close(void)
+{
+    if ( ur.sqMap && (ur.sqMap != MAP_FAILED) )
+        munmap(ur.sqMap, ur.sqMapLen);
+    if ( ur.cqMap && (ur.cqMap != MAP_FAILED) )
+        munmap(ur.cqMap, ur.cqMapLen);
+    if ( ur.sqes && ((void *)ur.sqes != MAP_FAILED) )
+        munmap(ur.sqes, ur.sqesLen);
+    if (ur.fd >= 0)
+        close(ur.fd);
+    // The kernel may still be reading the buffers until it's done
+    // with the ring, so only now let them go.
+    if ( ur.bufs && ((void *)ur.bufs != MAP_FAILED) )
+        munmap(ur.bufs, (size_t)URING_BUFS * URING_BUFSIZE);
+    if ( ur.bufRing && ((void *)ur.bufRing != MAP_FAILED) )
+        munmap(ur.bufRing, ur.bufRingLen);
+    free(ur.tx);
+
+    memset(&ur, 0, sizeof(ur));
+    ur.fd = -1;
+}
+
+
+int uring_active(void)
+{
+    return (ur.fd >= 0);
+}
+
+
+/*****************************************************************************
+ * uring_submit
+ *      Publish whatever SQEs we've filled in and enter the kernel,
+ *      optionally waiting for at least one completion.
+ *
+ * Inputs:
+ *  wait is the longest to wait in ms, 0 for not at all.
+ *
+ * Return:
+ *      As per io_uring_enter().
+ */
+static int uring_submit(int wait)
+{
+    struct io_uring_getevents_arg   arg;
+    struct __kernel_timespec        ts;
+    int                             rc;
+
+    __atomic_store_n(ur.sqTail, ur.sqLocalTail, __ATOMIC_RELEASE);
+
+    if (!wait)
+    {
+        rc = sys_io_uring_enter(ur.fd, ur.toSubmit, 0, 0, NULL, 0);
+    }
+    else
+    {
+        memset(&arg, 0, sizeof(arg));
+        ts.tv_sec = wait / 1000;
+        ts.tv_nsec = (wait % 1000) * 1000000L;
+        arg.ts = (unsigned long)&ts;
+        rc = sys_io_uring_enter(ur.fd, ur.toSubmit, 1,
+                                IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    }
+    if (rc >= 0)
+        ur.toSubmit -= min((unsigned int)rc, ur.toSubmit);
+    return rc;
+}
+
+
+// Next free SQE, zeroed. Submits what's queued if the ring is full.
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int        idx;
+
+    if (ur.sqLocalTail - __atomic_load_n(ur.sqHead, __ATOMIC_ACQUIRE) >= ur.entries)
+    {
+        uring_submit(0);
+        if (ur.sqLocalTail - __atomic_load_n(ur.sqHead, __ATOMIC_ACQUIRE) >= ur.entries)
+            return NULL;
+    }
+
+    idx = ur.sqLocalTail & *ur.sqMask;
+    sqe = &ur.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ur.sqArray[idx] = idx;
+    ur.sqLocalTail++;
+    ur.toSubmit++;
+    return sqe;
+}
+
+
+/*****************************************************************************
+ * uring_arm
+ *      The io_uring equivalent of adding a socket to the epoll set. Arms
+ *      a multishot receive on it: recv for packet sockets, recvmsg for
+ *      ICMPv6 sockets as processICMP() wants the source address. Where
+ *      the packet socket has a ring or is AF_XDP, there's nothing to
+ *      receive as such, so it gets a multishot poll and its usual handler.
+ *
+ * Inputs:
+ *  ev, with fd already set.
+ *
+ * Outputs:
+ *  Request queued, submitted at the next wait.
+ *
+ * Return:
+ *      0 on success, else -1
+ */
+int uring_arm(struct npd6Event *ev)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+
+    if (sqe == NULL)
+    {
+        flog(LOG_ERR, "io_uring submission queue full");
+        return -1;
+    }
+
+    sqe->fd = ev->fd;
+    sqe->user_data = (unsigned long)ev;
+
+    if (ev == &ev->iface->icmpEvent)
+    {
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->addr = (unsigned long)&recvmsgTemplate;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BGID;
+    }
+    else if (ev->iface->ringMap || ev->iface->xsk)
+    {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = POLLIN;
+    }
+    else
+    {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BGID;
+    }
+
+    return 0;
+}
+
+
+/*****************************************************************************
+ * uring_send
+ *      Queue an NA on the ring rather than sending it there and then.
+ *      The message is copied, so the caller's may go out of scope.
+ *
+ * Inputs:
+ *  sock to send on, and the message as it would be given to sendmsg().
+ *
+ * Outputs:
+ *  Request queued, submitted at the next wait.
+ *
+ * Return:
+ *      0 if queued, otherwise -1 and the caller should send it itself.
+ */
+int uring_send(int sock, struct msghdr *mhdr)
+{
+    struct uringTx      *tx = ur.txFree;
+    struct io_uring_sqe *sqe;
+
+    // Only the dispatcher thread uses the ring
+    if ( (ur.fd < 0) || (self != &mainWorker) || (tx == NULL) )
+        return -1;
+    if ( (mhdr->msg_iovlen != 1) || (mhdr->msg_iov[0].iov_len > sizeof(tx->data)) ||
+         (mhdr->msg_namelen > sizeof(tx->name)) || (mhdr->msg_controllen > sizeof(tx->control)) )
+        return -1;
+
+    sqe = uring_get_sqe();
+    if (sqe == NULL)
+        return -1;
+    ur.txFree = tx->nextFree;
+
+    memcpy(tx->data, mhdr->msg_iov[0].iov_base, mhdr->msg_iov[0].iov_len);
+    tx->iov.iov_base = tx->data;
+    tx->iov.iov_len = mhdr->msg_iov[0].iov_len;
+    memcpy(&tx->name, mhdr->msg_name, mhdr->msg_namelen);
+    memcpy(tx->control, mhdr->msg_control, mhdr->msg_controllen);
+    memset(&tx->mhdr, 0, sizeof(tx->mhdr));
+    tx->mhdr.msg_name = &tx->name;
+    tx->mhdr.msg_namelen = mhdr->msg_namelen;
+    tx->mhdr.msg_iov = &tx->iov;
+    tx->mhdr.msg_iovlen = 1;
+    tx->mhdr.msg_control = tx->control;
+    tx->mhdr.msg_controllen = mhdr->msg_controllen;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sock;
+    sqe->addr = (unsigned long)&tx->mhdr;
+    sqe->user_data = (unsigned long)tx | URING_TX_TAG;
+
+    return 0;
+}
+
+
+/*****************************************************************************
+ * uring_complete
+ *      Handle one completion.
+ */
+static void uring_complete(struct io_uring_cqe *cqe)
+{
+    struct npd6Event            *ev;
+    struct uringTx              *tx;
+    struct io_uring_recvmsg_out *out;
+    struct sockaddr_in6         *from;
+    unsigned char               *buf, *payload;
+    unsigned short              bid;
+    int                         ifIdx;
+
+    // An NA sent
+    if (cqe->user_data & URING_TX_TAG)
+    {
+        tx = (struct uringTx *)(unsigned long)(cqe->user_data & ~URING_TX_TAG);
+        tx->nextFree = ur.txFree;
+        ur.txFree = tx;
+        if (cqe->res < 0)
+        {
+            flog(LOG_ERR, "sendmsg returned with error %d = %s", -cqe->res, strerror(-cqe->res));
+            self->stats.naErrors++;
+        }
+        else
+        {
+            self->stats.naSent++;
+        }
+        return;
+    }
+
+    ev = (struct npd6Event *)(unsigned long)cqe->user_data;
+    ifIdx = ev->iface - interfaces;
+
+    if (cqe->res < 0)
+    {
+        switch (-cqe->res)
+        {
+            case ENOBUFS:
+                // We're behind in handing buffers back. Re-armed below.
+                flog(LOG_DEBUG, "io_uring ran out of receive buffers");
+                break;
+            case ECANCELED:
+                return;
+            default:
+                flog(LOG_ERR, "io_uring receive on fd %d failed: %s", ev->fd, strerror(-cqe->res));
+                recoverSocket(ev);
+                return;
+        }
+    }
+    else if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        consecutivePollErrors = 0;
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        buf = ur.bufs + (size_t)bid * URING_BUFSIZE;
+
+        if (ev == &ev->iface->icmpEvent)
+        {
+            out = (struct io_uring_recvmsg_out *)buf;
+            from = (struct sockaddr_in6 *)(out + 1);
+            payload = (unsigned char *)from + recvmsgTemplate.msg_namelen + recvmsgTemplate.msg_controllen;
+            if ( ralog && (out->payloadlen > 0) &&
+                 (payload + out->payloadlen <= buf + cqe->res) )
+            {
+                processICMP(ifIdx, payload, out->payloadlen, &from->sin6_addr);
+            }
+        }
+        else if (cqe->res > 0)
+        {
+            processNS(ifIdx, buf, cqe->res);
+        }
+        uring_recycle_buf(bid);
+    }
+    else
+    {
+        // Poll fired
+        consecutivePollErrors = 0;
+        ev->handler(ev);
+    }
+
+    // Multishot requests end now and then, e.g. out of buffers
+    if ( !(cqe->flags & IORING_CQE_F_MORE) )
+        uring_arm(ev);
+}
+
+
+/*****************************************************************************
+ * uring_dispatcher
+ *      The main loop when using io_uring. Each time round, queued
+ *      requests are submitted and we wait for completions in the same
+ *      system call, then handle every completion there is.
+ *
+ * Inputs:
+ *  void - uring_open() and registerInterfaces() already done.
+ *
+ * Outputs:
+ *  Everything, eventually.
+ *
+ * Return:
+ *  Never.
+ */
+void uring_dispatcher(void)
+{
+    unsigned int    head, tail;
+    int             rc;
+
+    for (;;)
+    {
+        head = *ur.cqHead;
+        tail = __atomic_load_n(ur.cqTail, __ATOMIC_ACQUIRE);
+
+        // Only wait if there's nothing already waiting for us
+        rc = uring_submit( (head == tail) ? DISPATCH_TIMEOUT : 0 );
+        if (rc < 0)
+        {
+            if (errno == ETIME)
+            {
+                flog(LOG_DEBUG, "Timed out of io_uring wait. Timeout was %d ms", DISPATCH_TIMEOUT);
+                consecutivePollErrors = 0;
+            }
+            else if (errno == EINTR)
+                flog(LOG_ERR, "Broke out of the io_uring wait via a signal event.");
+            else
+                flog(LOG_ERR, "Weird io_uring_enter error: %s", strerror(errno));
+        }
+
+        head = *ur.cqHead;
+        tail = __atomic_load_n(ur.cqTail, __ATOMIC_ACQUIRE);
+        for ( ; head != tail; head++)
+            uring_complete(&ur.cqes[head & *ur.cqMask]);
+        __atomic_store_n(ur.cqHead, head, __ATOMIC_RELEASE);
+        uring_publish_bufs();
+        // Anything the ring had no room for
+        flush_all_tx();
+
+        // Signals which need more than a signal handler should do
+        if (reloadPending)
+        {
+            reloadPending = 0;
+            reloadConfig();
+        }
+        if (dumpPending)
+        {
+            dumpPending = 0;
+            dumpAddressData();
+            dumpStats();
+        }
+    }
+}
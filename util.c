@@ -24,6 +24,7 @@
 
 #include "includes.h"
 #include "npd6.h"
+#include "cpu.h"
 
 //*******************************************************
 // When we receive sigusrN, do something awesome.
@@ -48,17 +49,14 @@ void usersignal(int mysig)
         case SIGUSR1:
             signal(SIGUSR1, usersignal);
             flog(LOG_DEBUG, "called with USR1");
-            flog(LOG_INFO, "SIGUSR1 received: rereading config");
-            if ( readConfig(configfile) )
-            {
-                flog(LOG_ERR, "Error in config file: %s", configfile);
-                exit(1);
-            }
+            // Sockets get rebuilt, so leave it to the dispatcher
+            reloadPending = 1;
             break;
          case SIGUSR2:
             signal(SIGUSR2, usersignal);
             flog(LOG_DEBUG, "called with USR2");
-            dumpAddressData();
+            // Workers may be busy with their trees, so leave it to the dispatcher
+            dumpPending = 1;
             break;
         case SIGHUP:
             signal(SIGUSR2, usersignal);
@@ -134,15 +132,16 @@ int npd6log(const char *function, int pri, char *format, ...)
     // Artificial blocking of code to improve efficiency... if the compiler plays ball. :-)
     {
         time_t now;
-        struct tm *timenow;
+        struct tm timenow;
         char timestamp[128], obuff[2048];
         va_list param;
 
         va_start(param, format);
         vsnprintf(obuff, sizeof(obuff), format, param);
         now = time(NULL);
-        timenow = localtime(&now);
-        (void) strftime(timestamp, sizeof(timestamp), LOGTIMEFORMAT, timenow);
+        // Re-entrant, as worker threads log too
+        localtime_r(&now, &timenow);
+        (void) strftime(timestamp, sizeof(timestamp), LOGTIMEFORMAT, &timenow);
 
         switch (logging) {
             case USE_FILE:
@@ -452,6 +451,55 @@ int getLinkaddress( char * iface, unsigned char * link) {
 }
 
 
+/*****************************************************************************
+ * getLinkLocal
+ *  Get the link-local IPv6 address of an interface. If it has several
+ *  we take the first.
+ *
+ * Inputs:
+ *  char * iface
+ *      String containing the interface name (e.g. "eth1")
+ *
+ * Outputs:
+ *  struct in6_addr * addr
+ *      The address, left untouched if none found.
+ *
+ * Return:
+ *  0 is successful,
+ *  1 if error or none found.
+ */
+int getLinkLocal( char * iface, struct in6_addr * addr)
+{
+    struct ifaddrs      *ifaddr, *ifa;
+    struct sockaddr_in6 *sin6;
+    int                 ret = 1;
+
+    if (getifaddrs(&ifaddr) < 0)
+    {
+        flog(LOG_ERR, "getifaddrs failed: %s", strerror(errno));
+        return 1;
+    }
+
+    for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next)
+    {
+        if ( (ifa->ifa_addr == NULL) || (ifa->ifa_addr->sa_family != AF_INET6) ||
+             strcmp(ifa->ifa_name, iface) )
+            continue;
+
+        sin6 = (struct sockaddr_in6 *)ifa->ifa_addr;
+        if (IN6_IS_ADDR_LINKLOCAL(&sin6->sin6_addr))
+        {
+            memcpy(addr, &sin6->sin6_addr, sizeof(struct in6_addr));
+            ret = 0;
+            break;
+        }
+    }
+
+    freeifaddrs(ifaddr);
+    return ret;
+}
+
+
 //*******************************************************
 // Take the supplied filename and open it for logging use.
 // Upon return, logFileFD set unless we failed.
@@ -487,6 +535,7 @@ void showVersion(void)
 {
     printf("npd6 - version %s\n", BUILDREV);
     printf("\nCopyright (C) 2011-2013 Sean Groarke\n\n");
+    cpu_report(stdout);
 }
 
 
@@ -514,99 +563,183 @@ void dropdead(void)
  *  target addresses seen (if that option is enabled)
  *
  * Inputs:
- *  tRoot is the tree of collected targets.
+ *  The sets of collected targets, one per thread.
  *
  * Outputs:
- *  Data is dumped to the defined log.
+ *  Data is dumped to the defined log, in address order.
  *
  * Return:
  *  Void
  */
 void dumpAddressData(void)
 {
+    struct npd6Worker   *worker;
+    struct addrSet      merged, *dumped = &mainWorker.targets;
+    struct addrIter     iter = { 0, 0 };
+    struct in6_addr     addr, *sorted = NULL;
+    char                addressString[INET6_ADDRSTRLEN];
+    size_t              bytes = addrset_memory(&mainWorker.targets);
+    unsigned int        held = mainWorker.targets.count, loop;
+
     if (!collectTargets)
     {
         flog(LOG_INFO, "Not dumping collected addresses - feature disabled via config.");
         return;
     }
 
+    // With no workers there's nothing to merge
+    memset(&merged, 0, sizeof(merged));
+    if (workerList)
+    {
+        dumped = &merged;
+        while (addrset_next(&mainWorker.targets, &iter, &addr))
+            addrset_add(&merged, &addr);
+        // Each worker's set is locked only while it's merged
+        for (worker = workerList; worker; worker = worker->next)
+        {
+            pthread_mutex_lock(&worker->tLock);
+            memset(&iter, 0, sizeof(iter));
+            while ( (merged.count < (unsigned int)collectTargets) &&
+                    addrset_next(&worker->targets, &iter, &addr) )
+                addrset_add(&merged, &addr);
+            bytes += addrset_memory(&worker->targets);
+            held += worker->targets.count;
+            pthread_mutex_unlock(&worker->tLock);
+        }
+    }
+
     flog(LOG_INFO, "====================================");
     flog(LOG_INFO, "Dumping list of targets seen so far:");
     flog(LOG_INFO, "------------------------------------");
 
-    twalk(tRoot, tDump);
+    // The set is in no useful order, so sort a copy
+    if (dumped->count)
+        sorted = malloc(dumped->count * sizeof(struct in6_addr));
+    if (sorted)
+    {
+        memset(&iter, 0, sizeof(iter));
+        for (loop = 0; addrset_next(dumped, &iter, &sorted[loop]); loop++)
+            ;
+        qsort(sorted, dumped->count, sizeof(struct in6_addr), tCompare);
+        for (loop = 0; loop < dumped->count; loop++)
+        {
+            print_addr(&sorted[loop], addressString);
+            flog(LOG_INFO, "Address: %s", addressString);
+        }
+        free(sorted);
+    }
+    else if (dumped->count)
+    {
+        flog(LOG_ERR, "Malloc failed. Dumping unsorted.");
+        memset(&iter, 0, sizeof(iter));
+        while (addrset_next(dumped, &iter, &addr))
+        {
+            print_addr(&addr, addressString);
+            flog(LOG_INFO, "Address: %s", addressString);
+        }
+    }
 
-    if (tEntries == collectTargets)
+    if (__atomic_load_n(&targetsHeld, __ATOMIC_RELAXED) >= (unsigned int)collectTargets)
     {
         flog(LOG_INFO, "(reached the configured limit - there were maybe more.)");
     }
 
-    flog(LOG_INFO, "Total unique targets seen: %d", tEntries);
+    flog(LOG_INFO, "Total unique targets seen: %u", dumped->count);
+    if (held)
+        flog(LOG_INFO, "Target sets: %u entries, %zu bytes, %.1f bytes/entry",
+             held, bytes, (double)bytes / held);
     flog(LOG_INFO, "====================================");
+
+    addrset_free(&merged);
 }
 
 
 /*****************************************************************************
  * storeTarget
- *  Look in tRoot tree to see if we have it already. If we don't store
- *  it in the tree. If we do have it, then ignore.
+ *  Look in this thread's set of targets to see if we have it already. If
+ *  we don't, store it in the set. If we do have it, then ignore.
  *
  * Inputs:
  *  in6_addr *Target - this is the newly seen target to check
  *
  * Outputs:
- *  tRoot has a new item added if the address was new.
+ *  The set has the address added if it was new.
  *
  * Return:
  *  Void
  */
 void storeTarget(struct in6_addr *newTarget)
 {
-    struct in6_addr *ptr;
+    unsigned int    held;
 
-    // Take a permanent copy of the target
-    ptr = (struct in6_addr *)malloc(sizeof(struct in6_addr) );
-    if (!ptr)
+    // Each thread has a set of its own. Lock it against being merged
+    // for a dump while we change it.
+    pthread_mutex_lock(&self->tLock);
+    if ( addrset_find(&self->targets, newTarget) )
     {
-        flog(LOG_ERR, "Malloc failed. Ignoring.");
-	return;
+        flog(LOG_DEBUG2, "Entry already recorded. Ignoring.");
+        pthread_mutex_unlock(&self->tLock);
+        return;
     }
-    memcpy(ptr, newTarget, sizeof(struct in6_addr) );
-
-    // We can't just tsearch() it into the tree, as there's no
-    // way to then know if the entry already existed or is now newly created.
-    // Hence we can't know to bump the count. So we tfind() first
-    // and only tsearch() if required. In a typical net the initial
-    // tfind() is going to return a result almost all the time, so the
-    // overhead of this double-call is actually low.
-    if ( tfind( (void *)ptr, &tRoot, tCompare) == NULL )
+
+    // The limit is on all the sets together, so claim a place first
+    held = __atomic_load_n(&targetsHeld, __ATOMIC_RELAXED);
+    do
     {
-        if (tEntries >= collectTargets)
+        if (held >= (unsigned int)collectTargets)
         {
             flog(LOG_INFO, "Reached max threshold of recorded targets (%d). Not recording.", collectTargets);
+            pthread_mutex_unlock(&self->tLock);
             return;
         }
-        // New entry
-        flog(LOG_DEBUG2, "New entry - recording.");
-        if ( tsearch( (void *)ptr, &tRoot, tCompare) == NULL)
-        {
-            flog(LOG_ERR, "tsearch failed. Cannot record entry.");
-            return;
-        }
-        else
-        {
-            tEntries++;
-        }
+    } while (!__atomic_compare_exchange_n(&targetsHeld, &held, held + 1, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    if ( addrset_add(&self->targets, newTarget) < 0 )
+    {
+        flog(LOG_ERR, "Malloc failed. Cannot record entry.");
+        __atomic_fetch_sub(&targetsHeld, 1, __ATOMIC_RELAXED);
     }
     else
     {
-        flog(LOG_DEBUG2, "Entry already recorded. Ignoring.");
+        flog(LOG_DEBUG2, "New entry - recording.");
+    }
+    pthread_mutex_unlock(&self->tLock);
+}
+
+
+/*****************************************************************************
+ * mergeTargets
+ *  Fold a stopped worker's collected targets into the dispatcher's set,
+ *  without a log line per address. Each was counted when it was stored,
+ *  so this never takes targetsHeld up; one already held is uncounted.
+ *
+ * Inputs:
+ *  set is the worker's targets, emptied here.
+ *
+ * Outputs:
+ *  mainWorker.targets and targetsHeld.
+ *
+ * Return:
+ *  Void
+ */
+void mergeTargets(struct addrSet *set)
+{
+    struct addrIter     iter = { 0, 0 };
+    struct in6_addr     addr;
+
+    while (addrset_next(set, &iter, &addr))
+    {
+        if ( addrset_find(&mainWorker.targets, &addr) ||
+             (addrset_add(&mainWorker.targets, &addr) < 0) )
+            __atomic_fetch_sub(&targetsHeld, 1, __ATOMIC_RELAXED);
     }
+    addrset_free(set);
 }
 
 /*****************************************************************************
  * tCompare
- *  This is the compare fn used by the tree handler.
+ *  This is the compare fn used to sort collected targets for dumping.
  *
  * Inputs:
  *  The two generic pointers are struct in6_addr *.
@@ -615,7 +748,7 @@ void storeTarget(struct in6_addr *newTarget)
  *  None.
  *
  * Return:
- *  0 if item already present, 1 if it was new.
+ *  <0, 0 or >0 as pa sorts before, the same as or after pb.
  *
  * Notes:
  * Need to compare two 128 bit numbers! Yucky.
@@ -627,10 +760,16 @@ void storeTarget(struct in6_addr *newTarget)
  * which is int[16]
  *
  * Needs to be moderately efficient, since if we're recording
- * a lot of addresses we call this via tfind/tsearch quite a lot,
+ * a lot of addresses we call this via qsort quite a lot,
  * so we do minimal-comparison.
  */
 int tCompare(const void *pa, const void *pb)
+{
+    return tCompareImpl(pa, pb);
+}
+
+
+static int tCompare_bytewise(const void *pa, const void *pb)
 {
     int paI=0, pbI=0;
     int idx;
@@ -653,37 +792,26 @@ int tCompare(const void *pa, const void *pb)
 }
 
 
-/*****************************************************************************
- * tDump
- *  This is the action used when walking tRoot from dumpData()
- *
- * Inputs:
- *  node, type of visit, depth - Check the man page for more...
- *
- * Outputs:
- *  Data dumped to log.
- *
- * Return:
- *  void
- */
-void tDump(const void *nodep, const VISIT which, const int depth)
+// Same order, compared a 64-bit half at a time
+static int tCompare_u64(const void *pa, const void *pb)
 {
-    struct in6_addr *data;
-    char addressString[INET6_ADDRSTRLEN];
-
-    switch (which) {
-        case preorder:
-        case endorder:
-            break;
-        case postorder:
-        case leaf:
-            data = *(struct in6_addr **) nodep;
-            print_addr(data, addressString);
-            flog(LOG_INFO, "Address: %s", addressString);
-            break;
-    }
+    uint64_t    wa[2], wb[2];
+
+    memcpy(wa, pa, sizeof(wa));
+    memcpy(wb, pb, sizeof(wb));
+    if (wa[0] != wb[0])
+        return (be64toh(wa[0]) < be64toh(wb[0])) ? -1 : 1;
+    if (wa[1] != wb[1])
+        return (be64toh(wa[1]) < be64toh(wb[1])) ? -1 : 1;
+    return 0;
 }
 
+struct cpuVariant tCompareVariants[] = {
+    { "bytewise",   0,  tCompare_bytewise },
+    { "u64",        0,  tCompare_u64 },
+    { NULL,         0,  NULL }
+};
+
 
 /*****************************************************************************
  * storeListEntry
@@ -692,37 +820,24 @@ void tDump(const void *nodep, const VISIT which, const int depth)
  *  in6_addr *Target - this is the newly seen target to check
  *
  * Outputs:
- *  lRoot has a new item added if the address was new.
+ *  lSet has the address added if it was new.
  *
  * Return:
  *  Void
  */
 void storeListEntry(struct in6_addr *newEntry)
 {
-    struct in6_addr *ptr;
-
-    // Take a permanenet copy of the target
-    ptr = (struct in6_addr *)malloc(sizeof(struct in6_addr) );
-    if (!ptr)
+    switch ( addrset_add(&lSet, newEntry) )
     {
-        flog(LOG_ERR, "Malloc failed. Ignoring.");
-	return;
-    }
-    memcpy(ptr, newEntry, sizeof(struct in6_addr) );
-
-    if ( tfind( (void *)ptr, &lRoot, tCompare) == NULL )
-    {
-        // New entry
-        flog(LOG_DEBUG2, "New list entry");
-        if ( tsearch( (void *)ptr, &lRoot, tCompare) == NULL)
-        {
-            flog(LOG_ERR, "tsearch failed. Cannot record entry.");
-            return;
-        }
-    }
-    else
-    {
-        flog(LOG_ERR, "Dupe list entry. Ignoring.");
+        case 1:
+            flog(LOG_DEBUG2, "New list entry");
+            break;
+        case 0:
+            flog(LOG_ERR, "Dupe list entry. Ignoring.");
+            break;
+        default:
+            flog(LOG_ERR, "Out of memory. Cannot record entry.");
+            break;
     }
 }
 
@@ -0,0 +1,295 @@
+/*
+ *   This software is Copyright 2011 by Sean Groarke <sgroarke@gmail.com>
+ *   All rights reserved.
+ *
+ *   This file is part of npd6.
+ *
+ *   npd6 is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   npd6 is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with npd6.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* $Id$
+ * $HeadURL$
+ */
+
+/*
+ * Worker pool for busy interfaces. Each worker thread has its own packet
+ * socket, all of them members of one PACKET_FANOUT group, so the kernel
+ * shares the interface's NSs out between them. Each runs processNS()
+ * independently, with its own counters and target tree; the dispatcher
+ * thread merges those when asked to dump them.
+ *
+ * The ICMPv6 socket stays with the dispatcher. Workers only send on it,
+ * which is safe to share.
+ */
+
+#include "includes.h"
+#include "npd6.h"
+#include <linux/if_packet.h>
+
+__thread struct npd6Worker  *self = &mainWorker;
+
+
+/*****************************************************************************
+ * worker_main
+ *      A worker thread's loop. Waits on its socket for a short while at a
+ *      time, so that it notices promptly when it is asked to stop.
+ */
+static void *worker_main(void *arg)
+{
+    struct rxBatch          *batch = NULL;
+    unsigned char           *msgdata = NULL;
+    struct pollfd           pfd;
+    int                     got, idx, handled, rc, sockErr;
+    socklen_t               errLen;
+
+    self = arg;
+
+    if (rxBatch)
+        batch = malloc(sizeof(struct rxBatch));
+    else
+        msgdata = malloc(MAX_MSG_SIZE * 2);
+    if ( (batch == NULL) && (msgdata == NULL) )
+    {
+        flog(LOG_ERR, "malloc failed - worker %d on %s not running",
+             self->id, interfaces[self->ifIdx].nameStr);
+        return NULL;
+    }
+
+    pfd.fd = self->sock;
+    pfd.events = POLLIN;
+
+    while (!self->stop)
+    {
+        rc = poll(&pfd, 1, WORKER_POLL_TIMEOUT);
+        if (rc <= 0)
+        {
+            if ( (rc < 0) && (errno != EINTR) )
+                flog(LOG_ERR, "Worker %d poll failed: %s", self->id, strerror(errno));
+            continue;
+        }
+
+        if (pfd.revents & (POLLERR | POLLHUP))
+        {
+            // Reading the error clears it
+            errLen = sizeof(sockErr);
+            getsockopt(self->sock, SOL_SOCKET, SO_ERROR, &sockErr, &errLen);
+            flog(LOG_WARNING, "Worker %d socket error: %s", self->id, strerror(sockErr));
+            continue;
+        }
+
+        if (batch)
+        {
+            for (handled = 0; handled < rxBatch; handled += got)
+            {
+                got = get_rx_batch(self->sock, batch, rxBatch - handled);
+                if (got <= 0)
+                    break;
+                for (idx = 0; idx < got; idx++)
+                    processNS(self->ifIdx, batch->data[idx], batch->msgs[idx].msg_len);
+                if (got < RX_BATCH)
+                    break;
+            }
+        }
+        else
+        {
+            got = get_rx(self->sock, msgdata);
+            if (got > 0)
+                processNS(self->ifIdx, msgdata, got);
+        }
+        flush_tx(self->ifIdx);
+    }
+
+    free(batch);
+    free(msgdata);
+    return NULL;
+}
+
+
+/*****************************************************************************
+ * start_workers
+ *      Start the configured number of workers on an interface, each with
+ *      its own packet socket joined to the interface's fanout group.
+ *
+ * Inputs:
+ *  Index into interfaces[] of the interface.
+ *
+ * Outputs:
+ *  Workers added to workerList.
+ *
+ * Return:
+ *      0 on success, otherwise -1. Any workers started are left running.
+ */
+int start_workers(int ifIdx)
+{
+    struct npd6Interface    *iface = &interfaces[ifIdx];
+    struct npd6Worker       *worker;
+    sigset_t                allSigs, oldSigs;
+    unsigned int            loop;
+    int                     fanoutArg, err;
+
+    fanoutArg = ((getpid() + ifIdx * 0x101) & 0xffff) |
+                (((iface->opts.fanout == FANOUT_CPU) ? PACKET_FANOUT_CPU : PACKET_FANOUT_HASH) << 16);
+
+    // Signals are for the dispatcher thread only
+    sigfillset(&allSigs);
+    pthread_sigmask(SIG_BLOCK, &allSigs, &oldSigs);
+
+    for (loop = 0; loop < iface->opts.workers; loop++)
+    {
+        worker = calloc(1, sizeof(struct npd6Worker));
+        if (worker == NULL)
+        {
+            flog(LOG_ERR, "calloc failed");
+            goto fail;
+        }
+        worker->ifIdx = ifIdx;
+        worker->id = loop;
+        pthread_mutex_init(&worker->tLock, NULL);
+
+        worker->sock = open_packet_socket(ifIdx);
+        if (worker->sock < 0)
+        {
+            free(worker);
+            goto fail;
+        }
+        if (setsockopt(worker->sock, SOL_PACKET, PACKET_FANOUT, &fanoutArg, sizeof(fanoutArg)) < 0)
+        {
+            flog(LOG_ERR, "setsockopt(PACKET_FANOUT) on %s: %s", iface->nameStr, strerror(errno));
+            close(worker->sock);
+            free(worker);
+            goto fail;
+        }
+
+        err = pthread_create(&worker->thread, NULL, worker_main, worker);
+        if (err)
+        {
+            flog(LOG_ERR, "pthread_create failed: %s", strerror(err));
+            close(worker->sock);
+            free(worker);
+            goto fail;
+        }
+
+        worker->next = workerList;
+        workerList = worker;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &oldSigs, NULL);
+    flog(LOG_INFO, "Started %u workers on %s, %s fanout", iface->opts.workers, iface->nameStr,
+         (iface->opts.fanout == FANOUT_CPU) ? "cpu" : "hash");
+    return 0;
+
+fail:
+    pthread_sigmask(SIG_SETMASK, &oldSigs, NULL);
+    return -1;
+}
+
+
+// Add one set of counters into another
+static void addStats(struct npd6Stats *total, struct npd6Stats *stats)
+{
+    total->nsReceived += stats->nsReceived;
+    total->nsBadCksum += stats->nsBadCksum;
+    total->naSent += stats->naSent;
+    total->naErrors += stats->naErrors;
+    total->txFlushes += stats->txFlushes;
+    total->txRetries += stats->txRetries;
+    total->txRingErrors += stats->txRingErrors;
+    total->bloomChecks += stats->bloomChecks;
+    total->bloomPasses += stats->bloomPasses;
+    total->bloomFalsePos += stats->bloomFalsePos;
+}
+
+// One line of dumpStats()
+static void logStats(const char *who, struct npd6Stats *stats)
+{
+    flog(LOG_INFO, "%s: %lu / %lu / %lu / %lu / %lu / %lu / %lu / %lu / %lu / %lu", who,
+         stats->nsReceived, stats->nsBadCksum, stats->naSent, stats->naErrors, stats->txFlushes,
+         stats->txRetries, stats->txRingErrors, stats->bloomChecks, stats->bloomPasses,
+         stats->bloomFalsePos);
+}
+
+
+/*****************************************************************************
+ * stop_workers
+ *      Stop and reap all workers. Their counters and targets are folded
+ *      into the dispatcher thread's, so nothing is lost over a reload.
+ *
+ * Inputs:
+ *  void
+ *
+ * Outputs:
+ *  workerList emptied, mainWorker updated.
+ *
+ * Return:
+ *      void
+ */
+void stop_workers(void)
+{
+    struct npd6Worker   *worker, *next;
+
+    for (worker = workerList; worker; worker = worker->next)
+        worker->stop = 1;
+
+    for (worker = workerList; worker; worker = next)
+    {
+        next = worker->next;
+        pthread_join(worker->thread, NULL);
+        close(worker->sock);
+
+        addStats(&mainWorker.stats, &worker->stats);
+        mergeTargets(&worker->targets);
+
+        pthread_mutex_destroy(&worker->tLock);
+        free(worker);
+    }
+    workerList = NULL;
+}
+
+
+/*****************************************************************************
+ * dumpStats
+ *      Log the counters, per worker and in total.
+ *
+ * Inputs:
+ *  void
+ *
+ * Outputs:
+ *  Data is dumped to the defined log.
+ *
+ * Return:
+ *      void
+ */
+void dumpStats(void)
+{
+    struct npd6Worker   *worker;
+    struct npd6Stats    total = mainWorker.stats;
+    char                who[INTERFACE_STRLEN + 32];
+
+    flog(LOG_INFO, "====================================");
+    flog(LOG_INFO, "NS received / NS bad checksum / NA sent / NA errors / TX flushes / TX retries"
+         " / TX ring errors / Bloom checks / Bloom passes / Bloom false positives:");
+    flog(LOG_INFO, "------------------------------------");
+    logStats("dispatcher", &mainWorker.stats);
+
+    for (worker = workerList; worker; worker = worker->next)
+    {
+        snprintf(who, sizeof(who), "%s worker %d", interfaces[worker->ifIdx].nameStr, worker->id);
+        logStats(who, &worker->stats);
+        addStats(&total, &worker->stats);
+    }
+
+    logStats("Total", &total);
+    addrlist_log_stats(&total);
+    flog(LOG_INFO, "====================================");
+}
@@ -0,0 +1,543 @@
+/*
+ *   This software is Copyright 2011 by Sean Groarke <sgroarke@gmail.com>
+ *   All rights reserved.
+ *
+ *   This file is part of npd6.
+ *
+ *   npd6 is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   npd6 is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with npd6.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* $Id$
+ * $HeadURL$
+ */
+
+/*
+ * AF_XDP receive/transmit backend. A small XDP program on the interface
+ * redirects NSs we might answer into an AF_XDP socket's UMEM, where
+ * processNS() reads them in place. NAs are built straight into spare
+ * UMEM frames and put on the socket's TX ring.
+ *
+ * Generic (skb) mode works on any device, veth included. Native mode
+ * needs driver support.
+ */
+
+#include "includes.h"
+#include "npd6.h"
+#include "ebpf.h"
+#include <linux/if_xdp.h>
+#include <linux/if_link.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#define XDP_FRAME_SIZE      2048
+#define XDP_RX_FRAMES       512         // Owned by the kernel via the fill ring
+#define XDP_TX_FRAMES       256         // Ours, for building NAs in
+#define XDP_RING_SIZE       512         // Must be a power of 2, >= XDP_RX_FRAMES
+#define XDP_BIND_TRIES      20          // 100ms apart
+#define XDP_NS_MINLEN       (ETH_HLEN + sizeof(struct ip6_hdr) + sizeof(struct nd_neighbor_solicit))
+
+struct xskRing {
+    uint32_t        *producer;
+    uint32_t        *consumer;
+    void            *descs;
+    uint32_t        mask;
+    void            *map;
+    size_t          mapLen;
+};
+
+struct npd6Xsk {
+    int             fd;
+    int             mapFd;
+    int             progFd;
+    int             linkFd;
+    unsigned char   *umem;
+    size_t          umemLen;
+    struct xskRing  rx, tx, fill, comp;
+    uint64_t        txFree[XDP_TX_FRAMES];
+    unsigned int    txFreeCount;
+    unsigned int    txPending;
+};
+
+
+/*****************************************************************************
+ * xdp_build_prog
+ *      Assemble the XDP program for an interface. It passes everything
+ *      to the kernel as normal, except NSs whose target lies in the
+ *      interface's prefix, which are redirected to our socket. If
+ *      ignoreLocal is set, NSs with target == destination are left for
+ *      the kernel, as it will answer those itself.
+ *
+ * Inputs:
+ *  ifIdx is the index into interfaces[].
+ *  mapFd is the XSKMAP holding our socket.
+ *
+ * Outputs:
+ *  struct bpf_insn *prog
+ *      The program. Room for EBPF_MAX_INSNS is plenty.
+ *
+ * Return:
+ *      Number of instructions.
+ */
+static unsigned int xdp_build_prog(int ifIdx, int mapFd, struct bpf_insn *prog)
+{
+    struct npd6Interface    *iface = &interfaces[ifIdx];
+    unsigned int            n = 0, j;
+    unsigned int            toPass[16], toRedirect[4];
+    unsigned int            nPass = 0, nRedirect = 0;
+    int                     word, bits;
+    uint32_t                val, mask;
+    unsigned char           maskBytes[4];
+    const int               tgtOff = ETH_HLEN + sizeof(struct ip6_hdr) +
+                                     offsetof(struct nd_neighbor_solicit, nd_ns_target);
+    const int               dstOff = ETH_HLEN + offsetof(struct ip6_hdr, ip6_dst);
+    struct bpf_insn         ldMap[] = { EBPF_LD_MAP_FD(BPF_REG_1, mapFd) };
+
+    // r6 = ctx, r2 = data, r3 = data_end
+    prog[n++] = EBPF_MOV64_REG(BPF_REG_6, BPF_REG_1);
+    prog[n++] = EBPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, data));
+    prog[n++] = EBPF_LDX_MEM(BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct xdp_md, data_end));
+
+    // Long enough to hold an NS?
+    prog[n++] = EBPF_MOV64_REG(BPF_REG_4, BPF_REG_2);
+    prog[n++] = EBPF_ALU64_IMM(BPF_ADD, BPF_REG_4, XDP_NS_MINLEN);
+    toPass[nPass++] = n;
+    prog[n++] = EBPF_JMP_REG(BPF_JGT, BPF_REG_4, BPF_REG_3, 0);
+
+    // IPv6, carrying ICMPv6, which is an NS
+    prog[n++] = EBPF_LDX_MEM(BPF_H, BPF_REG_4, BPF_REG_2, offsetof(struct ethhdr, h_proto));
+    toPass[nPass++] = n;
+    prog[n++] = EBPF_JMP_IMM(BPF_JNE, BPF_REG_4, htons(ETH_P_IPV6), 0);
+    prog[n++] = EBPF_LDX_MEM(BPF_B, BPF_REG_4, BPF_REG_2, ETH_HLEN + offsetof(struct ip6_hdr, ip6_nxt));
+    toPass[nPass++] = n;
+    prog[n++] = EBPF_JMP_IMM(BPF_JNE, BPF_REG_4, IPPROTO_ICMPV6, 0);
+    prog[n++] = EBPF_LDX_MEM(BPF_B, BPF_REG_4, BPF_REG_2, ETH_HLEN + sizeof(struct ip6_hdr));
+    toPass[nPass++] = n;
+    prog[n++] = EBPF_JMP_IMM(BPF_JNE, BPF_REG_4, ND_NEIGHBOR_SOLICIT, 0);
+
+    // Target within the prefix (or the cover of all of them). Words are compared as loaded, i.e. in
+    // network byte order, so the prefix and mask are taken the same way.
+    for (word = 0, bits = iface->coverLen; (word < 4) && (bits > 0); word++, bits -= 32)
+    {
+        memset(maskBytes, 0, sizeof(maskBytes));
+        for (j = 0; j < 32 && (int)j < bits; j++)
+            maskBytes[j/8] |= 0x80 >> (j%8);
+        memcpy(&mask, maskBytes, sizeof(mask));
+        memcpy(&val, &iface->coverPrefix.s6_addr[word*4], sizeof(val));
+        val &= mask;
+
+        prog[n++] = EBPF_LDX_MEM(BPF_W, BPF_REG_4, BPF_REG_2, tgtOff + word*4);
+        if (bits < 32)
+            prog[n++] = EBPF_ALU32_IMM(BPF_AND, BPF_REG_4, mask);
+        toPass[nPass++] = n;
+        prog[n++] = EBPF_JMP32_IMM(BPF_JNE, BPF_REG_4, val, 0);
+    }
+
+    // Leave tgt == dst alone if so configured
+    if (nsIgnoreLocal)
+    {
+        for (word = 0; word < 4; word++)
+        {
+            prog[n++] = EBPF_LDX_MEM(BPF_W, BPF_REG_4, BPF_REG_2, tgtOff + word*4);
+            prog[n++] = EBPF_LDX_MEM(BPF_W, BPF_REG_5, BPF_REG_2, dstOff + word*4);
+            toRedirect[nRedirect++] = n;
+            prog[n++] = EBPF_JMP_REG(BPF_JNE, BPF_REG_4, BPF_REG_5, 0);
+        }
+        toPass[nPass++] = n;
+        prog[n++] = EBPF_JA(0);
+    }
+
+    // Ours: bpf_redirect_map(&xskmap, rx_queue_index, XDP_PASS)
+    for (j = 0; j < nRedirect; j++)
+        prog[toRedirect[j]].off = n - toRedirect[j] - 1;
+    prog[n++] = EBPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, rx_queue_index));
+    prog[n++] = ldMap[0];
+    prog[n++] = ldMap[1];
+    prog[n++] = EBPF_MOV64_IMM(BPF_REG_3, XDP_PASS);
+    prog[n++] = EBPF_CALL(BPF_FUNC_redirect_map);
+    prog[n++] = EBPF_EXIT();
+
+    // Everyone else: carry on as normal
+    for (j = 0; j < nPass; j++)
+        prog[toPass[j]].off = n - toPass[j] - 1;
+    prog[n++] = EBPF_MOV64_IMM(BPF_REG_0, XDP_PASS);
+    prog[n++] = EBPF_EXIT();
+
+    return n;
+}
+
+
+/*****************************************************************************
+ * xdp_map_ring
+ *      mmap one of the socket's four rings and fill in the pointers.
+ *
+ * Return:
+ *      0 on success, otherwise -1
+ */
+static int xdp_map_ring(int fd, struct xdp_ring_offset *off, size_t elemSize,
+                        off_t pgoff, struct xskRing *ring)
+{
+    ring->mapLen = off->desc + XDP_RING_SIZE * elemSize;
+    ring->map = mmap(NULL, ring->mapLen, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (ring->map == MAP_FAILED)
+    {
+        ring->map = NULL;
+        flog(LOG_ERR, "mmap of AF_XDP ring failed: %s", strerror(errno));
+        return -1;
+    }
+    ring->producer = (uint32_t *)((char *)ring->map + off->producer);
+    ring->consumer = (uint32_t *)((char *)ring->map + off->consumer);
+    ring->descs = (char *)ring->map + off->desc;
+    ring->mask = XDP_RING_SIZE - 1;
+    return 0;
+}
+
+
+/*****************************************************************************
+ * open_xdp_socket
+ *      The AF_XDP alternative to open_packet_socket(). Sets up the UMEM
+ *      and rings, binds to the configured queue and attaches the XDP
+ *      program which feeds it.
+ *
+ * Inputs:
+ *  Index into interfaces[] of the interface we're opening it for.
+ *
+ * Outputs:
+ *  interfaces[ifIdx].xsk set up.
+ *
+ * Return:
+ *      int sock on success, otherwise -1
+ */
+int open_xdp_socket(int ifIdx)
+{
+    struct npd6Interface    *iface = &interfaces[ifIdx];
+    struct npd6Xsk          *xsk;
+    struct xdp_umem_reg     umemReg;
+    struct xdp_mmap_offsets offsets;
+    struct sockaddr_xdp     sxdp;
+    struct rlimit           unlimited = { RLIM_INFINITY, RLIM_INFINITY };
+    static struct bpf_insn  prog[EBPF_MAX_INSNS];
+    socklen_t               optlen;
+    int                     ringSize = XDP_RING_SIZE;
+    unsigned int            frame, insns;
+    int                     tries, err = -1;
+    uint32_t                queue = iface->opts.xdpQueue;
+
+    // Older kernels charge UMEM and maps to RLIMIT_MEMLOCK
+    setrlimit(RLIMIT_MEMLOCK, &unlimited);
+
+    xsk = calloc(1, sizeof(*xsk));
+    if (xsk == NULL)
+    {
+        flog(LOG_ERR, "calloc failed");
+        return (-1);
+    }
+    xsk->mapFd = xsk->progFd = xsk->linkFd = -1;
+    iface->xsk = xsk;
+
+    xsk->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (xsk->fd < 0)
+    {
+        flog(LOG_ERR, "Can't create socket(AF_XDP): %s", strerror(errno));
+        goto fail;
+    }
+
+    // The UMEM: RX frames first, then our TX frames
+    xsk->umemLen = (size_t)(XDP_RX_FRAMES + XDP_TX_FRAMES) * XDP_FRAME_SIZE;
+    xsk->umem = mmap(NULL, xsk->umemLen, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (xsk->umem == MAP_FAILED)
+    {
+        xsk->umem = NULL;
+        flog(LOG_ERR, "mmap of UMEM failed: %s", strerror(errno));
+        goto fail;
+    }
+    memset(&umemReg, 0, sizeof(umemReg));
+    umemReg.addr = (unsigned long)xsk->umem;
+    umemReg.len = xsk->umemLen;
+    umemReg.chunk_size = XDP_FRAME_SIZE;
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &umemReg, sizeof(umemReg)) < 0)
+    {
+        flog(LOG_ERR, "setsockopt(XDP_UMEM_REG): %s", strerror(errno));
+        goto fail;
+    }
+
+    if ( (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ringSize, sizeof(ringSize)) < 0) ||
+         (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ringSize, sizeof(ringSize)) < 0) ||
+         (setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING, &ringSize, sizeof(ringSize)) < 0) ||
+         (setsockopt(xsk->fd, SOL_XDP, XDP_TX_RING, &ringSize, sizeof(ringSize)) < 0) )
+    {
+        flog(LOG_ERR, "setsockopt(XDP ring sizes): %s", strerror(errno));
+        goto fail;
+    }
+
+    optlen = sizeof(offsets);
+    if (getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &optlen) < 0)
+    {
+        flog(LOG_ERR, "getsockopt(XDP_MMAP_OFFSETS): %s", strerror(errno));
+        goto fail;
+    }
+    if ( xdp_map_ring(xsk->fd, &offsets.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING, &xsk->rx) ||
+         xdp_map_ring(xsk->fd, &offsets.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING, &xsk->tx) ||
+         xdp_map_ring(xsk->fd, &offsets.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING, &xsk->fill) ||
+         xdp_map_ring(xsk->fd, &offsets.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING, &xsk->comp) )
+    {
+        goto fail;
+    }
+
+    // Give the kernel all the RX frames, and keep the TX ones ourselves
+    for (frame = 0; frame < XDP_RX_FRAMES; frame++)
+        ((uint64_t *)xsk->fill.descs)[frame] = (uint64_t)frame * XDP_FRAME_SIZE;
+    __atomic_store_n(xsk->fill.producer, XDP_RX_FRAMES, __ATOMIC_RELEASE);
+    for (frame = 0; frame < XDP_TX_FRAMES; frame++)
+        xsk->txFree[frame] = (uint64_t)(XDP_RX_FRAMES + frame) * XDP_FRAME_SIZE;
+    xsk->txFreeCount = XDP_TX_FRAMES;
+
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = iface->index;
+    sxdp.sxdp_queue_id = queue;
+    // Generic mode can only copy, native mode takes zero-copy if it can
+    sxdp.sxdp_flags = (iface->opts.xdp == XDPMODE_GENERIC) ? XDP_COPY : 0;
+    // A socket we closed moments ago (reload, recovery) releases the
+    // queue asynchronously, so give it a little while.
+    for (tries = 0; tries < XDP_BIND_TRIES; tries++)
+    {
+        err = bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp));
+        if ( (err == 0) || (errno != EBUSY) )
+            break;
+        usleep(100000);
+    }
+    if (err < 0)
+    {
+        flog(LOG_ERR, "AF_XDP bind to %s queue %u failed: %s",
+             iface->nameStr, queue, strerror(errno));
+        goto fail;
+    }
+
+    // The map the program redirects through, holding just us
+    xsk->mapFd = ebpf_map_create(BPF_MAP_TYPE_XSKMAP, sizeof(uint32_t), sizeof(uint32_t), queue + 1, 0);
+    if (xsk->mapFd < 0)
+        goto fail;
+    if (ebpf_map_update(xsk->mapFd, &queue, &xsk->fd, BPF_ANY) < 0)
+    {
+        flog(LOG_ERR, "XSKMAP update failed: %s", strerror(errno));
+        goto fail;
+    }
+
+    insns = xdp_build_prog(ifIdx, xsk->mapFd, prog);
+    xsk->progFd = ebpf_prog_load(BPF_PROG_TYPE_XDP, prog, insns);
+    if (xsk->progFd < 0)
+        goto fail;
+
+    xsk->linkFd = ebpf_link_xdp(xsk->progFd, iface->index,
+                    (iface->opts.xdp == XDPMODE_GENERIC) ? XDP_FLAGS_SKB_MODE : XDP_FLAGS_DRV_MODE);
+    if (xsk->linkFd < 0)
+        goto fail;
+
+    flog(LOG_INFO, "AF_XDP socket on %s queue %u (%s mode), %u insn XDP program attached",
+         iface->nameStr, queue, (iface->opts.xdp == XDPMODE_GENERIC) ? "generic" : "native", insns);
+
+    return xsk->fd;
+
+fail:
+    if (xsk->fd >= 0)
+        close(xsk->fd);
+    close_xdp_socket(ifIdx);
+    return (-1);
+}
+
+
+/*****************************************************************************
+ * close_xdp_socket
+ *      Detach the XDP program and free everything belonging to an
+ *      interface's AF_XDP socket, apart from the socket itself which,
+ *      as pktSock, is for the caller to close.
+ *
+ * Inputs:
+ *  Index into interfaces[] of the interface.
+ *
+ * Outputs:
+ *  interfaces[ifIdx].xsk freed and cleared.
+ *
+ * Return:
+ *      void
+ */
+void close_xdp_socket(int ifIdx)
+{
+    struct npd6Xsk  *xsk = interfaces[ifIdx].xsk;
+    struct xskRing  *rings[4];
+    int             loop;
+
+    if (xsk == NULL)
+        return;
+
+    if (xsk->linkFd >= 0)
+        close(xsk->linkFd);
+    if (xsk->progFd >= 0)
+        close(xsk->progFd);
+    if (xsk->mapFd >= 0)
+        close(xsk->mapFd);
+
+    rings[0] = &xsk->rx; rings[1] = &xsk->tx; rings[2] = &xsk->fill; rings[3] = &xsk->comp;
+    for (loop = 0; loop < 4; loop++)
+    {
+        if (rings[loop]->map)
+            munmap(rings[loop]->map, rings[loop]->mapLen);
+    }
+    if (xsk->umem)
+        munmap(xsk->umem, xsk->umemLen);
+
+    free(xsk);
+    interfaces[ifIdx].xsk = NULL;
+}
+
+
+/*****************************************************************************
+ * xdp_reap
+ *      Take back TX frames the kernel has finished sending.
+ */
+static void xdp_reap(struct npd6Xsk *xsk)
+{
+    uint32_t    prod, cons;
+    uint64_t    *addrs = xsk->comp.descs;
+
+    prod = __atomic_load_n(xsk->comp.producer, __ATOMIC_ACQUIRE);
+    cons = *xsk->comp.consumer;
+    while ( (cons != prod) && (xsk->txFreeCount < XDP_TX_FRAMES) )
+    {
+        xsk->txFree[xsk->txFreeCount++] = addrs[cons & xsk->comp.mask];
+        cons++;
+    }
+    __atomic_store_n(xsk->comp.consumer, cons, __ATOMIC_RELEASE);
+}
+
+
+/*****************************************************************************
+ * xdp_kick
+ *      Have the kernel send whatever we've queued on the TX ring.
+ */
+static void xdp_kick(struct npd6Xsk *xsk)
+{
+    if (!xsk->txPending)
+        return;
+
+    if (sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0)
+    {
+        if ( (errno != EAGAIN) && (errno != EBUSY) && (errno != ENOBUFS) )
+            flog(LOG_ERR, "AF_XDP TX kick failed: %s", strerror(errno));
+    }
+    xsk->txPending = 0;
+}
+
+
+/*****************************************************************************
+ * xdp_send_na
+ *      Build an NA as a complete Ethernet frame in a free UMEM frame and
+ *      queue it on the TX ring. It goes out at the next xdp_kick().
+ *
+ * Inputs:
+ *  ifIdx is the index into interfaces[].
+ *  dstMac, dstaddr are the solicitor's link and IPv6 addresses.
+ *  targetaddr is the target being advertised.
+ *  withOpt adds the target link-layer address option.
+ *
+ * Outputs:
+ *  NA on the TX ring.
+ *
+ * Return:
+ *      0 if queued, otherwise -1 and the caller should send it by other means.
+ */
+int xdp_send_na(int ifIdx, unsigned char *dstMac, struct in6_addr *dstaddr,
+                struct in6_addr *targetaddr, int withOpt)
+{
+    struct npd6Xsk  *xsk = interfaces[ifIdx].xsk;
+    struct xdp_desc *desc;
+    uint32_t        prod, cons;
+    uint64_t        addr;
+
+    // We need a source address to build the IPv6 header
+    if (IN6_IS_ADDR_UNSPECIFIED(&interfaces[ifIdx].linkLocal))
+        return -1;
+
+    xdp_reap(xsk);
+    if (xsk->txFreeCount == 0)
+    {
+        // Big burst: push out what we have so far and try again
+        xdp_kick(xsk);
+        xdp_reap(xsk);
+    }
+    prod = *xsk->tx.producer;
+    cons = __atomic_load_n(xsk->tx.consumer, __ATOMIC_ACQUIRE);
+    if ( (xsk->txFreeCount == 0) || (prod - cons > xsk->tx.mask) )
+    {
+        flog(LOG_DEBUG, "AF_XDP TX ring full on %s", interfaces[ifIdx].nameStr);
+        return -1;
+    }
+
+    addr = xsk->txFree[--xsk->txFreeCount];
+    desc = &((struct xdp_desc *)xsk->tx.descs)[prod & xsk->tx.mask];
+    desc->addr = addr;
+    desc->len = build_na_frame(ifIdx, dstMac, dstaddr, targetaddr, withOpt, xsk->umem + addr);
+    desc->options = 0;
+    __atomic_store_n(xsk->tx.producer, prod + 1, __ATOMIC_RELEASE);
+    xsk->txPending++;
+
+    return 0;
+}
+
+
+/*****************************************************************************
+ * xdp_rx
+ *      Called from the dispatcher when an interface's AF_XDP socket has
+ *      data. Every frame on the RX ring goes to processNS() in place and
+ *      then straight back on the fill ring. Any NAs produced are sent
+ *      with a single kick at the end.
+ *
+ * Inputs:
+ *  Index into interfaces[] of the interface.
+ *
+ * Outputs:
+ *  As per processNS().
+ *
+ * Return:
+ *      int number of frames handled
+ */
+int xdp_rx(int ifIdx)
+{
+    struct npd6Xsk  *xsk = interfaces[ifIdx].xsk;
+    struct xdp_desc *descs = xsk->rx.descs;
+    uint64_t        *fills = xsk->fill.descs;
+    uint32_t        prod, cons, fillProd;
+    int             frames = 0;
+
+    prod = __atomic_load_n(xsk->rx.producer, __ATOMIC_ACQUIRE);
+    cons = *xsk->rx.consumer;
+    fillProd = *xsk->fill.producer;
+
+    for ( ; cons != prod; cons++, frames++)
+    {
+        struct xdp_desc *desc = &descs[cons & xsk->rx.mask];
+
+        processNS(ifIdx, xsk->umem + desc->addr, desc->len);
+        fills[fillProd++ & xsk->fill.mask] = desc->addr & ~((uint64_t)XDP_FRAME_SIZE - 1);
+    }
+
+    __atomic_store_n(xsk->rx.consumer, cons, __ATOMIC_RELEASE);
+    __atomic_store_n(xsk->fill.producer, fillProd, __ATOMIC_RELEASE);
+
+    xdp_kick(xsk);
+
+    return frames;
+}